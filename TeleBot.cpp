@@ -1,21 +1,646 @@
 #include "TeleBot.h"
 #include <HTTPClient.h>
+#include <Preferences.h>
+#include <limits.h>
+#include <time.h>
+#include <utility>
+
+// Print в String: склейка без промежуточных копий
+class StrPrintTB : public Print {
+  public:
+    StrPrintTB(String &str) : _str(str) {}
+    
+    size_t write(uint8_t c) {
+      _str += (char)c;
+      return 1;
+    }
+    
+    size_t write(const uint8_t* buf, size_t len) {
+      _str.concat((const char*)buf, len);
+      return len;
+    }
+    
+  private:
+    String &_str;
+};
+
+// Копит запрос и отдает клиенту крупными блоками: каждый write()
+// WiFiClientSecure - отдельная TLS запись
+class PackTB : public Print {
+  public:
+    PackTB(Print &out) : _out(out) {}
+    
+    size_t write(uint8_t c) {
+      return write(&c, 1);
+    }
+    
+    size_t write(const uint8_t* buf, size_t len) {
+      size_t done = 0;
+      while (done < len) {
+        if (_pos == sizeof(_buf) && !_drain()) {
+          return done;
+        }
+        size_t n = min(len - done, sizeof(_buf) - _pos);
+        memcpy(_buf + _pos, buf + done, n);
+        _pos += n;
+        done += n;
+      }
+      return done;
+    }
+    
+    bool send() {
+      return _drain() && _ok;
+    }
+    
+    size_t total() {
+      return _total;
+    }
+    
+  private:
+    bool _drain() {
+      if (_pos > 0) {
+        size_t n = _out.write(_buf, _pos);
+        _total += n;
+        if (n != _pos) {
+          _ok = false;
+        }
+      }
+      _pos = 0;
+      return _ok;
+    }
+    
+    Print &_out;
+    uint8_t _buf[TX_BUF_TB];
+    size_t _pos = 0;
+    size_t _total = 0;
+    bool _ok = true;
+};
+
+// CRC32 записей в NVS и на SD
+static uint32_t crcTB(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (uint8_t b = 0; b < 8; b++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
 
 TeleBot::TeleBot(const char* token, WiFiClientSecure &client) 
-    : _token(token), _client(&client) {
+    : _token(token), _client(&client), _poll(&_pollClient) {
+  resetStats();
 }
 
 TeleBot::TeleBot(const char* token) 
-    : _token(token), _client(&_localClient) {
+    : _token(token), _client(&_localClient), _poll(&_pollClient) {
+  resetStats();
+}
+
+TeleBot::~TeleBot() {
+  _stopTask();
+  if (_persist && _doneID != _savedID) {
+    save();
+  }
+  delete _hookServer;
+  delete[] _queue;
+  
+  for (uint16_t i = 0; i < _routeCap; i++) {
+    if (_routes[i].own) {
+      free((void*)_routes[i].name);
+    }
+  }
+  delete[] _routes;
+}
+
+// ==================== HTTP ====================
+
+void HttpTB::reset() {
+  _st = ST_STATUS;
+  _pos = 0;
+  _status = 0;
+  _length = -1;
+  _left = 0;
+  _chunked = false;
+  _close = false;
+  _http10 = false;
+  _ext = false;
+  _request = false;
+  _post = false;
+  _auth = true;
+  _secret = NULL;
+}
+
+// Следующие заголовки - запрос клиента: строка запроса вместо статуса,
+// тело только по Content-Length или chunked
+void HttpTB::request(const char* secret) {
+  _request = true;
+  _secret = (secret != NULL && secret[0]) ? secret : NULL;
+  _auth = _secret == NULL;
+}
+
+void HttpTB::onHeader(HeaderHandlerTB handler) {
+  _handler = handler;
+}
+
+int HttpTB::head(char c) {
+  if (_st != ST_STATUS && _st != ST_HEADER) {
+    return _st == ST_ERROR ? -1 : 1;
+  }
+  _bytes++;
+  
+  if (c == '\r') {
+    return 0;
+  }
+  
+  if (c != '\n') {
+    // Длинные строки обрезаем: нужные нам заголовки короткие
+    if (_pos < sizeof(_buf) - 1) {
+      _buf[_pos++] = c;
+    }
+    return 0;
+  }
+  
+  _buf[_pos] = 0;
+  size_t len = _pos;
+  _pos = 0;
+  
+  if (_st == ST_STATUS && _request) {
+    // METHOD /path HTTP/1.x
+    const char* ver = strstr(_buf, " HTTP/1.");
+    if (ver == NULL) {
+      _st = ST_ERROR;
+      return -1;
+    }
+    _http10 = ver[8] == '0';
+    _close = _http10;
+    _post = strncmp(_buf, "POST ", 5) == 0;
+    _st = ST_HEADER;
+    return 0;
+  }
+  
+  if (_st == ST_STATUS) {
+    // HTTP/1.x NNN Reason
+    if (len < 12 || strncmp(_buf, "HTTP/1.", 7) != 0) {
+      _st = ST_ERROR;
+      return -1;
+    }
+    _http10 = _buf[7] == '0';
+    _close = _http10;
+    _status = atoi(_buf + 9);
+    _st = ST_HEADER;
+    return 0;
+  }
+  
+  if (len > 0) {
+    char* value = strchr(_buf, ':');
+    if (value == NULL) {
+      return 0;
+    }
+    *value++ = 0;
+    while (*value == ' ' || *value == '\t') {
+      value++;
+    }
+    
+    if (strcasecmp(_buf, "content-length") == 0) {
+      _length = atol(value);
+    } else if (strcasecmp(_buf, "transfer-encoding") == 0) {
+      _chunked = strstr(value, "chunked") != NULL;
+    } else if (_secret != NULL && 
+               strcasecmp(_buf, "x-telegram-bot-api-secret-token") == 0) {
+      _auth = strcmp(value, _secret) == 0;
+    } else if (strcasecmp(_buf, "connection") == 0) {
+      if (strncasecmp(value, "close", 5) == 0) {
+        _close = true;
+      } else if (strncasecmp(value, "keep-alive", 10) == 0) {
+        _close = false;
+      }
+    }
+    
+    if (_handler != NULL) {
+      _handler(_buf, value);
+    }
+    return 0;
+  }
+  
+  // Пустая строка: заголовки закончились
+  if (_status >= 100 && _status < 200) {
+    // 100 Continue и подобные - ждем настоящий ответ
+    bool http10 = _http10;
+    reset();
+    _http10 = http10;
+    return 0;
+  }
+  
+  if (_status == 204 || _status == 304) {
+    _st = ST_DONE;
+  } else if (_chunked) {
+    _st = ST_SIZE;
+    _left = 0;
+  } else if (_length >= 0) {
+    _left = _length;
+    _st = _length > 0 ? ST_BODY : ST_DONE;
+  } else if (_request) {
+    // У запроса без длины тела нет
+    _st = ST_DONE;
+  } else {
+    // Ни длины, ни chunked: тело до закрытия сокета
+    _left = -1;
+    _close = true;
+    _st = ST_BODY;
+  }
+  return 1;
+}
+
+int HttpTB::frame(char c) {
+  _bytes++;
+  switch (_st) {
+    case ST_SIZE:
+      if (c == '\n') {
+        _ext = false;
+        _pos = 0;
+        _st = _left > 0 ? ST_DATA : ST_TRAILER;
+        return _left > 0 ? 1 : 0;
+      }
+      if (c == '\r' || _ext) {
+        return 0;
+      }
+      if (c == ';') {
+        _ext = true;
+        return 0;
+      }
+      if (isxdigit((uint8_t)c) && _left < 0x1000000) {
+        _left = _left * 16 + (isdigit((uint8_t)c) ? c - '0' : 
+                                                    (tolower(c) - 'a' + 10));
+        return 0;
+      }
+      _st = ST_ERROR;
+      return -1;
+      
+    case ST_CRLF:
+      if (c == '\n') {
+        _left = 0;
+        _st = ST_SIZE;
+      } else if (c != '\r') {
+        _st = ST_ERROR;
+        return -1;
+      }
+      return 0;
+      
+    case ST_TRAILER:
+      if (c == '\n') {
+        if (_pos == 0) {
+          _st = ST_DONE;
+          return 2;
+        }
+        _pos = 0;
+      } else if (c != '\r') {
+        _pos = 1;
+      }
+      return 0;
+      
+    case ST_DONE:
+      return 2;
+      
+    default:
+      return _st == ST_ERROR ? -1 : 1;
+  }
+}
+
+long HttpTB::data() {
+  if (_st == ST_BODY) {
+    return _left < 0 ? LONG_MAX : _left;
+  }
+  return _st == ST_DATA ? _left : 0;
+}
+
+void HttpTB::consume(size_t n) {
+  _bytes += n;
+  if (_left < 0) {
+    return;
+  }
+  
+  _left -= n;
+  if (_left > 0) {
+    return;
+  }
+  
+  if (_st == ST_BODY) {
+    _st = ST_DONE;
+  } else if (_st == ST_DATA) {
+    _st = ST_CRLF;
+  }
+}
+
+void HttpTB::eof() {
+  // Закрытие сокета - законный конец только для тела без длины
+  _st = (_st == ST_BODY && _left < 0) ? ST_DONE : ST_ERROR;
+}
+
+void HttpTB::fail() {
+  _st = ST_ERROR;
+}
+
+bool HttpTB::inBody() {
+  return _st != ST_STATUS && _st != ST_HEADER;
+}
+
+bool HttpTB::done() {
+  return _st == ST_DONE;
+}
+
+bool HttpTB::failed() {
+  return _st == ST_ERROR;
+}
+
+int HttpTB::status() {
+  return _status;
+}
+
+long HttpTB::length() {
+  return _length;
+}
+
+bool HttpTB::chunked() {
+  return _chunked;
+}
+
+bool HttpTB::close() {
+  return _close;
+}
+
+bool HttpTB::post() {
+  return _post;
+}
+
+bool HttpTB::auth() {
+  return _auth;
+}
+
+uint32_t HttpTB::bytes() {
+  return _bytes;
+}
+
+BodyTB::BodyTB(Client &client, HttpTB &http, unsigned long timeout)
+    : _client(client), _http(http), _wait_ms(timeout) {
+  // Ожидание данных делает сам _next(), повторные попытки Stream не нужны
+  setTimeout(0);
+}
+
+// Довести разбор до байта данных тела: false - тело закончилось
+bool BodyTB::_next() {
+  while (!_http.done() && !_http.failed()) {
+    unsigned long start = millis();
+    while (!_client.available()) {
+      if (!_client.connected()) {
+        _http.eof();
+        return false;
+      }
+      if (millis() - start > _wait_ms) {
+        _http.fail();
+        return false;
+      }
+      delay(1);
+    }
+    
+    if (_http.data() > 0) {
+      return true;
+    }
+    
+    int c = _client.read();
+    if (c < 0 || _http.frame(c) < 0) {
+      return false;
+    }
+  }
+  return false;
+}
+
+int BodyTB::available() {
+  if (_detached) {
+    return _rest.length() - _pos;
+  }
+  long n = _http.data();
+  return n > 0 ? min((long)_client.available(), n) : 0;
+}
+
+int BodyTB::read() {
+  if (_detached) {
+    return _pos < _rest.length() ? (uint8_t)_rest[_pos++] : -1;
+  }
+  if (!_next()) {
+    return -1;
+  }
+  int c = _client.read();
+  if (c >= 0) {
+    _http.consume(1);
+  }
+  return c;
+}
+
+int BodyTB::read(uint8_t* buf, size_t len) {
+  if (_detached) {
+    size_t n = min(len, (size_t)(_rest.length() - _pos));
+    memcpy(buf, _rest.c_str() + _pos, n);
+    _pos += n;
+    return n;
+  }
+  if (!_next()) {
+    return 0;
+  }
+  size_t want = min((long)len, _http.data());
+  int n = _client.read(buf, want);
+  if (n > 0) {
+    _http.consume(n);
+  }
+  return n > 0 ? n : 0;
+}
+
+int BodyTB::peek() {
+  if (_detached) {
+    return _pos < _rest.length() ? (uint8_t)_rest[_pos] : -1;
+  }
+  if (!_next()) {
+    return -1;
+  }
+  return _client.peek();
+}
+
+void BodyTB::skip() {
+  uint8_t buf[64];
+  while (read(buf, sizeof(buf)) > 0) {
+  }
+}
+
+// Дальше тело читается из памяти, а сокет и _http свободны
+// для следующего запроса. Вызывается между апдейтами массива result:
+// в память берутся только целые апдейты, сколько влезет в max, и массив
+// закрывается. Остальные придут в следующем опросе - offset до них
+// не дошел. false - часть пачки отложена
+bool BodyTB::detach(size_t max) {
+  if (_detached) {
+    return true;
+  }
+  
+  if (_http.length() > 0) {
+    _rest.reserve(min((size_t)_http.data(), max));
+  }
+  
+  // Граница апдейта - '}' на уровне массива; строки и экранирование
+  // отслеживаем, чтобы скобки внутри текста не сбивали счет
+  size_t whole = 0;
+  size_t seen = 0;
+  int depth = 0;
+  bool str = false;
+  bool esc = false;
+  bool end = false;
+  char buf[64];
+  int n;
+  while ((n = read((uint8_t*)buf, sizeof(buf))) > 0) {
+    if (!end && seen < max) {
+      _rest.concat(buf, min((size_t)n, max - seen));
+    }
+    for (int i = 0; i < n && !end && seen + i < max; i++) {
+      char c = buf[i];
+      if (str) {
+        if (esc) {
+          esc = false;
+        } else if (c == '\\') {
+          esc = true;
+        } else if (c == '"') {
+          str = false;
+        }
+      } else if (c == '"') {
+        str = true;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if (c == '}' || c == ']') {
+        if (depth == 0) {
+          // ']' самого массива: пачка влезла целиком
+          whole = seen + i + 1;
+          end = true;
+        } else if (--depth == 0) {
+          whole = seen + i + 1;
+        }
+      }
+    }
+    seen += n;
+  }
+  
+  _rest.remove(whole, _rest.length() - whole);
+  if (!end) {
+    _rest += ']';
+  }
+  
+  _detached = true;
+  return end;
+}
+
+BufTB::BufTB(const char* data, size_t len) : _data(data), _len(len) {
+  setTimeout(0);
+}
+
+int BufTB::available() {
+  return _len - _pos;
+}
+
+int BufTB::read() {
+  return _pos < _len ? (uint8_t)_data[_pos++] : -1;
+}
+
+int BufTB::peek() {
+  return _pos < _len ? (uint8_t)_data[_pos] : -1;
+}
+
+void AckTB::reset() {
+  _len = 0;
+  _depth = 0;
+  _str = false;
+  _esc = false;
+  _field = FIELD_NONE;
+  _ok = false;
+  _code = 0;
+}
+
+// Ключи узнаются только на первом уровне: "ok" внутри текста
+// сообщения в result не считается
+void AckTB::feed(char c) {
+  if (_str) {
+    if (_esc) {
+      _esc = false;
+    } else if (c == '\\') {
+      _esc = true;
+    } else if (c == '"') {
+      _str = false;
+      _key[_len] = 0;
+    } else if (_len < sizeof(_key) - 1) {
+      _key[_len++] = c;
+    }
+    return;
+  }
+  
+  switch (c) {
+    case '"':
+      _str = true;
+      _len = 0;
+      _field = FIELD_NONE;
+      break;
+      
+    case ':':
+      if (_depth == 1) {
+        _field = !strcmp(_key, "ok") ? FIELD_OK : 
+                 !strcmp(_key, "error_code") ? FIELD_CODE : FIELD_NONE;
+      }
+      break;
+      
+    case '{':
+    case '[':
+      _depth++;
+      _field = FIELD_NONE;
+      break;
+      
+    case '}':
+    case ']':
+      if (_depth > 0) {
+        _depth--;
+      }
+      _field = FIELD_NONE;
+      break;
+      
+    case ',':
+      _field = FIELD_NONE;
+      break;
+      
+    default:
+      if (_field == FIELD_OK && (c == 't' || c == 'f')) {
+        _ok = c == 't';
+        _field = FIELD_NONE;
+      } else if (_field == FIELD_CODE && isdigit((uint8_t)c)) {
+        _code = _code * 10 + (c - '0');
+      }
+      break;
+  }
+}
+
+bool AckTB::ok() {
+  return _ok;
+}
+
+int AckTB::code() {
+  return _code;
 }
 
 void TeleBot::_initWiFi() {
+  if (_wifiEvents) {
+    return;
+  }
+  _wifiEvents = true;
   WiFi.onEvent([this](WiFiEvent_t event, WiFiEventInfo_t info) {
-    this->_wifiEvent(event);
+    this->_wifiEvent(event, info);
   });
 }
 
-void TeleBot::_wifiEvent(WiFiEvent_t event) {
+void TeleBot::_wifiEvent(WiFiEvent_t event, WiFiEventInfo_t &info) {
   switch(event) {
     case ARDUINO_EVENT_WIFI_STA_CONNECTED:
       if (_debug) Serial.println("WiFi: Connected");
@@ -23,7 +648,14 @@ void TeleBot::_wifiEvent(WiFiEvent_t event) {
       break;
       
     case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
-      if (_debug) Serial.println("WiFi: Disconnected");
+      if (_debug) {
+        Serial.print("WiFi: Disconnected, reason ");
+        Serial.println(info.wifi_sta_disconnected.reason);
+      }
+      // 8 (ASSOC_LEAVE) - это WiFi.begin() сбросил прошлую попытку
+      if (_wifiSt == WIFI_IDLE_TB || info.wifi_sta_disconnected.reason != 8) {
+        _wifiDown = true;
+      }
       _setWiFiStat(WIFI_DISCONNECTED_TB);
       break;
       
@@ -32,11 +664,13 @@ void TeleBot::_wifiEvent(WiFiEvent_t event) {
         Serial.print("IP: ");
         Serial.println(WiFi.localIP());
       }
+      _wifiUp = true;
       _setWiFiStat(WIFI_CONNECTED_TB);
       break;
       
     case ARDUINO_EVENT_WIFI_STA_LOST_IP:
       if (_debug) Serial.println("WiFi: No IP");
+      _wifiDown = true;
       _setWiFiStat(WIFI_DISCONNECTED_TB);
       break;
       
@@ -63,6 +697,16 @@ bool TeleBot::conWiFi(WiFiConfTB &conf) {
   _wifiConf = conf;
   _initWiFi();
   
+  // Основная сеть всегда первая, addAP() добавляет за ней
+  if (_aps[0].ssid == NULL || strcmp(_aps[0].ssid, conf.ssid) != 0) {
+    _aps[0] = ApTB();
+  }
+  _aps[0].ssid = conf.ssid;
+  _aps[0].pass = conf.password;
+  if (_apCount == 0) {
+    _apCount = 1;
+  }
+  
   _setWiFiStat(WIFI_CONNECTING_TB);
   
   if (_debug) {
@@ -82,16 +726,34 @@ bool TeleBot::conWiFi(WiFiConfTB &conf) {
     }
   }
   
+  // Переподключением управляет _wifiStep(), а не драйвер
   WiFi.mode(WIFI_STA);
-  WiFi.begin(conf.ssid, conf.password);
+  WiFi.setAutoReconnect(false);
+  
+  if (_wifiCache.channel == 0) {
+    _wifiLoad();
+  }
+  
+  _wifiOff = false;
+  _wifiSince = millis();
+  _wifiInfo.pause = 0;
+  _wifiRound();
+  
+  // Не ждем: статус обновят события WiFi, дальше ведет loop()
+  if (conf.timeout == 0 || _nonBlock) {
+    return isWiFi();
+  }
   
   unsigned long start = millis();
-  while (WiFi.status() != WL_CONNECTED && millis() - start < conf.timeout) {
-    delay(500);
-    if (_debug) Serial.print(".");
+  while (millis() - start < conf.timeout) {
+    _wifiStep();
+    if (_wifiSt == WIFI_IDLE_TB && isWiFi()) {
+      break;
+    }
+    delay(10);
   }
   
-  if (WiFi.status() == WL_CONNECTED) {
+  if (isWiFi()) {
     _setWiFiStat(WIFI_CONNECTED_TB);
     
     if (_debug) {
@@ -109,494 +771,4349 @@ bool TeleBot::conWiFi(WiFiConfTB &conf) {
   }
 }
 
-bool TeleBot::_setStaticIP() {
-  if (!WiFi.config(_wifiConf.ip, _wifiConf.gateway, 
-                   _wifiConf.subnet, _wifiConf.dns1, _wifiConf.dns2)) {
-    if (_debug) Serial.println("Static IP FAIL!");
+bool TeleBot::addAP(const char* ssid, const char* pass) {
+  // Ячейка 0 - за сетью из conWiFi()
+  uint8_t slot = _apCount > 0 ? _apCount : 1;
+  if (slot >= WIFI_APS_TB) {
+    _error = "Too many AP";
     return false;
   }
+  _aps[slot] = ApTB();
+  _aps[slot].ssid = ssid;
+  _aps[slot].pass = pass;
+  _apCount = slot + 1;
   return true;
 }
 
-void TeleBot::deconWiFi() {
-  WiFi.disconnect(true);
-  _setWiFiStat(WIFI_DISCONNECTED_TB);
-  if (_debug) Serial.println("WiFi OFF");
-}
-
-void TeleBot::callWiFi(WiFiHandlerTB handler) {
-  _wifiHandler = handler;
-}
-
-WiFiStatTB TeleBot::wifiStatus() {
-  return _wifiStat;
-}
-
-bool TeleBot::isWiFi() {
-  return WiFi.status() == WL_CONNECTED;
-}
-
-void TeleBot::autoWiFi(bool enable, unsigned long interval) {
-  _autoReconnect = enable;
-  _reconnectTime = interval;
-}
-
-bool TeleBot::begin() {
-  if (_useDNS) {
-    _client->setInsecure();
+// Один шаг подключения: без задержек, решения по флагам событий
+void TeleBot::_wifiStep() {
+  if (_wifiUp) {
+    _wifiUp = false;
+    _wifiDown = false;
+    _wifiDone();
   }
   
-  if (_debug) {
-    Serial.println("TeleBot started");
-    Serial.print("Token: ");
-    Serial.println(_token);
-  }
+  bool down = _wifiDown;
+  _wifiDown = false;
+  unsigned long now = millis();
   
-  return true;
-}
+  switch (_wifiSt) {
+    case WIFI_IDLE_TB:
+      // Обрыв: сразу новый круг, первая попытка - прямо по кэшу
+      if (!_wifiOff && _autoReconnect && (down || !isWiFi())) {
+        if (_debug) Serial.println("WiFi: reconnect");
+        _wifiSince = now;
+        _wifiInfo.pause = 0;
+        _wifiRound();
+      }
+      break;
+      
+    case WIFI_FAST_TB:
+      if (down || now - _wifiAt > WIFI_FAST_MS_TB) {
+        _wifiNext();
+      }
+      break;
+      
+    case WIFI_TRY_TB:
+      if (down || now - _wifiAt > WIFI_TRY_MS_TB) {
+        _wifiNext();
+      }
+      break;
+      
+    case WIFI_SCAN_TB: {
+      int16_t found = WiFi.scanComplete();
+      if (found == WIFI_SCAN_RUNNING && now - _wifiAt < WIFI_TRY_MS_TB) {
+        break;
+      }
+      _wifiRank(found);
+      WiFi.scanDelete();
+      _wifiTry();
+      break;
+    }
+      
+    case WIFI_PAUSE_TB:
+      if (_wifiOff) {
+        _wifiSt = WIFI_IDLE_TB;
+      } else if (now - _wifiAt >= _wifiInfo.pause) {
+        _wifiRound();
+      }
+      break;
+  }
+}
+
+// Круг попыток: кэш, затем сети по рангу
+void TeleBot::_wifiRound() {
+  _rankCount = 0;
+  _rankPos = 0;
+  
+  if (_wifiCache.channel > 0) {
+    for (uint8_t i = 0; i < _apCount; i++) {
+      // После двух неудач подряд точка из кэша, видимо, сменилась
+      if (_aps[i].ssid != NULL && _aps[i].fail < 2 &&
+          _hash(_aps[i].ssid, strlen(_aps[i].ssid)) == _wifiCache.ssid) {
+        _wifiSt = WIFI_FAST_TB;
+        _wifiBegin(i, _wifiCache.bssid, _wifiCache.channel);
+        return;
+      }
+    }
+  }
+  
+  _wifiScan();
+}
+
+void TeleBot::_wifiScan() {
+  // Одна сеть: выбирать не из чего, WiFi.begin() найдет ее сам
+  if (_apCount == 1) {
+    _rank[0].ap = 0;
+    _rank[0].channel = 0;
+    _rankCount = 1;
+    _wifiTry();
+    return;
+  }
+  
+  _wifiInfo.scans++;
+  WiFi.scanNetworks(true);
+  _wifiAt = millis();
+  _wifiSt = WIFI_SCAN_TB;
+}
+
+// Лучшая точка каждой известной сети: RSSI плюс история
+void TeleBot::_wifiRank(int16_t found) {
+  _rankCount = 0;
+  _rankPos = 0;
+  
+  for (int16_t i = 0; i < found; i++) {
+    String ssid = WiFi.SSID(i);
+    for (uint8_t ap = 0; ap < _apCount; ap++) {
+      if (_aps[ap].ssid == NULL || ssid != _aps[ap].ssid) {
+        continue;
+      }
+      
+      int16_t score = WiFi.RSSI(i) + 5 * min(_aps[ap].ok, (uint8_t)4) - 
+                      10 * min(_aps[ap].fail, (uint8_t)4);
+      
+      uint8_t n = 0;
+      while (n < _rankCount && _rank[n].ap != ap) {
+        n++;
+      }
+      if (n < _rankCount && _rank[n].score >= score) {
+        break;
+      }
+      
+      _rank[n].ap = ap;
+      memcpy(_rank[n].bssid, WiFi.BSSID(i), 6);
+      _rank[n].channel = WiFi.channel(i);
+      _rank[n].score = score;
+      if (n == _rankCount) {
+        _rankCount++;
+      }
+      break;
+    }
+  }
+  
+  // Кандидатов не больше WIFI_APS_TB: сортировка вставками
+  for (uint8_t i = 1; i < _rankCount; i++) {
+    RankTB r = _rank[i];
+    uint8_t j = i;
+    while (j > 0 && _rank[j - 1].score < r.score) {
+      _rank[j] = _rank[j - 1];
+      j--;
+    }
+    _rank[j] = r;
+  }
+  
+  if (_debug) {
+    Serial.print("WiFi: candidates ");
+    Serial.println(_rankCount);
+  }
+}
+
+void TeleBot::_wifiTry() {
+  if (_rankPos < _rankCount) {
+    RankTB &r = _rank[_rankPos];
+    _wifiSt = WIFI_TRY_TB;
+    _wifiBegin(r.ap, r.bssid, r.channel);
+    return;
+  }
+  
+  // Круг не удался: пауза растет вдвое до _reconnectTime
+  unsigned long pause = _wifiInfo.pause * 2;
+  _wifiInfo.pause = min(max(pause, (unsigned long)WIFI_RETRY_TB), _reconnectTime);
+  _wifiAt = millis();
+  _wifiSt = WIFI_PAUSE_TB;
+  
+  if (_debug) {
+    Serial.print("WiFi: retry in ");
+    Serial.println(_wifiInfo.pause);
+  }
+}
+
+void TeleBot::_wifiNext() {
+  _wifiInfo.failed++;
+  if (_aps[_wifiAp].fail < 255) {
+    _aps[_wifiAp].fail++;
+  }
+  
+  if (_wifiSt == WIFI_FAST_TB) {
+    _wifiScan();
+  } else {
+    _rankPos++;
+    _wifiTry();
+  }
+}
+
+void TeleBot::_wifiBegin(uint8_t ap, const uint8_t* bssid, uint16_t channel) {
+  _wifiAp = ap;
+  _wifiAt = millis();
+  _wifiInfo.attempts++;
+  
+  // Адрес из кэша - только для прямой попытки, иначе снова DHCP.
+  // Шаг ставится до WiFi.begin(): события могут прийти сразу
+  if (!_wifiConf.staticIP) {
+    if (_wifiSt == WIFI_FAST_TB && _wifiConf.fastIP && _wifiCache.ip != 0) {
+      WiFi.config(IPAddress(_wifiCache.ip), IPAddress(_wifiCache.gateway),
+                  IPAddress(_wifiCache.subnet), IPAddress(_wifiCache.dns));
+      _wifiIP = true;
+    } else if (_wifiIP) {
+      WiFi.config(IPAddress(), IPAddress(), IPAddress());
+      _wifiIP = false;
+    }
+  }
+  
+  if (_debug) {
+    Serial.print("WiFi: try ");
+    Serial.print(_aps[ap].ssid);
+    Serial.print(" ch ");
+    Serial.println(channel);
+  }
+  
+  WiFi.begin(_aps[ap].ssid, _aps[ap].pass, channel, channel > 0 ? bssid : NULL);
+}
+
+// Подключились: история сети, кэш точки, сброс паузы
+void TeleBot::_wifiDone() {
+  // Драйвер мог подключиться и без нас - ищем сеть по имени
+  if (_wifiSt == WIFI_IDLE_TB) {
+    String ssid = WiFi.SSID();
+    for (uint8_t i = 0; i < _apCount; i++) {
+      if (_aps[i].ssid != NULL && ssid == _aps[i].ssid) {
+        _wifiAp = i;
+      }
+    }
+  } else {
+    _wifiInfo.lastMs = millis() - _wifiSince;
+  }
+  
+  if (_wifiSt == WIFI_FAST_TB) {
+    _wifiInfo.fast++;
+  }
+  
+  ApTB &ap = _aps[_wifiAp];
+  if (ap.ok < 255) {
+    ap.ok++;
+  }
+  ap.fail = 0;
+  _wifiSt = WIFI_IDLE_TB;
+  _wifiInfo.pause = 0;
+  
+  if (ap.ssid == NULL) {
+    return;
+  }
+  
+  WiFiCacheTB cache;
+  cache.ssid = _hash(ap.ssid, strlen(ap.ssid));
+  uint8_t* bssid = WiFi.BSSID();
+  if (bssid != NULL) {
+    memcpy(cache.bssid, bssid, 6);
+  }
+  cache.channel = WiFi.channel();
+  cache.ip = WiFi.localIP();
+  cache.gateway = WiFi.gatewayIP();
+  cache.subnet = WiFi.subnetMask();
+  cache.dns = WiFi.dnsIP(0);
+  
+  // NVS пишется только когда точка или адрес сменились
+  if (memcmp(&cache, &_wifiCache, sizeof(cache)) != 0) {
+    _wifiCache = cache;
+    _wifiSave();
+  }
+}
+
+// Кэш в NVS: прямое подключение работает и после перезагрузки
+struct WiFiRecTB {
+  uint32_t magic;
+  WiFiCacheTB cache;
+  uint32_t crc;
+};
+
+#define WIFI_MAGIC_TB 0x31574254   // "TBW1"
+
+bool TeleBot::_wifiLoad() {
+  WiFiRecTB rec;
+  Preferences prefs;
+  if (!prefs.begin("telebot", true)) {
+    return false;
+  }
+  size_t got = prefs.getBytes("wifi", &rec, sizeof(rec));
+  prefs.end();
+  
+  if (got != sizeof(rec) || rec.magic != WIFI_MAGIC_TB ||
+      rec.crc != crcTB((const uint8_t*)&rec, offsetof(WiFiRecTB, crc))) {
+    return false;
+  }
+  _wifiCache = rec.cache;
+  return true;
+}
+
+bool TeleBot::_wifiSave() {
+  WiFiRecTB rec;
+  rec.magic = WIFI_MAGIC_TB;
+  rec.cache = _wifiCache;
+  rec.crc = crcTB((const uint8_t*)&rec, offsetof(WiFiRecTB, crc));
+  
+  Preferences prefs;
+  if (!prefs.begin("telebot", false)) {
+    return false;
+  }
+  size_t put = prefs.putBytes("wifi", &rec, sizeof(rec));
+  prefs.end();
+  return put == sizeof(rec);
+}
+
+bool TeleBot::_setStaticIP() {
+  if (!WiFi.config(_wifiConf.ip, _wifiConf.gateway, 
+                   _wifiConf.subnet, _wifiConf.dns1, _wifiConf.dns2)) {
+    if (_debug) Serial.println("Static IP FAIL!");
+    return false;
+  }
+  return true;
+}
+
+void TeleBot::deconWiFi() {
+  _wifiOff = true;
+  _wifiSt = WIFI_IDLE_TB;
+  WiFi.disconnect(true);
+  _setWiFiStat(WIFI_DISCONNECTED_TB);
+  if (_debug) Serial.println("WiFi OFF");
+}
+
+void TeleBot::callWiFi(WiFiHandlerTB handler) {
+  _wifiHandler = handler;
+}
+
+WiFiStatTB TeleBot::wifiStatus() {
+  return _wifiStat;
+}
+
+WiFiInfoTB TeleBot::wifiInfo() {
+  return _wifiInfo;
+}
+
+bool TeleBot::isWiFi() {
+  return WiFi.status() == WL_CONNECTED;
+}
+
+void TeleBot::autoWiFi(bool enable, unsigned long interval) {
+  _autoReconnect = enable;
+  _reconnectTime = interval;
+}
+
+bool TeleBot::begin() {
+  if (_debug) {
+    Serial.println("TeleBot started");
+    // Секретная часть токена (после ':') в лог не попадает
+    const char* colon = strchr(_token, ':');
+    Serial.print("Token: ");
+    Serial.write((const uint8_t*)_token, colon ? colon - _token + 1 : 0);
+    Serial.println("***");
+  }
+  
+  // Offset из persist(): сразу подтверждаем его серверу
+  if (_lastID > 0 && _hookServer == NULL && _task == NULL && isWiFi()) {
+    _resume();
+  }
+  
+  return true;
+}
 
 void TeleBot::loop() {
+  // dual(): апдейты уже разобраны задачей сети
+  if (_task != NULL) {
+    _ringDispatch();
+  }
+  
+  if (_persist) {
+    _persistStep();
+  }
+  
+  // Подключение из conWiFi() ведут события и _wifiStep()
+  if (_apCount > 0) {
+    _wifiStep();
+  }
+  
   // Авто-реконнект WiFi
   if (_autoReconnect && !isWiFi()) {
+    // WiFi настроен без conWiFi(): только WiFi.reconnect() по таймеру
     unsigned long now = millis();
-    if (now - _lastTry > _reconnectTime) {
+    if (_apCount == 0 && now - _lastTry > _reconnectTime) {
       if (_debug) Serial.println("Auto WiFi...");
       WiFi.reconnect();
       _lastTry = now;
     }
-    delay(100);
+    if (_pollSt != POLL_IDLE_TB && _task == NULL) {
+      _pollReset(true);
+    }
+    if (!_nonBlock) {
+      delay(100);
+    }
+    return;
+  }
+  
+  // Опросом и очередью бота в хабе управляет TeleBotHub::loop()
+  if (_hub) {
     return;
   }
   
   // Обработка сообщений
   if (isWiFi()) {
+    _drainQueue();
+    _liveStep();
+    if (_aCount > 0) {
+      _pipeBatch();
+    }
+    if (_unacked > 0) {
+      _ackDrain(false);
+    }
+    
+    // Опрос в задаче сети
+    if (_task != NULL) {
+      return;
+    }
+    
+    // Апдейты приходят сами
+    if (_hookServer != NULL) {
+      _hookStep();
+      return;
+    }
+    
+    if (_nonBlock) {
+      _pollStep();
+      return;
+    }
+    
     unsigned long now = millis();
     
     if (now - _lastCheck > _checkTime) {
-      String updates = _getUpdates();
+      _getUpdates();
       _lastCheck = now;
-      
-      if (updates.length() > 0) {
-        if (_debug) {
-          Serial.println("Updates:");
-          Serial.println(updates);
-        }
-        
-        DynamicJsonDocument doc(MAX_MSG_SIZE);
-        DeserializationError error = deserializeJson(doc, updates);
-        
-        if (!error) {
-          JsonArray result = doc["result"];
-          
-          for (JsonObject update : result) {
-            _process(update);
-          }
-        } else if (_debug) {
-          Serial.print("JSON error: ");
-          Serial.println(error.c_str());
-          _error = "JSON error: " + String(error.c_str());
-        }
-      }
     }
   }
 }
 
-String TeleBot::_getUpdates() {
-  String url = "/bot" + String(_token) + "/getUpdates?timeout=5";
+// Пропустить пробелы JSON и подсмотреть следующий символ
+static int peekTB(Stream &body) {
+  int c = body.peek();
+  while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+    body.read();
+    c = body.peek();
+  }
+  return c;
+}
+
+// Разбор ответа getUpdates по одному апдейту прямо из потока:
+// в памяти всегда лежит только текущий апдейт, сколько бы их ни пришло
+bool TeleBot::_dispatch(Stream &body) {
+  // В dual() здесь задача сети, а _error принадлежит loop().
+  // Кольцо создано до запуска задачи и живет дольше нее
+  bool ring = _ring.size() > 0;
   
-  if (_lastID > 0) {
-    url += "&offset=" + String(_lastID + 1);
+  // Пробелы вокруг ':' допустимы в JSON, поэтому ключ и скобку
+  // ищем по отдельности. Если за "result" не ": [", это было
+  // значение, а не ключ - ищем дальше
+  while (true) {
+    if (!body.find("\"result\"")) {
+      if (!ring) {
+        _error = "No result in updates";
+      }
+      return false;
+    }
+    if (peekTB(body) != ':') {
+      continue;
+    }
+    body.read();
+    if (peekTB(body) == '[') {
+      body.read();
+      break;
+    }
   }
   
-  String response = "";
+  // В dual() апдейт разбирается сразу в слот кольца, а арена
+  // принадлежит loop()
+  ArenaDocTB local(ring ? 0 : MAX_MSG_SIZE, 
+                   ArenaAllocTB(ring ? NULL : &_arena));
   
-  if (_client->connect("api.telegram.org", 443)) {
-    _client->println("GET " + url + " HTTP/1.1");
-    _client->println("Host: api.telegram.org");
-    _client->println("Connection: close");
-    _client->println();
+  while (true) {
+    int c = peekTB(body);
+    if (c != '{') {
+      // ']' - пачка закончилась
+      return c == ']';
+    }
+    
+    JsonDocument *slot = &local;
+    if (ring) {
+      slot = _ringSlot();
+      if (slot == NULL) {
+        return false;
+      }
+    }
+    JsonDocument &doc = *slot;
+    
+    // Прошлый раз этот апдейт не влез в документ раньше, чем
+    // разобрался его id: теперь через фильтр читаем только id
+    bool skip = _skipBig;
+    DeserializationError error;
+    if (skip) {
+      StaticJsonDocument<16> filter;
+      filter["update_id"] = true;
+      error = deserializeJson(doc, body, 
+                              DeserializationOption::Filter(filter));
+    } else {
+      error = deserializeJson(doc, body);
+    }
+    
+    if (error) {
+      // Апдейт, который не разбирается сам по себе, пропускаем, иначе
+      // он будет приходить снова и снова. Обрыв, таймаут или усеченное
+      // тело - другое дело: апдейт не получен, offset не двигаем,
+      // и следующий опрос запросит его снова
+      bool bad = !skip && (error == DeserializationError::NoMemory ||
+                           error == DeserializationError::TooDeep ||
+                           error == DeserializationError::InvalidInput);
+      if (bad && doc["update_id"].is<long>()) {
+        _advance(doc["update_id"]);
+      } else if (bad && error == DeserializationError::NoMemory) {
+        // Пачка следующего опроса начнется с этого апдейта
+        _skipBig = true;
+      }
+      
+      if (!ring) {
+        _error = "JSON error: " + String(error.c_str());
+      }
+      if (_debug) {
+        Serial.print("JSON error: ");
+        Serial.println(error.c_str());
+      }
+      return false;
+    }
+    
+    JsonObject update = doc.as<JsonObject>();
+    long update_id = update["update_id"];
+    _advance(update_id);
+    
+    if (skip) {
+      _skipBig = false;
+      if (_debug) {
+        Serial.print("Update skipped: ");
+        Serial.println(update_id);
+      }
+    } else {
+      _pollStats().updates++;
+      
+      // Тело целиком не печатаем: на 115200 бод это сотни мс на апдейт
+      if (_debug) {
+        Serial.print("Update: ");
+        Serial.println(update_id);
+      }
+      
+      if (ring) {
+        _ring.push();
+      } else {
+        _process(update);
+      }
+    }
     
-    unsigned long timeout = millis() + 5000;
-    while (!_client->available() && millis() < timeout) {
-      delay(10);
+    c = body.read();
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+      c = body.read();
     }
     
-    while (_client->available()) {
-      String line = _client->readStringUntil('\n');
-      if (line == "\r") {
+    if (c != ',') {
+      return c == ']';
+    }
+  }
+}
+
+// Один ограниченный шаг опроса: ни одной задержки и ни одного
+// ожидания сокета, только то, что уже лежит в буфере
+void TeleBot::_pollStep() {
+  switch (_pollSt) {
+    case POLL_IDLE_TB:
+      if (millis() - _lastCheck > _checkTime) {
+        _pollSt = POLL_CONNECT_TB;
+      }
+      break;
+      
+    case POLL_CONNECT_TB:
+      // TLS рукопожатие WiFiClientSecure блокирующее, но с keep-alive
+      // оно случается только при первом запросе или после обрыва
+      if (!_poll->connected()) {
+        unsigned long start = millis();
+        if (!_dial(*_poll, _pollConn())) {
+          _pollConn().failed++;
+          if (_debug) Serial.println("Poll connect FAIL");
+          _pollReset(true);
+          break;
+        }
+        _pollStats().connect.add(millis() - start);
+      }
+      _pollSt = POLL_SEND_TB;
+      break;
+      
+    case POLL_SEND_TB: {
+      char req[256];
+      // limit держит пачку в пределах буфера POLL_BODY_MAX_TB
+      size_t len = _updatesReq(req, sizeof(req), _longPoll, 
+                               POLL_BODY_MAX_TB / MAX_MSG_SIZE, false);
+      size_t sent = len ? _poll->write((const uint8_t*)req, len) : 0;
+      _pollStats().bytesOut += sent;
+      if (len == 0 || sent != len) {
+        _pollReset(true);
+        break;
+      }
+      
+      _pollStart = millis();
+      _pollHttp.reset();
+      _pollHttp.onHeader(_headerHandler);
+      _pollSt = POLL_HEAD_TB;
+      break;
+    }
+      
+    case POLL_HEAD_TB: {
+      size_t budget = POLL_STEP_TB;
+      while (budget-- > 0 && _poll->available()) {
+        int r = _pollHttp.head(_poll->read());
+        if (r < 0) {
+          _pollReset(true);
+          return;
+        }
+        if (r > 0) {
+          // В dual() lastStatus() - только для вызовов из loop()
+          if (_ring.size() == 0) {
+            _status = _pollHttp.status();
+          }
+          if (_pollHttp.length() > POLL_BODY_MAX_TB) {
+            _pollStream();
+            return;
+          }
+          // Тело известной длины - в арену (кроме dual(): она у loop())
+          _pollBody = "";
+          _pollLen = 0;
+          if (!_taskLive && _pollHttp.length() > 0) {
+            _pollMark = _arena.mark();
+            _pollBuf = (char*)_arena.alloc(_pollHttp.length());
+          }
+          if (_pollBuf == NULL && _pollHttp.length() > 0) {
+            _pollBody.reserve(_pollHttp.length());
+          }
+          _pollSt = _pollHttp.done() ? POLL_PARSE_TB : POLL_BODY_TB;
+          return;
+        }
+      }
+      
+      // Сервер держит long poll до _longPoll секунд
+      if (millis() - _pollStart > (unsigned long)_longPoll * 1000 + 10000 ||
+          (!_poll->connected() && !_poll->available())) {
+        _pollReset(true);
+      }
+      break;
+    }
+      
+    case POLL_BODY_TB: {
+      char buf[64];
+      size_t budget = POLL_STEP_TB;
+      while (budget > 0 && !_pollHttp.done() && _poll->available()) {
+        long n = _pollHttp.data();
+        if (n == 0) {
+          // Разметка chunked: размер куска и переводы строк
+          budget--;
+          if (_pollHttp.frame(_poll->read()) < 0) {
+            _pollReset(true);
+            return;
+          }
+          continue;
+        }
+        
+        // В арене место под все тело уже есть
+        char* dst = _pollBuf ? _pollBuf + _pollLen : buf;
+        size_t room = _pollBuf ? (size_t)n : sizeof(buf);
+        size_t want = min((size_t)min(n, (long)budget), room);
+        int got = _poll->read((uint8_t*)dst, want);
+        if (got <= 0) {
+          break;
+        }
+        _pollHttp.consume(got);
+        if (_pollBuf) {
+          _pollLen += got;
+        } else {
+          _pollBody.concat(buf, got);
+        }
+        budget -= got;
+        
+        if (_pollBody.length() > POLL_BODY_MAX_TB) {
+          _pollReset(true);
+          return;
+        }
+      }
+      
+      if (!_pollHttp.done() && !_poll->connected() && !_poll->available()) {
+        _pollHttp.eof();
+      }
+      
+      if (_pollHttp.done()) {
+        _pollSt = POLL_PARSE_TB;
+      } else if (_pollHttp.failed() ||
+                 millis() - _pollStart > (unsigned long)_longPoll * 1000 + 10000) {
+        _pollReset(true);
+      }
+      break;
+    }
+      
+    case POLL_PARSE_TB: {
+      // Тело забираем у опроса: обработчики могут его сбросить,
+      // а память нужна до конца разбора
+      bool inArena = _pollBuf != NULL;
+      const char* data = _pollBuf;
+      size_t len = _pollLen;
+      // Арена у loop(): в dual() задача ее не размечает и не откатывает,
+      // иначе сотрет документы, которые loop() как раз собирает
+      bool own = !_taskLive;
+      size_t mark = inArena ? _pollMark : own ? _arena.mark() : 0;
+      _pollBuf = NULL;
+      
+      String updates;
+      if (!inArena) {
+        // Переносом, а не копией: иначе в пике в памяти две пачки
+        updates = std::move(_pollBody);
+        data = updates.c_str();
+        len = updates.length();
+      }
+      _pollBody = "";
+      StatsTB &st = _pollStats();
+      _statCall(st, API_GET_UPDATES_TB, _pollStart, true);
+      _pollReset(_pollHttp.close());
+      
+      if (len > 0) {
+        BufTB body(data, len);
+        uint32_t count = st.updates;
+        _dispatch(body);
+        st.batch.add(st.updates - count);
+      }
+      if (own) {
+        _arena.rewind(mark);
+      }
+      break;
+    }
+  }
+}
+
+// Пачка больше буфера (длинные апдейты и limit не спас): разбираем
+// прямо из сокета, как блокирующий опрос. Сброс без разбора вернул бы
+// ту же пачку на следующем опросе, и бот бы стоял
+void TeleBot::_pollStream() {
+  if (_debug) Serial.println("Poll: batch too big, streaming");
+  
+  StatsTB &st = _pollStats();
+  bool own = !_taskLive;
+  size_t mark = own ? _arena.mark() : 0;
+  BodyTB body(*_poll, _pollHttp);
+  uint32_t count = st.updates;
+  bool ok = _dispatch(body);
+  st.batch.add(st.updates - count);
+  if (own) {
+    _arena.rewind(mark);
+  }
+  body.skip();
+  
+  _statCall(st, API_GET_UPDATES_TB, _pollStart, ok);
+  _pollSt = POLL_PARSE_TB;
+  _pollReset(!_pollHttp.done() || _pollHttp.close());
+}
+
+void TeleBot::_pollReset(bool close) {
+  // Обрыв на приеме ответа - неудачный вызов getUpdates
+  if (_pollSt == POLL_HEAD_TB || _pollSt == POLL_BODY_TB) {
+    _statCall(_pollStats(), API_GET_UPDATES_TB, _pollStart, false);
+  }
+  if (close) {
+    _poll->stop();
+  }
+  _pollBody = "";
+  if (_pollBuf != NULL) {
+    _arena.rewind(_pollMark);
+    _pollBuf = NULL;
+  }
+  _pollSt = POLL_IDLE_TB;
+  _lastCheck = millis();
+}
+
+bool TeleBot::_getUpdates() {
+  char req[256];
+  unsigned long start = millis();
+  if (!_updatesReq(req, sizeof(req), LONG_POLL_TB, 0, !_keepAlive) || 
+      !_open("getUpdates", NULL, 0, req, 
+             LONG_POLL_TB * 1000UL + READ_TIMEOUT_TB)) {
+    return _statCall(API_GET_UPDATES_TB, start, false);
+  }
+  
+  BodyTB body(*_client, _http);
+  _body = &body;
+  uint32_t updates = _stats.updates;
+  size_t mark = _arena.mark();
+  bool ok = _dispatch(body);
+  _arena.rewind(mark);
+  _stats.batch.add(_stats.updates - updates);
+  
+  if (_body) {
+    _body = NULL;
+    body.skip();
+    _finish(!_http.done() || _http.close());
+  }
+  return _statCall(API_GET_UPDATES_TB, start, ok);
+}
+
+// Обработчик отправляет ответ, пока пачка еще читается из того же
+// сокета: целые апдейты из остатка (до MAX_MSG_SIZE) забираем в память,
+// соединение отдаем запросу
+void TeleBot::_detach() {
+  BodyTB* body = _body;
+  _body = NULL;
+  
+  if (!body->detach(MAX_MSG_SIZE) && _debug) {
+    Serial.println("Updates: rest of batch left for the next poll");
+  }
+  _finish(!_http.done() || _http.close());
+}
+
+// Делит "/cmd@bot arg1 arg2" на команду, адресата и аргументы
+// без копирования
+static void splitTB(const char* p, size_t n, ArgTB &cmd, ArgTB &mention,
+                    ArgTB *args, uint8_t &argc) {
+  const char* end = p + n;
+  
+  const char* cmdEnd = p;
+  while (cmdEnd < end && !isspace((uint8_t)*cmdEnd)) {
+    cmdEnd++;
+  }
+  
+  const char* at = (const char*)memchr(p, '@', cmdEnd - p);
+  cmd.ptr = p;
+  cmd.len = (at ? at : cmdEnd) - p;
+  mention.ptr = at ? at + 1 : NULL;
+  mention.len = at ? cmdEnd - at - 1 : 0;
+  
+  argc = 0;
+  const char* q = cmdEnd;
+  while (argc < MAX_ARGS_TB) {
+    while (q < end && isspace((uint8_t)*q)) {
+      q++;
+    }
+    if (q >= end) {
+      break;
+    }
+    ArgTB &arg = args[argc++];
+    arg.ptr = q;
+    while (q < end && !isspace((uint8_t)*q)) {
+      q++;
+    }
+    arg.len = q - arg.ptr;
+  }
+}
+
+void TeleBot::_process(JsonObject update) {
+  // В dual() _lastID уходит вперед, а сохранять можно только
+  // то, что уже отдано обработчикам
+  long update_id = update["update_id"];
+  if (update_id > _doneID) {
+    _doneID = update_id;
+  }
+  
+  if (update.containsKey("message")) {
+    _processMsg(update["message"]);
+  } else if (update.containsKey("callback_query")) {
+    _processInline(update["callback_query"]);
+  }
+}
+
+void TeleBot::_processMsg(JsonObject msgObj) {
+  MsgViewTB view;
+  view.obj = msgObj;
+  view.chat_id = msgObj["chat"]["id"];
+  view.msg_id = msgObj["message_id"];
+  
+  // Обработка команд
+  RouteTB *route = NULL;
+  ArgTB text = view.text();
+  if (text.len > 0 && text.ptr[0] == '/') {
+    ArgTB mention;
+    splitTB(text.ptr, text.len, view._cmd, mention, view._args, view.argc);
+    route = _command(view._cmd, mention);
+  }
+  
+  // View-обработчики получают сообщение без копий,
+  // String поля собираются только для обычных
+  if (route != NULL && route->view != NULL) {
+    route->view(view);
+    return;
+  }
+  
+  if (route != NULL && route->handler != NULL) {
+    MsgTB msg;
+    view.materialize(msg);
+    route->handler(msg);
+    return;
+  }
+  
+  // Общий обработчик
+  if (_msgView != NULL) {
+    _msgView(view);
+  } else if (_msgHandler != NULL) {
+    MsgTB msg;
+    view.materialize(msg);
+    _msgHandler(msg);
+  }
+}
+
+// ==================== КОМАНДЫ ====================
+
+String ArgTB::str() const {
+  String out;
+  if (ptr != NULL) {
+    out.concat(ptr, len);
+  }
+  return out;
+}
+
+bool ArgTB::equals(const char* str) const {
+  return ptr != NULL && strlen(str) == len && memcmp(ptr, str, len) == 0;
+}
+
+long ArgTB::toInt() const {
+  char buf[24];
+  size_t n = min((size_t)len, sizeof(buf) - 1);
+  memcpy(buf, ptr, n);
+  buf[n] = 0;
+  return atol(buf);
+}
+
+static ArgTB argTB(const char* str) {
+  ArgTB arg;
+  if (str != NULL) {
+    arg.ptr = str;
+    arg.len = strlen(str);
+  }
+  return arg;
+}
+
+ArgTB MsgViewTB::text() const {
+  return argTB(obj["text"].as<const char*>());
+}
+
+ArgTB MsgViewTB::user() const {
+  return argTB(obj["from"]["username"].as<const char*>());
+}
+
+ArgTB MsgViewTB::name() const {
+  return argTB(obj["from"]["first_name"].as<const char*>());
+}
+
+ArgTB MsgViewTB::data() const {
+  return argTB(obj["data"].as<const char*>());
+}
+
+ArgTB MsgViewTB::id() const {
+  return argTB(obj["id"].as<const char*>());
+}
+
+void MsgViewTB::materialize(MsgTB &msg) const {
+  msg.chat_id = chat_id;
+  msg.msg_id = msg_id;
+  msg.is_inline = is_inline;
+  msg.text = text().str();
+  msg.user = user().str();
+  msg.name = name().str();
+  msg.inline_data = is_inline ? data().str() : String();
+  msg.inline_id = is_inline ? id().str() : String();
+  
+  // Команда и аргументы - смещениями от начала текста
+  ArgTB src = text();
+  msg._cmd = SpanTB();
+  msg.argc = argc;
+  if (_cmd.ptr != NULL) {
+    msg._cmd.pos = _cmd.ptr - src.ptr;
+    msg._cmd.len = _cmd.len;
+  }
+  for (uint8_t i = 0; i < argc; i++) {
+    msg._args[i].pos = _args[i].ptr - src.ptr;
+    msg._args[i].len = _args[i].len;
+  }
+}
+
+ArgTB MsgViewTB::cmd() const {
+  return _cmd;
+}
+
+ArgTB MsgViewTB::arg(uint8_t i) const {
+  return i < argc ? _args[i] : ArgTB();
+}
+
+ArgTB MsgTB::_span(const SpanTB &span) const {
+  ArgTB arg;
+  if (span.pos + span.len <= text.length()) {
+    arg.ptr = text.c_str() + span.pos;
+    arg.len = span.len;
+  }
+  return arg;
+}
+
+ArgTB MsgTB::cmd() const {
+  return _cmd.len > 0 ? _span(_cmd) : ArgTB();
+}
+
+ArgTB MsgTB::arg(uint8_t i) const {
+  return i < argc ? _span(_args[i]) : ArgTB();
+}
+
+// FNV-1a
+uint32_t TeleBot::_hash(const char* str, size_t len, uint32_t h) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)str[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Строка с длиной впереди: {"ab","c"} и {"a","bc"} различаются
+uint32_t TeleBot::_hashStr(const String &str, uint32_t h) {
+  uint8_t len[2] = {(uint8_t)str.length(), (uint8_t)(str.length() >> 8)};
+  h = _hash((const char*)len, 2, h);
+  return _hash(str.c_str(), str.length(), h);
+}
+
+// Слот команды или пустой слот, куда ее можно вставить
+TeleBot::RouteTB *TeleBot::_route(const char* name, size_t len, 
+                                  uint32_t hash) {
+  if (_routeCap == 0) {
+    return NULL;
+  }
+  
+  uint16_t mask = _routeCap - 1;
+  for (uint16_t i = hash & mask; ; i = (i + 1) & mask) {
+    RouteTB &r = _routes[i];
+    if (r.name == NULL) {
+      return &r;
+    }
+    if (r.hash == hash && r.len == len && memcmp(r.name, name, len) == 0) {
+      return &r;
+    }
+  }
+}
+
+void TeleBot::_growRoutes() {
+  RouteTB *old = _routes;
+  uint16_t oldCap = _routeCap;
+  
+  _routeCap = oldCap ? oldCap * 2 : 16;
+  _routes = new RouteTB[_routeCap]();
+  
+  for (uint16_t i = 0; i < oldCap; i++) {
+    if (old[i].name != NULL) {
+      *_route(old[i].name, old[i].len, old[i].hash) = old[i];
+    }
+  }
+  delete[] old;
+}
+
+void TeleBot::_addRoute(const char* name, size_t len, MsgHandlerTB handler,
+                        ViewHandlerTB view, bool copy) {
+  if (len == 0 || len > 255) {
+    return;
+  }
+  
+  // Заполнение не больше 3/4: поиск всегда находит пустой слот
+  if ((_routeCount + 1) * 4 > _routeCap * 3) {
+    _growRoutes();
+  }
+  
+  uint32_t hash = _hash(name, len);
+  RouteTB *r = _route(name, len, hash);
+  
+  if (r->name == NULL) {
+    if (copy) {
+      char* dup = (char*)malloc(len + 1);
+      memcpy(dup, name, len);
+      dup[len] = 0;
+      name = dup;
+    }
+    r->hash = hash;
+    r->name = name;
+    r->len = len;
+    r->own = copy;
+    _routeCount++;
+  }
+  
+  r->handler = handler;
+  r->view = view;
+}
+
+// Обработчик команды; в группах /cmd@OtherBot адресована другому боту
+TeleBot::RouteTB *TeleBot::_command(const ArgTB &cmd, const ArgTB &mention) {
+  if (mention.ptr != NULL && _botName.length() > 0) {
+    if (mention.len != _botName.length() || 
+        strncasecmp(mention.ptr, _botName.c_str(), mention.len) != 0) {
+      return NULL;
+    }
+  }
+  
+  RouteTB *r = _route(cmd.ptr, cmd.len, _hash(cmd.ptr, cmd.len));
+  return (r != NULL && r->name != NULL) ? r : NULL;
+}
+
+void TeleBot::_processInline(JsonObject inlineObj) {
+  MsgViewTB view;
+  view.obj = inlineObj;
+  view.chat_id = inlineObj["message"]["chat"]["id"];
+  view.msg_id = inlineObj["message"]["message_id"];
+  view.is_inline = true;
+  
+  if (_inlineView != NULL) {
+    _inlineView(view);
+  } else if (_inlineHandler != NULL) {
+    MsgTB msg;
+    view.materialize(msg);
+    _inlineHandler(msg);
+  }
+}
+
+bool TeleBot::send(long chat_id, const String &text, 
+                   const String &parse, const String &keys) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"text", text.c_str(), text.length(), true},
+    {"parse_mode", parse.length() ? parse.c_str() : NULL, parse.length(), false},
+    {"reply_markup", keys.length() ? keys.c_str() : NULL, keys.length(), true}
+  };
+  
+  bool ok = _call("sendMessage", params, 4, chat_id);
+  
+  if (_debug) {
+    Serial.print("Send: ");
+    Serial.println(ok ? "OK" : "FAIL");
+  }
+  
+  return ok;
+}
+
+bool TeleBot::send(long chat_id, const String &text, const String &keys) {
+  return send(chat_id, text, "", keys);
+}
+
+bool TeleBot::sendIn(long chat_id, const String &text, const String &keys) {
+  return send(chat_id, text, "", keys);
+}
+
+// Разметка уже закодирована: идет в сокет без сборки и кодирования
+bool TeleBot::send(long chat_id, const String &text, const KeyTB &keys,
+                   const String &parse) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"text", text.c_str(), text.length(), true},
+    {"parse_mode", parse.length() ? parse.c_str() : NULL, parse.length(), false},
+    {"reply_markup", keys.length() ? keys.c_str() : NULL, keys.length(), false}
+  };
+  
+  bool ok = _call("sendMessage", params, 4, chat_id);
+  
+  if (_debug) {
+    Serial.print("Send: ");
+    Serial.println(ok ? "OK" : "FAIL");
+  }
+  
+  return ok;
+}
+
+bool TeleBot::sendChat(long chat_id, const String &action) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"action", action.c_str(), action.length(), false}
+  };
+  
+  return _call("sendChatAction", params, 2, chat_id);
+}
+
+bool TeleBot::answer(const String &inline_id, const String &text) {
+  ParamTB params[] = {
+    {"callback_query_id", inline_id.c_str(), inline_id.length(), false},
+    {"text", text.length() ? text.c_str() : NULL, text.length(), true}
+  };
+  
+  return _request("answerCallbackQuery", params, 2);
+}
+
+bool TeleBot::edit(long chat_id, long msg_id, const String &text, 
+                   const String &keys) {
+  char id[24], mid[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  snprintf(mid, sizeof(mid), "%ld", msg_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"message_id", mid, strlen(mid), false},
+    {"text", text.c_str(), text.length(), true},
+    {"reply_markup", keys.length() ? keys.c_str() : NULL, keys.length(), true}
+  };
+  
+  return _call("editMessageText", params, 4, chat_id);
+}
+
+bool TeleBot::edit(long chat_id, long msg_id, const String &text, 
+                   const KeyTB &keys) {
+  char id[24], mid[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  snprintf(mid, sizeof(mid), "%ld", msg_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"message_id", mid, strlen(mid), false},
+    {"text", text.c_str(), text.length(), true},
+    {"reply_markup", keys.length() ? keys.c_str() : NULL, keys.length(), false}
+  };
+  
+  return _call("editMessageText", params, 4, chat_id);
+}
+
+long TeleBot::lastMsg() {
+  return _lastMsg;
+}
+
+bool TeleBot::del(long chat_id, long msg_id) {
+  char id[24], mid[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  snprintf(mid, sizeof(mid), "%ld", msg_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"message_id", mid, strlen(mid), false}
+  };
+  
+  return _call("deleteMessage", params, 2, chat_id);
+}
+
+bool TeleBot::photo(long chat_id, const String &photo_url, const String &caption) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"photo", photo_url.c_str(), photo_url.length(), true},
+    {"caption", caption.length() ? caption.c_str() : NULL, caption.length(), true}
+  };
+  
+  return _call("sendPhoto", params, 3, chat_id);
+}
+
+bool TeleBot::document(long chat_id, const String &doc_url, const String &caption) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"document", doc_url.c_str(), doc_url.length(), true},
+    {"caption", caption.length() ? caption.c_str() : NULL, caption.length(), true}
+  };
+  
+  return _call("sendDocument", params, 3, chat_id);
+}
+
+// live - секунд трансляции (60..86400), дальше liveLoc() с lastMsg()
+bool TeleBot::location(long chat_id, float lat, float lon, int live) {
+  char id[24], la[16], lo[16], period[12];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  snprintf(la, sizeof(la), "%.6f", lat);
+  snprintf(lo, sizeof(lo), "%.6f", lon);
+  snprintf(period, sizeof(period), "%d", live);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"latitude", la, strlen(la), false},
+    {"longitude", lo, strlen(lo), false},
+    {"live_period", live > 0 ? period : NULL, strlen(period), false}
+  };
+  
+  return _call("sendLocation", params, 4, chat_id);
+}
+
+String TeleBot::get() {
+  String response;
+  if (_request("getMe", NULL, 0, response)) {
+    return response;
+  }
+  return "";
+}
+
+bool TeleBot::_connect(bool &reused) {
+  reused = false;
+  _ttfb = -1;
+  
+  if (_body) {
+    _detach();
+  }
+  
+  // Ответы push() идут раньше ответа на этот запрос
+  if (_unacked > 0) {
+    _ackDrain(true);
+  }
+  
+  // В хабе сокет берется из общего пула на каждый запрос
+  if (_hub) {
+    _client = _hub->_take(*this);
+  }
+  
+  if (_keepAlive && _client->connected()) {
+    // Сокет простаивал дольше, чем держит сервер - не доверяем ему
+    if (millis() - _lastUse < _idleTime) {
+      // Остатки предыдущего ответа не должны попасть в новый
+      while (_client->available()) {
+        _client->read();
+      }
+      reused = true;
+      _connStat.reused++;
+      return true;
+    }
+    
+    if (_debug) Serial.println("Conn: idle, reconnect");
+    _client->stop();
+    _connStat.stale++;
+  }
+  
+  unsigned long start = millis();
+  if (!_dial(*_client, _connStat)) {
+    _connStat.failed++;
+    if (_debug) Serial.println("Connect FAIL");
+    return false;
+  }
+  
+  _stats.connect.add(millis() - start);
+  _connStat.opened++;
+  return true;
+}
+
+uint32_t TeleBot::_dnsIP = 0;
+unsigned long TeleBot::_dnsAt = 0;
+portMUX_TYPE TeleBot::_dnsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Подключение к api.telegram.org: DNS только когда сохраненного адреса
+// нет, он старше DNS_TTL_TB или по нему не удалось подключиться.
+// Сертификат проверяется по имени (SNI), а не по адресу.
+// Счетчики - в conn: у задачи dual() они свои
+bool TeleBot::_dial(WiFiClientSecure &client, ConnStatTB &conn) {
+  // Клиент может быть из пула хаба: настройки TLS берем свои
+  if (_ca != NULL) {
+    client.setCACert(_ca);
+  } else if (_insecure) {
+    client.setInsecure();
+  } else {
+    // Сертификат задан в самом клиенте: подключение по имени его
+    // не переписывает
+    return client.connect("api.telegram.org", 443);
+  }
+  
+  // Адрес и его время читаем и пишем парой: в dual() кэш делят
+  // задача сети и loop(). Само подключение - вне секции
+  portENTER_CRITICAL(&_dnsMux);
+  uint32_t cached = _dnsIP;
+  unsigned long at = _dnsAt;
+  portEXIT_CRITICAL(&_dnsMux);
+  
+  if (cached != 0 && millis() - at < DNS_TTL_TB) {
+    if (client.connect(IPAddress(cached), 443, "api.telegram.org", 
+                       _ca, NULL, NULL)) {
+      conn.cached++;
+      return true;
+    }
+    if (_debug) Serial.println("DNS: cached address failed");
+  }
+  
+  IPAddress ip;
+  conn.resolved++;
+  if (!WiFi.hostByName("api.telegram.org", ip) || (uint32_t)ip == 0) {
+    portENTER_CRITICAL(&_dnsMux);
+    _dnsIP = 0;
+    portEXIT_CRITICAL(&_dnsMux);
+    return false;
+  }
+  
+  // Тот же адрес только что не ответил - дело не в DNS
+  bool retry = (uint32_t)ip != cached || millis() - at >= DNS_TTL_TB;
+  portENTER_CRITICAL(&_dnsMux);
+  _dnsIP = ip;
+  _dnsAt = millis();
+  portEXIT_CRITICAL(&_dnsMux);
+  if (!retry) {
+    return false;
+  }
+  return client.connect(ip, 443, "api.telegram.org", _ca, NULL, NULL);
+}
+
+// get - готовый GET запрос, иначе POST method с параметрами
+bool TeleBot::_open(const String &method, const ParamTB *params, int count,
+                    const char* get, unsigned long timeout) {
+  // Вторая попытка только если первая шла по старому сокету:
+  // сервер мог закрыть его, а connected() еще этого не видит
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused;
+    if (!_connect(reused)) {
+      return false;
+    }
+    
+    // Параметры кодируются прямо в сокет, без промежуточной строки
+    PackTB out(*_client);
+    if (get != NULL) {
+      out.print(get);
+    } else {
+      _head(out, method, _paramsLen(params, count), !_keepAlive);
+    }
+    if (count > 0) {
+      _writeParams(out, params, count);
+    }
+    bool sent = out.send();
+    _stats.bytesOut += out.total();
+    
+    if (sent && _readHead(timeout)) {
+      return true;
+    }
+    
+    _client->stop();
+    
+    // Повтор только если сервер точно не получил запрос: запись не
+    // прошла или сокет закрылся до первого байта ответа. После
+    // таймаута запрос мог выполниться, и второй sendMessage задвоит
+    // сообщение
+    if (!reused || (sent && !_eof)) {
+      break;
+    }
+    
+    _connStat.stale++;
+    if (_debug) Serial.println("Conn: stale, reconnect");
+  }
+  
+  return false;
+}
+
+void TeleBot::_finish(bool close) {
+  if (close || !_keepAlive) {
+    _client->stop();
+  }
+  _lastUse = millis();
+  
+  if (_hub) {
+    _hub->_used(_client);
+  }
+}
+
+bool TeleBot::_exchange(const String &method, const ParamTB *params, 
+                        int count, String &response) {
+  if (!_open(method, params, count)) {
+    return false;
+  }
+  
+  bool ok = _readBody(response);
+  _finish(!ok || _http.close());
+  return ok;
+}
+
+bool TeleBot::_readHead(unsigned long timeout) {
+  _http.reset();
+  _http.onHeader(_headerHandler);
+  
+  unsigned long start = millis();
+  _ttfb = -1;
+  _eof = false;
+  while (true) {
+    if (!_client->available()) {
+      if (!_client->connected()) {
+        _eof = _ttfb < 0;
+        return false;
+      }
+      if (millis() - start > timeout) {
+        return false;
+      }
+      delay(1);
+      continue;
+    }
+    
+    if (_ttfb < 0) {
+      _ttfb = millis() - start;
+    }
+    
+    int r = _http.head(_client->read());
+    if (r < 0) {
+      return false;
+    }
+    if (r > 0) {
+      break;
+    }
+  }
+  
+  _status = _http.status();
+  return true;
+}
+
+bool TeleBot::_readBody(String &response) {
+  response = "";
+  if (_http.length() > 0) {
+    response.reserve(_http.length());
+  }
+  
+  // Ровно столько, сколько указано в разметке: сокет остается
+  // готов к следующему запросу
+  BodyTB body(*_client, _http);
+  char buf[256];
+  int n;
+  while ((n = body.read((uint8_t*)buf, sizeof(buf))) > 0) {
+    response.concat(buf, n);
+  }
+  
+  return _http.done();
+}
+
+bool TeleBot::_request(const String &method, const String &params) {
+  ParamTB raw = {NULL, params.c_str(), params.length(), false};
+  return _request(method, &raw, 1);
+}
+
+// Заголовки пишутся прямо в пакет, без промежуточной строки
+void TeleBot::_head(Print &out, const String &method, size_t length, 
+                    bool close) {
+  out.print("POST /bot");
+  out.print(_token);
+  out.write('/');
+  out.print(method);
+  out.print(" HTTP/1.1\r\n"
+            "Host: api.telegram.org\r\n"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: ");
+  out.print((unsigned long)length);
+  out.print(close ? "\r\nConnection: close\r\n\r\n" 
+                  : "\r\nConnection: keep-alive\r\n\r\n");
+}
+
+// GET getUpdates в буфер на стеке. 0 - не поместился
+size_t TeleBot::_updatesReq(char* buf, size_t cap, int timeout, int limit,
+                             bool close) {
+  char offset[32] = "";
+  long last = _lastID;
+  if (last > 0) {
+    snprintf(offset, sizeof(offset), "&offset=%ld", last + 1);
+  }
+  char lim[24] = "";
+  if (limit > 0) {
+    snprintf(lim, sizeof(lim), "&limit=%d", limit);
+  }
+  
+  int n = snprintf(buf, cap, "GET /bot%s/getUpdates?timeout=%d%s%s HTTP/1.1\r\n"
+                   "Host: api.telegram.org\r\nConnection: %s\r\n\r\n",
+                   _token, timeout, offset, lim, 
+                   close ? "close" : "keep-alive");
+  return n > 0 && (size_t)n < cap ? n : 0;
+}
+
+bool TeleBot::_request(const String &method, const ParamTB *params, 
+                       int count) {
+  unsigned long start = millis();
+  bool ok = _open(method, params, count);
+  if (ok) {
+    ok = _response();
+    _finish(!_http.done() || _http.close());
+  }
+  return _statCall(_api(method), start, ok);
+}
+
+// Тело ответа после _readHead(): в арену, если она есть и длина
+// известна, иначе в String. Читается кусками, разбирается из памяти
+bool TeleBot::_response() {
+  size_t mark = _arena.mark();
+  long len = _http.length();
+  char* buf = len > 0 ? (char*)_arena.alloc(len) : NULL;
+  
+  bool ok;
+  if (buf != NULL) {
+    BodyTB body(*_client, _http);
+    size_t got = 0;
+    int n;
+    while (got < (size_t)len && 
+           (n = body.read((uint8_t*)buf + got, len - got)) > 0) {
+      got += n;
+    }
+    ok = _http.done() && _result(buf, got);
+  } else {
+    String response;
+    ok = _readBody(response) && _result(response.c_str(), response.length());
+  }
+  
+  _arena.rewind(mark);
+  return ok;
+}
+
+// Для вызовов, которым нужен весь ответ (getMe)
+bool TeleBot::_request(const String &method, const ParamTB *params, 
+                       int count, String &response) {
+  unsigned long start = millis();
+  bool ok = _exchange(method, params, count, response) && _result(response);
+  return _statCall(_api(method), start, ok);
+}
+
+bool TeleBot::_result(const String &response) {
+  return _result(response.c_str(), response.length());
+}
+
+// Разбор {"ok":...}: при ошибке запоминает код, описание и retry_after
+bool TeleBot::_result(const char* data, size_t len) {
+  _lastCode = 0;
+  _retryAfter = 0;
+  
+  // Фильтр: эхо отправленного сообщения в result не нужно и
+  // не поместилось бы в документ
+  StaticJsonDocument<256> filter;
+  filter["ok"] = true;
+  filter["error_code"] = true;
+  filter["description"] = true;
+  filter["parameters"]["retry_after"] = true;
+  filter["result"]["message_id"] = true;
+  
+  size_t mark = _arena.mark();
+  ArenaDocTB doc(512, ArenaAllocTB(&_arena));
+  DeserializationError error = deserializeJson(doc, data, len, 
+                               DeserializationOption::Filter(filter));
+  
+  bool ok = !error && doc["ok"] == true;
+  if (ok) {
+    _lastMsg = doc["result"]["message_id"] | 0L;
+  } else if (!error) {
+    // 429: Telegram сообщает, сколько секунд ждать
+    _lastCode = doc["error_code"] | 0;
+    _retryAfter = doc["parameters"]["retry_after"] | 0;
+    _error = doc["description"] | "API error";
+  }
+  
+  // Документ больше не нужен: его место в арене свободно
+  _arena.rewind(mark);
+  return ok;
+}
+
+// multipart/form-data: файл идет в сокет блоками по UPLOAD_CHUNK_TB,
+// длина тела известна заранее, весь файл в память не читается
+bool TeleBot::_upload(const char* method, const char* field, long chat_id,
+                      Stream &data, size_t size, const String &filename,
+                      const String &caption) {
+  String boundary = "----TeleBot" + String(millis(), HEX);
+  
+  String safeName = filename;
+  safeName.replace("\"", "_");
+  safeName.replace("\r", "_");
+  safeName.replace("\n", "_");
+  
+  String pre = "--" + boundary + "\r\n";
+  pre += "Content-Disposition: form-data; name=\"chat_id\"\r\n\r\n";
+  pre += String(chat_id) + "\r\n";
+  
+  if (caption.length() > 0) {
+    pre += "--" + boundary + "\r\n";
+    pre += "Content-Disposition: form-data; name=\"caption\"\r\n\r\n";
+    pre += caption + "\r\n";
+  }
+  
+  pre += "--" + boundary + "\r\n";
+  pre += "Content-Disposition: form-data; name=\"" + String(field) + 
+         "\"; filename=\"" + safeName + "\"\r\n";
+  pre += "Content-Type: application/octet-stream\r\n\r\n";
+  
+  String post = "\r\n--" + boundary + "--\r\n";
+  
+  String head = "POST /bot" + String(_token) + "/" + method + " HTTP/1.1\r\n";
+  head += "Host: api.telegram.org\r\n";
+  head += "Content-Type: multipart/form-data; boundary=" + boundary + "\r\n";
+  head += "Content-Length: " + String(pre.length() + size + post.length()) + 
+          "\r\n";
+  head += _keepAlive ? "Connection: keep-alive\r\n\r\n" 
+                     : "Connection: close\r\n\r\n";
+  
+  uint8_t api = _api(method);
+  unsigned long start = millis();
+  
+  // Пока файл не начали читать, старый сокет можно сменить на новый
+  bool sent = false;
+  for (int attempt = 0; attempt < 2 && !sent; attempt++) {
+    bool reused;
+    if (!_connect(reused)) {
+      return _statCall(api, start, false);
+    }
+    
+    PackTB out(*_client);
+    out.print(head);
+    out.print(pre);
+    sent = out.send();
+    _stats.bytesOut += out.total();
+    
+    if (!sent) {
+      _client->stop();
+      if (!reused) {
+        return _statCall(api, start, false);
+      }
+      _connStat.stale++;
+    }
+  }
+  
+  if (!sent) {
+    return _statCall(api, start, false);
+  }
+  
+  uint8_t buf[UPLOAD_CHUNK_TB];
+  size_t left = size;
+  while (left > 0) {
+    size_t n = data.readBytes(buf, min(left, sizeof(buf)));
+    if (n == 0 || _client->write(buf, n) != n) {
+      // Тело короче заявленного - соединение уже не спасти
+      _client->stop();
+      _error = n == 0 ? "Upload: source ended early" : "Upload: write failed";
+      return _statCall(api, start, false);
+    }
+    _stats.bytesOut += n;
+    left -= n;
+  }
+  
+  _stats.bytesOut += post.length();
+  if (_client->print(post) != post.length() || !_readHead()) {
+    _client->stop();
+    return _statCall(api, start, false);
+  }
+  
+  bool ok = _response();
+  _finish(!_http.done() || _http.close());
+  
+  if (_debug) {
+    Serial.print("Upload: ");
+    Serial.print(size);
+    Serial.println(ok ? " bytes OK" : " bytes FAIL");
+  }
+  
+  return _statCall(api, start, ok);
+}
+
+bool TeleBot::photo(long chat_id, Stream &data, size_t size,
+                    const String &filename, const String &caption) {
+  return _upload("sendPhoto", "photo", chat_id, data, size, filename, caption);
+}
+
+bool TeleBot::document(long chat_id, Stream &data, size_t size,
+                       const String &filename, const String &caption) {
+  return _upload("sendDocument", "document", chat_id, data, size, 
+                 filename, caption);
+}
+
+#ifdef TELEBOT_SD_ENABLE
+bool TeleBot::photo(long chat_id, fs::File &file, const String &caption) {
+  String name = file.name();
+  return photo(chat_id, file, file.size() - file.position(), 
+               name.substring(name.lastIndexOf('/') + 1), caption);
+}
+
+bool TeleBot::document(long chat_id, fs::File &file, const String &caption) {
+  String name = file.name();
+  return document(chat_id, file, file.size() - file.position(), 
+                  name.substring(name.lastIndexOf('/') + 1), caption);
+}
+#endif
+
+bool TeleBot::_call(const String &method, const ParamTB *params, int count,
+                    long chat_id) {
+  if (_queue != NULL) {
+    // В очереди параметры должны пережить вызов - склеиваем в строку
+    String joined;
+    joined.reserve(_paramsLen(params, count));
+    StrPrintTB out(joined);
+    _writeParams(out, params, count);
+    return _enqueue(method, joined, chat_id);
+  }
+  
+  if (_noAck) {
+    return _fire(method, params, count);
+  }
+  
+  return _request(method, params, count);
+}
+
+size_t TeleBot::_paramsLen(const ParamTB *params, int count) {
+  size_t total = 0;
+  bool first = true;
+  
+  for (int i = 0; i < count; i++) {
+    if (params[i].value == NULL) {
+      continue;
+    }
+    if (!first) {
+      total++;
+    }
+    if (params[i].key != NULL) {
+      total += strlen(params[i].key) + 1;
+    }
+    total += params[i].encode ? encLen(params[i].value, params[i].len) 
+                              : params[i].len;
+    first = false;
+  }
+  
+  return total;
+}
+
+void TeleBot::_writeParams(Print &out, const ParamTB *params, int count) {
+  bool first = true;
+  
+  for (int i = 0; i < count; i++) {
+    if (params[i].value == NULL) {
+      continue;
+    }
+    if (!first) {
+      out.write('&');
+    }
+    if (params[i].key != NULL) {
+      out.print(params[i].key);
+      out.write('=');
+    }
+    if (params[i].encode) {
+      encode(out, params[i].value, params[i].len);
+    } else {
+      out.write((const uint8_t*)params[i].value, params[i].len);
+    }
+    first = false;
+  }
+}
+
+// ==================== КЛАВИАТУРЫ ====================
+
+// Строка JSON в кавычках, с экранированием как у ArduinoJson
+static void jsonStrTB(Print &out, const char* str, size_t len) {
+  out.write('"');
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = str[i];
+    if (c == '"' || c == '\\') {
+      out.write('\\');
+      out.write(c);
+    } else if (c >= 0x20) {
+      out.write(c);
+    } else if (c == '\n') {
+      out.print("\\n");
+    } else if (c == '\r') {
+      out.print("\\r");
+    } else if (c == '\t') {
+      out.print("\\t");
+    } else {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out.print(buf);
+    }
+  }
+  out.write('"');
+}
+
+static void jsonStrTB(Print &out, const String &str) {
+  jsonStrTB(out, str.c_str(), str.length());
+}
+
+static void jsonStrTB(Print &out, const char* str) {
+  jsonStrTB(out, str, strlen(str));
+}
+
+// Клавиатуры пишутся прямо в строку: размер ничем не ограничен
+String TeleBot::createKey(const String keys[][2], int rows, 
+                         bool resize, bool once) {
+  String output;
+  StrPrintTB out(output);
+  out.print("{\"keyboard\":[");
+  
+  for (int i = 0; i < rows; i++) {
+    if (i > 0) {
+      out.write(',');
+    }
+    out.write('[');
+    jsonStrTB(out, keys[i][0]);
+    if (keys[i][1].length() > 0) {
+      out.write(',');
+      jsonStrTB(out, keys[i][1]);
+    }
+    out.write(']');
+  }
+  
+  out.print("],\"resize_keyboard\":");
+  out.print(resize ? "true" : "false");
+  out.print(",\"one_time_keyboard\":");
+  out.print(once ? "true" : "false");
+  out.write('}');
+  return output;
+}
+
+String TeleBot::createIn(const String keys[][3], int rows, bool delBtn) {
+  String output;
+  StrPrintTB out(output);
+  out.print("{\"inline_keyboard\":[");
+  
+  for (int i = 0; i < rows; i++) {
+    if (i > 0) {
+      out.write(',');
+    }
+    out.print("[{\"text\":");
+    jsonStrTB(out, keys[i][0]);
+    out.print(",\"callback_data\":");
+    jsonStrTB(out, keys[i][1]);
+    if (keys[i][2].length() > 0) {
+      out.print(",\"url\":");
+      jsonStrTB(out, keys[i][2]);
+    }
+    out.print("}]");
+  }
+  
+  if (delBtn) {
+    if (rows > 0) {
+      out.write(',');
+    }
+    out.print("[{\"text\":\"❌ Удалить\",\"callback_data\":\"delete\"}]");
+  }
+  
+  out.print("]}");
+  return output;
+}
+
+String TeleBot::createURL(const String keys[][2], int rows) {
+  String output;
+  StrPrintTB out(output);
+  out.print("{\"inline_keyboard\":[");
+  
+  for (int i = 0; i < rows; i++) {
+    if (i > 0) {
+      out.write(',');
+    }
+    out.print("[{\"text\":");
+    jsonStrTB(out, keys[i][0]);
+    out.print(",\"url\":");
+    jsonStrTB(out, keys[i][1]);
+    out.print("}]");
+  }
+  
+  out.print("]}");
+  return output;
+}
+
+// Таблица BtnTB: ряды разделены ROW_TB, пустые ряды пропускаются
+static void markupTB(Print &out, const BtnTB* btns, size_t count, bool inl) {
+  out.print(inl ? "{\"inline_keyboard\":[" : "{\"keyboard\":[");
+  
+  bool rowOpen = false;
+  bool anyRow = false;
+  for (size_t i = 0; i < count; i++) {
+    const BtnTB &b = btns[i];
+    if (b.text == NULL) {
+      if (rowOpen) {
+        out.write(']');
+        rowOpen = false;
+      }
+      continue;
+    }
+    
+    if (!rowOpen) {
+      out.print(anyRow ? ",[" : "[");
+      rowOpen = true;
+      anyRow = true;
+    } else {
+      out.write(',');
+    }
+    
+    if (!inl) {
+      jsonStrTB(out, b.text);
+      continue;
+    }
+    out.print("{\"text\":");
+    jsonStrTB(out, b.text);
+    if (b.data != NULL) {
+      out.print(",\"callback_data\":");
+      jsonStrTB(out, b.data);
+    }
+    if (b.url != NULL) {
+      out.print(",\"url\":");
+      jsonStrTB(out, b.url);
+    }
+    out.write('}');
+  }
+  
+  if (rowOpen) {
+    out.write(']');
+  }
+  out.write(']');
+}
+
+bool KeyTB::inl(const BtnTB* btns, size_t count) {
+  String json;
+  StrPrintTB out(json);
+  markupTB(out, btns, count, true);
+  out.write('}');
+  return this->json(json);
+}
+
+bool KeyTB::reply(const BtnTB* btns, size_t count, bool resize, bool once) {
+  String json;
+  StrPrintTB out(json);
+  markupTB(out, btns, count, false);
+  out.print(",\"resize_keyboard\":");
+  out.print(resize ? "true" : "false");
+  out.print(",\"one_time_keyboard\":");
+  out.print(once ? "true" : "false");
+  out.write('}');
+  return this->json(json);
+}
+
+// URL-кодирование один раз: дальше разметка уходит в сокет как есть
+bool KeyTB::json(const String &markup) {
+  _enc = "";
+  if (!_enc.reserve(TeleBot::encLen(markup.c_str(), markup.length()))) {
+    return false;
+  }
+  StrPrintTB out(_enc);
+  TeleBot::encode(out, markup.c_str(), markup.length());
+  return _enc.length() > 0 || markup.length() == 0;
+}
+
+const char* KeyTB::c_str() const {
+  return _enc.c_str();
+}
+
+size_t KeyTB::length() const {
+  return _enc.length();
+}
+
+const KeyTB &TeleBot::cacheKey(const String keys[][2], int rows, 
+                               bool resize, bool once) {
+  // Тип клавиатуры - первым байтом, флаги - последним
+  uint32_t h = _hash("K", 1);
+  for (int i = 0; i < rows; i++) {
+    h = _hashStr(keys[i][1], _hashStr(keys[i][0], h));
+  }
+  char flags = resize << 1 | once;
+  h = _hash(&flags, 1, h);
+  
+  KeySlotTB &slot = _keySlot(h);
+  if (slot.keys.length() == 0) {
+    slot.keys.json(createKey(keys, rows, resize, once));
+  }
+  return slot.keys;
+}
+
+const KeyTB &TeleBot::cacheIn(const String keys[][3], int rows, bool delBtn) {
+  uint32_t h = _hash("I", 1);
+  for (int i = 0; i < rows; i++) {
+    h = _hashStr(keys[i][2], _hashStr(keys[i][1], _hashStr(keys[i][0], h)));
+  }
+  char flags = delBtn;
+  h = _hash(&flags, 1, h);
+  
+  KeySlotTB &slot = _keySlot(h);
+  if (slot.keys.length() == 0) {
+    slot.keys.json(createIn(keys, rows, delBtn));
+  }
+  return slot.keys;
+}
+
+const KeyTB &TeleBot::cacheURL(const String keys[][2], int rows) {
+  uint32_t h = _hash("U", 1);
+  for (int i = 0; i < rows; i++) {
+    h = _hashStr(keys[i][1], _hashStr(keys[i][0], h));
+  }
+  
+  KeySlotTB &slot = _keySlot(h);
+  if (slot.keys.length() == 0) {
+    slot.keys.json(createURL(keys, rows));
+  }
+  return slot.keys;
+}
+
+// Ключ по id: тип клавиатуры в нем есть, кнопок нет. Теги в нижнем
+// регистре, чтобы id не совпал с хэшем содержимого той же клавиатуры
+static void keyIdTB(char* key, char type, uint32_t id) {
+  key[0] = type;
+  for (uint8_t i = 0; i < 4; i++) {
+    key[i + 1] = (char)(id >> (i * 8));
+  }
+}
+
+const KeyTB &TeleBot::cacheKey(uint32_t id, const String keys[][2], int rows,
+                               bool resize, bool once) {
+  char key[5];
+  keyIdTB(key, 'k', id);
+  KeySlotTB &slot = _keySlot(_hash(key, sizeof(key)));
+  if (slot.keys.length() == 0) {
+    slot.keys.json(createKey(keys, rows, resize, once));
+  }
+  return slot.keys;
+}
+
+const KeyTB &TeleBot::cacheIn(uint32_t id, const String keys[][3], int rows,
+                              bool delBtn) {
+  char key[5];
+  keyIdTB(key, 'i', id);
+  KeySlotTB &slot = _keySlot(_hash(key, sizeof(key)));
+  if (slot.keys.length() == 0) {
+    slot.keys.json(createIn(keys, rows, delBtn));
+  }
+  return slot.keys;
+}
+
+const KeyTB &TeleBot::cacheURL(uint32_t id, const String keys[][2], int rows) {
+  char key[5];
+  keyIdTB(key, 'u', id);
+  KeySlotTB &slot = _keySlot(_hash(key, sizeof(key)));
+  if (slot.keys.length() == 0) {
+    slot.keys.json(createURL(keys, rows));
+  }
+  return slot.keys;
+}
+
+// Слот кэша с этим хэшем или самый давний, очищенный под новую клавиатуру
+TeleBot::KeySlotTB &TeleBot::_keySlot(uint32_t hash) {
+  KeySlotTB *old = &_keys[0];
+  _keyTick++;
+  
+  for (uint8_t i = 0; i < KEY_CACHE_TB; i++) {
+    KeySlotTB &slot = _keys[i];
+    if (slot.hash == hash && slot.keys.length() > 0) {
+      slot.used = _keyTick;
+      _keyStat.hits++;
+      return slot;
+    }
+    if (slot.used < old->used) {
+      old = &slot;
+    }
+  }
+  
+  _keyStat.built++;
+  old->hash = hash;
+  old->used = _keyTick;
+  old->keys = KeyTB();
+  return *old;
+}
+
+KeyStatTB TeleBot::keyStat() {
+  return _keyStat;
+}
+
+// ==================== ОЧЕРЕДЬ ОТПРАВКИ ====================
+
+bool TeleBot::_enqueue(const String &method, const String &params, 
+                       long chat_id) {
+  if (_qCount >= _qSize) {
+    _qStat.dropped++;
+    _error = "Queue full";
+    if (_debug) Serial.println("Queue full, drop");
+    return false;
+  }
+  
+  OutTB &item = _queue[(_qHead + _qCount) % _qSize];
+  item.method = method;
+  item.params = params;
+  item.chat_id = chat_id;
+  item.due = millis();
+  item.tries = 0;
+  
+  _qCount++;
+  if (_qCount > _qStat.peak) {
+    _qStat.peak = _qCount;
+  }
+  return true;
+}
+
+// Когда чату можно отправить следующее сообщение (0 - чат неизвестен)
+unsigned long *TeleBot::_chatSlot(long chat_id, bool create) {
+  int oldest = 0;
+  for (int i = 0; i < RATE_CHATS_TB; i++) {
+    if (_rate[i].chat_id == chat_id) {
+      return &_rate[i].next;
+    }
+    if ((long)(_rate[i].next - _rate[oldest].next) < 0) {
+      oldest = i;
+    }
+  }
+  
+  if (!create) {
+    return NULL;
+  }
+  
+  // Вытесняем чат, которому дольше всех уже можно писать
+  _rate[oldest].chat_id = chat_id;
+  _rate[oldest].next = millis();
+  return &_rate[oldest].next;
+}
+
+void TeleBot::_drainQueue() {
+  if (_qCount == 0) {
+    return;
+  }
+  
+  unsigned long now = millis();
+  
+  // Глобальный бакет: RATE_GLOBAL_TB сообщений в секунду
+  _tokens += (now - _tokenTime) * RATE_GLOBAL_TB;
+  if (_tokens > RATE_GLOBAL_TB * 1000UL) {
+    _tokens = RATE_GLOBAL_TB * 1000UL;
+  }
+  _tokenTime = now;
+  
+  if (_tokens < 1000) {
+    return;
+  }
+  
+  // Первое готовое сообщение; занятый чат не держит остальные
+  for (uint16_t i = 0; i < _qCount; i++) {
+    uint16_t idx = (_qHead + i) % _qSize;
+    OutTB &item = _queue[idx];
+    
+    if ((long)(now - item.due) < 0) {
+      continue;
+    }
+    
+    unsigned long *next = _chatSlot(item.chat_id, false);
+    if (next != NULL && (long)(now - *next) < 0) {
+      continue;
+    }
+    
+    // _lastCode от прошлого вызова не должен попасть в решение о повторе
+    _lastCode = 0;
+    _retryAfter = 0;
+    bool ok = _request(item.method, item.params);
+    _tokens -= 1000;
+    
+    // 400 "chat not found", 403 "bot was blocked" и т.п. повтором не
+    // лечатся. Повторяем 429, 5xx и обрывы (_lastCode == 0)
+    bool fatal = !ok && _lastCode >= 400 && _lastCode < 500 && 
+                 _lastCode != 429;
+    if (!fatal) {
+      next = _chatSlot(item.chat_id, true);
+      *next = millis() + (item.chat_id < 0 ? RATE_GROUP_MS_TB : 
+                                             RATE_CHAT_MS_TB);
+    }
+    
+    if (!ok && !fatal && ++item.tries < QUEUE_TRIES_TB) {
+      // Повтор: по retry_after, иначе с нарастающей паузой
+      unsigned long wait = _retryAfter > 0 ? _retryAfter * 1000UL : 
+                                             1000UL << item.tries;
+      item.due = millis() + wait;
+      if (_retryAfter > 0) {
+        *next = item.due;
+      }
+      _qStat.retried++;
+      if (_debug) {
+        Serial.print("Queue retry in ");
+        Serial.println(wait);
+      }
+      return;
+    }
+    
+    if (ok) {
+      _qStat.sent++;
+    } else {
+      _qStat.failed++;
+    }
+    
+    // Удаляем элемент, сдвигая предшествующие к концу очереди
+    for (uint16_t j = i; j > 0; j--) {
+      _queue[(_qHead + j) % _qSize] = _queue[(_qHead + j - 1) % _qSize];
+    }
+    _queue[_qHead].method = "";
+    _queue[_qHead].params = "";
+    _qHead = (_qHead + 1) % _qSize;
+    _qCount--;
+    return;
+  }
+}
+
+// Смена размера сохраняет ждущие сообщения, сколько поместится.
+// Выброшенные при отключении или уменьшении считаются в dropped
+void TeleBot::queue(bool enable, uint16_t size) {
+  OutTB *fresh = NULL;
+  uint16_t keep = 0;
+  
+  if (enable && size > 0) {
+    fresh = new OutTB[size];
+    keep = min(_qCount, size);
+    for (uint16_t i = 0; i < keep; i++) {
+      fresh[i] = _queue[(_qHead + i) % _qSize];
+    }
+    if (_queue == NULL) {
+      _tokens = RATE_GLOBAL_TB * 1000UL;
+      _tokenTime = millis();
+    }
+  }
+  
+  if (_qCount > keep) {
+    _qStat.dropped += _qCount - keep;
+    if (_debug) {
+      Serial.print("Queue: dropped ");
+      Serial.println(_qCount - keep);
+    }
+  }
+  
+  delete[] _queue;
+  _queue = fresh;
+  _qSize = fresh ? size : 0;
+  _qHead = 0;
+  _qCount = keep;
+}
+
+QueueStatTB TeleBot::queueStat() {
+  QueueStatTB stat = _qStat;
+  stat.depth = _qCount;
+  return stat;
+}
+
+// ==================== ЖИВЫЕ СООБЩЕНИЯ ====================
+
+TeleBot::LiveTB *TeleBot::_liveSlot(long chat_id, long msg_id, bool create) {
+  LiveTB *idle = NULL;
+  for (uint8_t i = 0; i < LIVE_SLOTS_TB; i++) {
+    LiveTB &slot = _live[i];
+    if (slot.chat_id == chat_id && slot.msg_id == msg_id) {
+      return &slot;
+    }
+    // Свободный или давно не менявшийся слот без ждущей правки
+    if (!slot.pending && (idle == NULL || (idle->msg_id != 0 &&
+        (slot.msg_id == 0 || (long)(slot.next - idle->next) < 0)))) {
+      idle = &slot;
+    }
+  }
+  
+  if (!create || idle == NULL) {
+    return NULL;
+  }
+  
+  *idle = LiveTB();
+  idle->chat_id = chat_id;
+  idle->msg_id = msg_id;
+  return idle;
+}
+
+// Новое содержимое уже в слоте: решаем, нужна ли правка
+bool TeleBot::_livePut(LiveTB *slot, uint32_t hash) {
+  _liveStat.updates++;
+  
+  if (slot->pending && hash == slot->hash) {
+    _liveStat.same++;
+    return true;
+  }
+  if (slot->pending) {
+    _liveStat.merged++;
+  }
+  
+  // Вернулись к тому, что уже показано: отменяем ждущую правку
+  if (hash == slot->shown) {
+    if (slot->pending) {
+      slot->pending = false;
+      _livePend--;
+    } else {
+      _liveStat.same++;
+    }
+    slot->text = "";
+    slot->keys = "";
+    return true;
+  }
+  
+  if (!slot->pending) {
+    slot->pending = true;
+    slot->tries = 0;
+    _livePend++;
+  }
+  slot->hash = hash;
+  return true;
+}
+
+bool TeleBot::live(long chat_id, long msg_id, const String &text, 
+                   const String &keys) {
+  LiveTB *slot = _liveSlot(chat_id, msg_id, true);
+  if (slot == NULL) {
+    _error = "Live slots busy";
+    return false;
+  }
+  
+  slot->loc = false;
+  slot->text = text;
+  slot->keys = keys;
+  return _livePut(slot, _hashStr(keys, _hashStr(text)));
+}
+
+bool TeleBot::liveLoc(long chat_id, long msg_id, float lat, float lon) {
+  LiveTB *slot = _liveSlot(chat_id, msg_id, true);
+  if (slot == NULL) {
+    _error = "Live slots busy";
+    return false;
+  }
+  
+  // Сравниваем с точностью, с которой координаты уходят в запрос
+  char pos[32];
+  snprintf(pos, sizeof(pos), "%.6f,%.6f", lat, lon);
+  slot->loc = true;
+  slot->text = pos;
+  slot->keys = "";
+  return _livePut(slot, _hashStr(slot->text));
+}
+
+bool TeleBot::liveStop(long chat_id, long msg_id) {
+  LiveTB *slot = _liveSlot(chat_id, msg_id, false);
+  if (slot == NULL) {
+    return true;
+  }
+  
+  bool ok = true;
+  if (slot->pending) {
+    ok = _liveSend(*slot);
+    slot->pending = false;
+    _livePend--;
+  }
+  
+  // Трансляция геопозиции заканчивается у всех сразу
+  if (slot->loc) {
+    char id[24], mid[24];
+    snprintf(id, sizeof(id), "%ld", chat_id);
+    snprintf(mid, sizeof(mid), "%ld", msg_id);
+    
+    ParamTB params[] = {
+      {"chat_id", id, strlen(id), false},
+      {"message_id", mid, strlen(mid), false}
+    };
+    ok = _request("stopMessageLiveLocation", params, 2) && ok;
+  }
+  
+  *slot = LiveTB();
+  return ok;
+}
+
+void TeleBot::liveRate(unsigned long ms) {
+  _liveEvery = ms;
+}
+
+LiveStatTB TeleBot::liveStat() {
+  return _liveStat;
+}
+
+bool TeleBot::_liveSend(LiveTB &slot) {
+  char id[24], mid[24];
+  snprintf(id, sizeof(id), "%ld", slot.chat_id);
+  snprintf(mid, sizeof(mid), "%ld", slot.msg_id);
+  bool ok;
+  
+  if (slot.loc) {
+    int comma = slot.text.indexOf(',');
+    ParamTB params[] = {
+      {"chat_id", id, strlen(id), false},
+      {"message_id", mid, strlen(mid), false},
+      {"latitude", slot.text.c_str(), (size_t)comma, false},
+      {"longitude", slot.text.c_str() + comma + 1, 
+                    slot.text.length() - comma - 1, false}
+    };
+    ok = _request("editMessageLiveLocation", params, 4);
+  } else {
+    ParamTB params[] = {
+      {"chat_id", id, strlen(id), false},
+      {"message_id", mid, strlen(mid), false},
+      {"text", slot.text.c_str(), slot.text.length(), true},
+      {"reply_markup", slot.keys.length() ? slot.keys.c_str() : NULL, 
+                       slot.keys.length(), true}
+    };
+    ok = _request("editMessageText", params, 4);
+  }
+  
+  // Telegram уже показывает это содержимое - правка не нужна
+  if (!ok && _lastCode == 400 && _error.indexOf("not modified") >= 0) {
+    ok = true;
+  }
+  
+  if (ok) {
+    _liveStat.sent++;
+    slot.shown = slot.hash;
+    slot.text = "";
+    slot.keys = "";
+  }
+  return ok;
+}
+
+// Одна правка за вызов: из готовых - та, что ждет дольше всех,
+// иначе частое сообщение отнимает лимит чата у соседних
+void TeleBot::_liveStep() {
+  if (_livePend == 0) {
+    return;
+  }
+  
+  unsigned long now = millis();
+  LiveTB *ready = NULL;
+  
+  for (uint8_t i = 0; i < LIVE_SLOTS_TB; i++) {
+    LiveTB &slot = _live[i];
+    if (!slot.pending || (long)(now - slot.next) < 0) {
+      continue;
+    }
+    
+    // Лимит чата общий с очередью отправки
+    unsigned long *next = _chatSlot(slot.chat_id, false);
+    if (next != NULL && (long)(now - *next) < 0) {
+      continue;
+    }
+    
+    if (ready == NULL || (long)(slot.next - ready->next) < 0) {
+      ready = &slot;
+    }
+  }
+  
+  if (ready == NULL) {
+    return;
+  }
+  
+  LiveTB &slot = *ready;
+  bool ok = _liveSend(slot);
+  
+  unsigned long *next = _chatSlot(slot.chat_id, true);
+  *next = millis() + (slot.chat_id < 0 ? RATE_GROUP_MS_TB : RATE_CHAT_MS_TB);
+  slot.next = millis() + _liveEvery;
+  
+  if (ok || ++slot.tries >= QUEUE_TRIES_TB) {
+    if (!ok) {
+      _liveStat.failed++;
+      slot.text = "";
+      slot.keys = "";
+    }
+    slot.pending = false;
+    _livePend--;
+  } else if (_retryAfter > 0) {
+    slot.next = millis() + _retryAfter * 1000UL;
+    *next = slot.next;
+  }
+  
+  if (_debug) {
+    Serial.print("Live ");
+    Serial.print(slot.msg_id);
+    Serial.println(ok ? ": OK" : ": FAIL");
+  }
+}
+
+// ==================== КОНВЕЙЕР ЗАПРОСОВ ====================
+
+uint32_t TeleBot::_asyncPush(const char* method, const ParamTB *params, 
+                             int count) {
+  if (_aCount >= ASYNC_SLOTS_TB) {
+    _error = "Async full";
+    return 0;
+  }
+  
+  AsyncTB &item = _async[(_aHead + _aCount) % ASYNC_SLOTS_TB];
+  if (++_ticket == 0) {
+    _ticket = 1;
+  }
+  item.ticket = _ticket;
+  item.method = method;
+  item.params = "";
+  item.params.reserve(_paramsLen(params, count));
+  StrPrintTB out(item.params);
+  _writeParams(out, params, count);
+  
+  _aCount++;
+  return item.ticket;
+}
+
+uint32_t TeleBot::sendAsync(long chat_id, const String &text, 
+                            const String &parse, const String &keys) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"text", text.c_str(), text.length(), true},
+    {"parse_mode", parse.length() ? parse.c_str() : NULL, parse.length(), false},
+    {"reply_markup", keys.length() ? keys.c_str() : NULL, keys.length(), true}
+  };
+  
+  return _asyncPush("sendMessage", params, 4);
+}
+
+uint32_t TeleBot::editAsync(long chat_id, long msg_id, const String &text, 
+                            const String &keys) {
+  char id[24], mid[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  snprintf(mid, sizeof(mid), "%ld", msg_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"message_id", mid, strlen(mid), false},
+    {"text", text.c_str(), text.length(), true},
+    {"reply_markup", keys.length() ? keys.c_str() : NULL, keys.length(), true}
+  };
+  
+  return _asyncPush("editMessageText", params, 4);
+}
+
+uint32_t TeleBot::delAsync(long chat_id, long msg_id) {
+  char id[24], mid[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  snprintf(mid, sizeof(mid), "%ld", msg_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"message_id", mid, strlen(mid), false}
+  };
+  
+  return _asyncPush("deleteMessage", params, 2);
+}
+
+// params - готовая строка key=value&..., уже URL-кодированная
+uint32_t TeleBot::callAsync(const String &method, const String &params) {
+  ParamTB raw = {NULL, params.c_str(), params.length(), false};
+  return _asyncPush(method.c_str(), &raw, 1);
+}
+
+void TeleBot::onDone(DoneHandlerTB handler) {
+  _doneHandler = handler;
+}
+
+bool TeleBot::flush() {
+  while (_aCount > 0) {
+    if (!_pipeBatch()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Пачка запросов одной записью, затем ответы по порядку: вся пачка
+// стоит один RTT вместо одного на запрос. Обработчики onDone()
+// вызываются после пачки, когда сокет уже свободен для send()
+bool TeleBot::_pipeBatch() {
+  uint8_t n = min(_aCount, (uint8_t)PIPE_DEPTH_TB);
+  if (n == 0) {
+    return true;
+  }
+  
+  DoneTB done[PIPE_DEPTH_TB];
+  uint8_t got = 0;
+  bool closed = false;
+  
+  for (int attempt = 0; attempt < 2; attempt++) {
+    bool reused;
+    if (!_connect(reused)) {
+      return false;
+    }
+    
+    PackTB out(*_client);
+    for (uint8_t i = 0; i < n; i++) {
+      AsyncTB &item = _async[(_aHead + i) % ASYNC_SLOTS_TB];
+      _head(out, item.method, item.params.length(), 
+            !_keepAlive && i == n - 1);
+      out.print(item.params);
+    }
+    bool sent = out.send();
+    _stats.bytesOut += out.total();
+    
+    unsigned long start = millis();
+    while (sent && got < n && _readHead()) {
+      AsyncTB &item = _async[(_aHead + got) % ASYNC_SLOTS_TB];
+      bool ok = _response();
+      bool body = _http.done();
+      _statCall(_api(item.method), start, ok);
+      
+      DoneTB &d = done[got++];
+      d.ticket = item.ticket;
+      d.ok = ok;
+      d.code = ok ? 0 : (_lastCode ? _lastCode : _http.status());
+      d.retry = _retryAfter;
+      d.msg_id = ok ? _lastMsg : 0;
+      
+      // Сервер закрывает соединение: следующие запросы он не читал
+      if (!body || _http.close()) {
+        closed = body;
+        break;
+      }
+    }
+    
+    // Повтор, как и в _open(), только если пачка точно не дошла
+    if (got > 0 || !reused || (sent && !_eof)) {
+      break;
+    }
+    
+    // Старый сокет молча закрыт сервером: пачку он не видел
+    _client->stop();
+    _connStat.stale++;
+    if (_debug) Serial.println("Pipe: stale, reconnect");
+  }
+  
+  // Последний ответ с Connection: close или недочитанный: его остаток
+  // следующий запрос принял бы за свой заголовок
+  _finish(got < n || !_http.done() || _http.close());
+  
+  // Обрыв посреди пачки: дошли ли остальные, неизвестно - повтор
+  // мог бы продублировать сообщение, поэтому сообщаем об ошибке.
+  // После штатного закрытия остальные ждут следующей пачки
+  uint8_t answered = got;
+  if (!closed) {
+    for (; got < n; got++) {
+      AsyncTB &item = _async[(_aHead + got) % ASYNC_SLOTS_TB];
+      DoneTB &d = done[got];
+      d.ticket = item.ticket;
+      d.ok = false;
+      d.code = 0;
+      d.retry = 0;
+      d.msg_id = 0;
+      _statCall(_api(item.method), millis(), false);
+    }
+  }
+  
+  for (uint8_t i = 0; i < got; i++) {
+    AsyncTB &item = _async[_aHead];
+    item.method = "";
+    item.params = "";
+    _aHead = (_aHead + 1) % ASYNC_SLOTS_TB;
+    _aCount--;
+  }
+  
+  if (_debug) {
+    Serial.print("Pipe: ");
+    Serial.print(answered);
+    Serial.print("/");
+    Serial.println(n);
+  }
+  
+  if (_doneHandler) {
+    for (uint8_t i = 0; i < got; i++) {
+      _doneHandler(done[i]);
+    }
+  }
+  return answered == got;
+}
+
+// ==================== БЕЗ ОЖИДАНИЯ ОТВЕТА ====================
+
+bool TeleBot::push(long chat_id, const String &text, const String &parse) {
+  char id[24];
+  snprintf(id, sizeof(id), "%ld", chat_id);
+  
+  ParamTB params[] = {
+    {"chat_id", id, strlen(id), false},
+    {"text", text.c_str(), text.length(), true},
+    {"parse_mode", parse.length() ? parse.c_str() : NULL, parse.length(), false}
+  };
+  
+  return _fire("sendMessage", params, 3);
+}
+
+void TeleBot::noAck(bool enable) {
+  _noAck = enable;
+}
+
+AckStatTB TeleBot::ackStat() {
+  _ackStat.pending = _unacked;
+  return _ackStat;
+}
+
+// Запрос уходит в сокет, ответ остается в нем до _ackDrain().
+// true - записано, о доставке скажет только ackStat()
+bool TeleBot::_fire(const String &method, const ParamTB *params, int count) {
+  // Сокеты хаба общие: там ответ нужно забрать сразу
+  if (_hub) {
+    return _request(method, params, count);
+  }
+  
+  // Без keep-alive сервер закроет сокет после первого ответа
+  if (_unacked >= (_keepAlive ? NOACK_DEPTH_TB : 1)) {
+    _ackDrain(true);
+  }
+  
+  uint8_t api = _api(method);
+  unsigned long start = millis();
+  if (_unacked > 0 && !_client->connected()) {
+    _ackDrop();
+  }
+  if (_unacked == 0) {
+    bool reused;
+    if (!_connect(reused)) {
+      _ackStat.lost++;
+      return _statCall(api, start, false);
+    }
+    _http.reset();
+    _http.onHeader(_headerHandler);
+    _ack.reset();
+  }
+  
+  PackTB out(*_client);
+  _head(out, method, _paramsLen(params, count), !_keepAlive);
+  _writeParams(out, params, count);
+  bool sent = out.send();
+  _stats.bytesOut += out.total();
+  _lastUse = millis();
+  
+  if (!sent) {
+    _client->stop();
+    _ackDrop();
+    _ackStat.lost++;
+    return _statCall(api, start, false);
+  }
+  
+  PendTB &pend = _pend[(_pHead + _unacked) % NOACK_DEPTH_TB];
+  pend.api = api;
+  pend.start = start;
+  _unacked++;
+  _ackStat.sent++;
+  return true;
+}
+
+// wait - дочитать все ответы (перед обычным запросом), иначе только
+// то, что уже пришло: loop() не ждет
+void TeleBot::_ackDrain(bool wait) {
+  unsigned long start = millis();
+  
+  while (_unacked > 0) {
+    if (_http.done()) {
+      _ackDone();
+      start = millis();
+      continue;
+    }
+    if (_http.failed()) {
+      _client->stop();
+      _ackDrop();
+      return;
+    }
+    
+    if (!_client->available()) {
+      if (!_client->connected()) {
+        _http.eof();
+        continue;
+      }
+      if (!wait) {
+        return;
+      }
+      if (millis() - start > 5000) {
+        _http.fail();
+        continue;
+      }
+      delay(1);
+      continue;
+    }
+    
+    long n = _http.inBody() ? _http.data() : 0;
+    if (n > 0) {
+      char buf[64];
+      int got = _client->read((uint8_t*)buf, min((size_t)n, sizeof(buf)));
+      if (got <= 0) {
+        continue;
+      }
+      _http.consume(got);
+      for (int i = 0; i < got; i++) {
+        _ack.feed(buf[i]);
+      }
+    } else if (_http.inBody()) {
+      _http.frame(_client->read());
+    } else {
+      _http.head(_client->read());
+    }
+  }
+}
+
+void TeleBot::_ackDone() {
+  PendTB &pend = _pend[_pHead];
+  _pHead = (_pHead + 1) % NOACK_DEPTH_TB;
+  _unacked--;
+  
+  bool ok = _http.status() == 200 && _ack.ok();
+  _statCall(pend.api, pend.start, ok);
+  if (ok) {
+    _ackStat.ok++;
+  } else {
+    _ackStat.failed++;
+    _ackStat.code = _ack.code() ? _ack.code() : _http.status();
+    if (_debug) {
+      Serial.print("Ack FAIL: ");
+      Serial.println(_ackStat.code);
+    }
+  }
+  
+  bool close = _http.close();
+  _http.reset();
+  _http.onHeader(_headerHandler);
+  _ack.reset();
+  _lastUse = millis();
+  
+  // Запросы после закрывающего ответа сервер уже не прочитает
+  if (close) {
+    _client->stop();
+    _ackDrop();
+  }
+}
+
+// Обрыв: ответов на оставшиеся уже не будет
+void TeleBot::_ackDrop() {
+  if (_unacked > 0 && _debug) {
+    Serial.print("Ack lost: ");
+    Serial.println(_unacked);
+  }
+  
+  while (_unacked > 0) {
+    _statCall(_pend[_pHead].api, _pend[_pHead].start, false);
+    _pHead = (_pHead + 1) % NOACK_DEPTH_TB;
+    _unacked--;
+    _ackStat.lost++;
+  }
+  _http.reset();
+  _ack.reset();
+}
+
+// ==================== АРЕНА ====================
+
+ArenaTB::~ArenaTB() {
+  end();
+}
+
+bool ArenaTB::begin(size_t size) {
+  end();
+  if (size == 0) {
+    return true;
+  }
+  
+  _buf = (uint8_t*)malloc(size);
+  if (_buf == NULL) {
+    return false;
+  }
+  _size = size;
+  return true;
+}
+
+void ArenaTB::end() {
+  free(_buf);
+  _buf = NULL;
+  _size = 0;
+  _used = 0;
+}
+
+void* ArenaTB::alloc(size_t n) {
+  if (_size == 0) {
+    return NULL;
+  }
+  
+  // Выравнивание под любой тип, как у malloc
+  size_t start = (_used + 7) & ~(size_t)7;
+  if (n == 0 || start + n > _size) {
+    _overflows += n > 0;
+    return NULL;
+  }
+  
+  _used = start + n;
+  if (_used > _peak) {
+    _peak = _used;
+  }
+  return _buf + start;
+}
+
+bool ArenaTB::owns(const void* p) {
+  return p >= _buf && p < _buf + _size;
+}
+
+size_t ArenaTB::mark() {
+  return _used;
+}
+
+void ArenaTB::rewind(size_t mark) {
+  if (mark < _used) {
+    _used = mark;
+  }
+}
+
+ArenaStatTB ArenaTB::stat() {
+  ArenaStatTB st;
+  st.size = _size;
+  st.used = _used;
+  st.peak = _peak;
+  st.overflows = _overflows;
+  return st;
+}
+
+void* ArenaAllocTB::allocate(size_t n) {
+  void* p = arena ? arena->alloc(n) : NULL;
+  return p ? p : malloc(n);
+}
+
+// Память арены освобождает откат к метке, а не документ
+void ArenaAllocTB::deallocate(void* p) {
+  if (!arena || !arena->owns(p)) {
+    free(p);
+  }
+}
+
+// ArduinoJson зовет только для shrinkToFit(): в арене блок остается
+void* ArenaAllocTB::reallocate(void* p, size_t n) {
+  if (arena && arena->owns(p)) {
+    return p;
+  }
+  return realloc(p, n);
+}
+
+bool TeleBot::arena(size_t size) {
+  // Тело опроса могло остаться в старом буфере
+  if (_pollBuf != NULL) {
+    _pollReset(true);
+  }
+  
+  if (!_arena.begin(size)) {
+    _error = "Arena alloc failed";
+    return false;
+  }
+  return true;
+}
+
+ArenaStatTB TeleBot::arenaStat() {
+  return _arena.stat();
+}
+
+// ==================== ДВА ЯДРА ====================
+
+RingTB::~RingTB() {
+  end();
+}
+
+bool RingTB::begin(uint8_t slots, size_t slotSize) {
+  end();
+  if (slots == 0) {
+    return false;
+  }
+  
+  _docs = new DynamicJsonDocument*[slots];
+  _size = slots;
+  for (uint8_t i = 0; i < slots; i++) {
+    _docs[i] = new DynamicJsonDocument(slotSize);
+    if (_docs[i]->capacity() == 0) {
+      _size = i + 1;
+      end();
+      return false;
+    }
+  }
+  
+  _head = 0;
+  _tail = 0;
+  _peak = 0;
+  _stalls = 0;
+  return true;
+}
+
+void RingTB::end() {
+  for (uint8_t i = 0; i < _size; i++) {
+    delete _docs[i];
+  }
+  delete[] _docs;
+  _docs = NULL;
+  _size = 0;
+}
+
+JsonDocument *RingTB::slot() {
+  uint32_t head = _head.load(std::memory_order_relaxed);
+  if (_size == 0 || head - _tail.load(std::memory_order_acquire) >= _size) {
+    return NULL;
+  }
+  return _docs[head % _size];
+}
+
+// Слот заполнен: читатель увидит его целиком после release
+void RingTB::push() {
+  uint32_t head = _head.load(std::memory_order_relaxed) + 1;
+  uint8_t depth = head - _tail.load(std::memory_order_acquire);
+  if (depth > _peak) {
+    _peak = depth;
+  }
+  _head.store(head, std::memory_order_release);
+}
+
+void RingTB::stall() {
+  _stalls++;
+}
+
+JsonDocument *RingTB::front() {
+  uint32_t tail = _tail.load(std::memory_order_relaxed);
+  if (tail == _head.load(std::memory_order_acquire)) {
+    return NULL;
+  }
+  return _docs[tail % _size];
+}
+
+void RingTB::pop() {
+  _tail.store(_tail.load(std::memory_order_relaxed) + 1, 
+              std::memory_order_release);
+}
+
+uint8_t RingTB::size() {
+  return _size;
+}
+
+RingStatTB RingTB::stat() {
+  RingStatTB st;
+  uint32_t head = _head.load(std::memory_order_acquire);
+  uint32_t tail = _tail.load(std::memory_order_acquire);
+  st.slots = _size;
+  st.depth = head - tail;
+  st.peak = _peak;
+  st.pushed = head;
+  st.popped = tail;
+  st.stalls = _stalls;
+  return st;
+}
+
+// Счетчики задачи dual() в общие
+static void mergeTB(StatsTB &to, const StatsTB &from) {
+  for (uint8_t i = 0; i < API_COUNT_TB; i++) {
+    to.api[i].calls += from.api[i].calls;
+    to.api[i].failed += from.api[i].failed;
+    to.api[i].time.merge(from.api[i].time);
+  }
+  to.connect.merge(from.connect);
+  to.ttfb.merge(from.ttfb);
+  to.total.merge(from.total);
+  to.batch.merge(from.batch);
+  to.updates += from.updates;
+  to.bytesOut += from.bytesOut;
+}
+
+static void mergeTB(ConnStatTB &to, const ConnStatTB &from) {
+  to.opened += from.opened;
+  to.reused += from.reused;
+  to.stale += from.stale;
+  to.failed += from.failed;
+  to.resolved += from.resolved;
+  to.cached += from.cached;
+}
+
+bool TeleBot::dual(bool enable, uint8_t slots, size_t slotSize) {
+  if (!enable) {
+    _stopTask();
+    
+    // Задача вышла: ее счетчики переходят в общие
+    if (!_netReset) {
+      mergeTB(_stats, _netStats);
+    }
+    _netStats = StatsTB();
+    _netReset = false;
+    mergeTB(_connStat, _netConn);
+    _netConn = ConnStatTB();
+    
+    // Разобранное, но не обработанное не теряем
+    _ringDispatch();
+    _ring.end();
+    return true;
+  }
+  
+  if (_task != NULL) {
+    return true;
+  }
+  
+  if (_hub != NULL || _hookServer != NULL) {
+    _error = "dual: bot is in TeleBotHub or in webhook mode";
+    return false;
+  }
+  
+  if (!_ring.begin(slots, slotSize)) {
+    _error = "dual: no memory for ring";
+    return false;
+  }
+  
+  // Опрос переходит в задачу: начинаем его с чистого состояния
+  if (_pollSt != POLL_IDLE_TB) {
+    _pollReset(true);
+  }
+  
+  _taskRun = true;
+  _taskLive = true;
+  if (xTaskCreatePinnedToCore(_netTask, "telebot", TASK_STACK_TB, this, 1, 
+                              &_task, 0) != pdPASS) {
+    _taskRun = false;
+    _taskLive = false;
+    _task = NULL;
+    _ring.end();
+    _error = "dual: task not created";
+    return false;
+  }
+  
+  if (_debug) Serial.println("Dual: net task on core 0");
+  return true;
+}
+
+RingStatTB TeleBot::ringStat() {
+  return _ring.stat();
+}
+
+// Задача сети: неблокирующий опрос по _poll, апдейты - в кольцо
+void TeleBot::_netTask(void *arg) {
+  TeleBot *bot = (TeleBot*)arg;
+  
+  while (bot->_taskRun) {
+    if (bot->_netReset) {
+      bot->_netStats = StatsTB();
+      bot->_netReset = false;
+    }
+    
+    if (!bot->isWiFi()) {
+      if (bot->_pollSt != POLL_IDLE_TB) {
+        bot->_pollReset(true);
+      }
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+      continue;
+    }
+    
+    bot->_pollStep();
+    
+    // Ждать нечего - отдаем ядро
+    if (bot->_pollSt == POLL_IDLE_TB || !bot->_poll->available()) {
+      vTaskDelay(1);
+    }
+  }
+  
+  if (bot->_pollSt != POLL_IDLE_TB) {
+    bot->_pollReset(true);
+  }
+  bot->_taskLive = false;
+  vTaskDelete(NULL);
+}
+
+void TeleBot::_stopTask() {
+  if (_task == NULL) {
+    return;
+  }
+  
+  // Задача выходит сама: в connect() или в ожидании слота ее не прервать.
+  // Ждем ее здесь, и во время TLS подключения это до таймаута connect()
+  _taskRun = false;
+  while (_taskLive) {
+    delay(1);
+  }
+  _task = NULL;
+}
+
+// Полное кольцо держит сеть: пока loop() не освободит слот,
+// новые апдейты не читаются
+JsonDocument *TeleBot::_ringSlot() {
+  JsonDocument *doc = _ring.slot();
+  if (doc != NULL) {
+    return doc;
+  }
+  
+  _ring.stall();
+  while ((doc = _ring.slot()) == NULL) {
+    if (!_taskRun) {
+      return NULL;
+    }
+    vTaskDelay(1);
+  }
+  return doc;
+}
+
+void TeleBot::_ringDispatch() {
+  // Не больше одного круга: пришедшее сейчас подождет следующего loop()
+  for (uint8_t i = _ring.size(); i > 0; i--) {
+    JsonDocument *doc = _ring.front();
+    if (doc == NULL) {
+      break;
+    }
+    _process(doc->as<JsonObject>());
+    _ring.pop();
+  }
+}
+
+// ==================== WEBHOOK ====================
+
+bool TeleBot::hook(uint16_t port, const String &url, const String &secret) {
+  if (_hub != NULL || _task != NULL) {
+    _error = "hook: bot is in TeleBotHub or dual()";
+    return false;
+  }
+  
+  if (secret.length() > HOOK_SECRET_TB) {
+    _error = "hook: secret too long";
+    return false;
+  }
+  
+  // Telegram шлет апдейты только на https: url - адрес прокси или
+  // туннеля, который передает их сюда обычным HTTP
+  if (url.length() > 0) {
+    char conns[8];
+    snprintf(conns, sizeof(conns), "%d", HOOK_CONNS_TB);
+    
+    ParamTB params[] = {
+      {"url", url.c_str(), url.length(), true},
+      {"secret_token", secret.length() ? secret.c_str() : NULL, 
+       secret.length(), true},
+      {"max_connections", conns, strlen(conns), false}
+    };
+    
+    if (!_request("setWebhook", params, 3)) {
+      return false;
+    }
+  }
+  
+  if (_pollSt != POLL_IDLE_TB) {
+    _pollReset(true);
+  }
+  
+  _hookEnd();
+  delete _hookServer;
+  _hookServer = new WiFiServer(port, HOOK_CONNS_TB);
+  _hookServer->begin();
+  _hookSecret = secret;
+  
+  if (_debug) {
+    Serial.print("Webhook on port ");
+    Serial.println(port);
+  }
+  return true;
+}
+
+bool TeleBot::unhook() {
+  if (_hookServer != NULL) {
+    _hookEnd();
+    _hookServer->end();
+    delete _hookServer;
+    _hookServer = NULL;
+  }
+  
+  // Пока webhook задан, getUpdates отвечает 409
+  return _request("deleteWebhook", NULL, 0);
+}
+
+HookStatTB TeleBot::hookStat() {
+  return _hookStat;
+}
+
+void TeleBot::_hookStep() {
+  // Соединения, которые уже ждут; новых не ждем. Запрос читается
+  // кусками, как опрос nonBlock(): медленный клиент не держит loop()
+  for (uint8_t i = 0; i < HOOK_CONNS_TB; i++) {
+    if (!_hookBusy) {
+      _hookClient = _hookServer->available();
+      if (!_hookClient) {
+        return;
+      }
+      _hookBusy = true;
+      _hookStart = millis();
+      _hookBody = "";
+      _hookHttp.reset();
+      _hookHttp.request(_hookSecret.c_str());
+    }
+    
+    int r = _hookRead();
+    if (r == 0) {
+      return;
+    }
+    if (r > 0) {
+      size_t mark = _arena.mark();
+      _hookServe();
+      _arena.rewind(mark);
+    }
+    _hookEnd();
+  }
+}
+
+void TeleBot::_hookEnd() {
+  if (_hookBusy) {
+    _hookClient.stop();
+  }
+  _hookBusy = false;
+  _hookBody = "";
+}
+
+// Не больше POLL_STEP_TB байт запроса за вызов. 0 - ждем еще,
+// 1 - принят целиком, -1 - отклонен или оборван
+int TeleBot::_hookRead() {
+  size_t budget = POLL_STEP_TB;
+  while (budget > 0 && !_hookHttp.inBody() && _hookClient.available()) {
+    budget--;
+    int r = _hookHttp.head(_hookClient.read());
+    if (r == 0) {
+      continue;
+    }
+    
+    int code = 0;
+    if (r < 0) {
+      code = 400;
+    } else if (!_hookHttp.post()) {
+      code = 405;
+    } else if (!_hookHttp.auth()) {
+      code = 403;
+    } else if (_hookHttp.length() > POLL_BODY_MAX_TB) {
+      code = 413;
+    }
+    
+    if (code != 0) {
+      if (_debug) {
+        Serial.print("Webhook: reject ");
+        Serial.println(code);
+      }
+      _hookStat.rejected++;
+      _hookReply(_hookClient, code);
+      return -1;
+    }
+    if (_hookHttp.length() > 0) {
+      _hookBody.reserve(_hookHttp.length());
+    }
+  }
+  
+  char buf[64];
+  while (budget > 0 && _hookHttp.inBody() && !_hookHttp.done() && 
+         _hookClient.available()) {
+    long n = _hookHttp.data();
+    if (n == 0) {
+      // Разметка chunked: размер куска и переводы строк
+      budget--;
+      if (_hookHttp.frame(_hookClient.read()) < 0) {
         break;
       }
+      continue;
     }
     
-    while (_client->available()) {
-      response += _client->readString();
+    size_t want = min((size_t)min(n, (long)budget), sizeof(buf));
+    int got = _hookClient.read((uint8_t*)buf, want);
+    if (got <= 0) {
+      break;
     }
+    _hookHttp.consume(got);
+    _hookBody.concat(buf, got);
+    budget -= got;
     
-    _client->stop();
-    
-    DynamicJsonDocument doc(1024);
-    DeserializationError error = deserializeJson(doc, response);
-    
-    if (!error) {
-      JsonArray results = doc["result"];
-      for (JsonObject update : results) {
-        long update_id = update["update_id"];
-        if (update_id > _lastID) {
-          _lastID = update_id;
-        }
-      }
+    // Chunked тело без длины: предел тот же, что и по Content-Length
+    if (_hookBody.length() > POLL_BODY_MAX_TB) {
+      _hookStat.rejected++;
+      _hookReply(_hookClient, 413);
+      return -1;
     }
   }
   
-  return response;
+  if (_hookHttp.inBody() && !_hookHttp.done() && 
+      !_hookClient.connected() && !_hookClient.available()) {
+    _hookHttp.eof();
+  }
+  
+  if (_hookHttp.done()) {
+    return 1;
+  }
+  if (_hookHttp.failed() || millis() - _hookStart > HOOK_TIMEOUT_TB ||
+      (!_hookClient.connected() && !_hookClient.available())) {
+    _hookStat.failed++;
+    return -1;
+  }
+  return 0;
 }
 
-void TeleBot::_process(JsonObject &update) {
-  if (update.containsKey("message")) {
-    _processMsg(update["message"]);
-  } else if (update.containsKey("callback_query")) {
-    _processInline(update["callback_query"]);
+// Один апдейт в POST: 200 уходит до обработчиков, чтобы Telegram
+// не ждал их и не слал апдейт повторно
+bool TeleBot::_hookServe() {
+  ArenaDocTB doc(MAX_MSG_SIZE, ArenaAllocTB(&_arena));
+  DeserializationError error = deserializeJson(doc, _hookBody);
+  
+  if (error && error != DeserializationError::NoMemory) {
+    _hookStat.failed++;
+    _error = "Webhook JSON: " + String(error.c_str());
+    _hookReply(_hookClient, 400);
+    return false;
+  }
+  
+  // Слишком большой апдейт подтверждаем, как и опрос его пропускает:
+  // иначе Telegram будет повторять его, а следующие встанут за ним.
+  // Потерю видно в hookStat().dropped
+  _hookReply(_hookClient, 200);
+  
+  if (error) {
+    _hookStat.dropped++;
+    _error = "Webhook JSON: " + String(error.c_str());
+    if (_debug) Serial.println("Webhook: update too big, dropped");
+    return false;
+  }
+  
+  JsonObject update = doc.as<JsonObject>();
+  long update_id = update["update_id"];
+  _advance(update_id);
+  _stats.updates++;
+  _hookStat.received++;
+  
+  if (_debug) {
+    Serial.print("Webhook update: ");
+    Serial.println(update_id);
   }
+  
+  _process(update);
+  return true;
+}
+
+void TeleBot::_hookReply(Client &client, int code) {
+  const char* text = code == 200 ? "OK" : code == 403 ? "Forbidden" : 
+                     code == 405 ? "Method Not Allowed" : 
+                     code == 413 ? "Payload Too Large" : "Bad Request";
+  char head[128];
+  snprintf(head, sizeof(head), 
+           "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+           code, text);
+  client.print(head);
+}
+
+// ==================== СОХРАНЕНИЕ OFFSET ====================
+
+// Запись offset в NVS или на SD: 16 байт, crc по первым 12
+struct OffsetRecTB {
+  uint32_t magic;
+  uint32_t bot;       // Хэш id бота из токена
+  int32_t offset;     // Последний обработанный update_id
+  uint32_t crc;
+};
+
+#define OFFSET_MAGIC_TB 0x31664254   // "TBf1"
+
+// Id бота - часть токена до ':'
+static size_t botIdTB(const char* token) {
+  const char* colon = strchr(token, ':');
+  return colon ? colon - token : strlen(token);
+}
+
+// Ключ NVS не длиннее 15 символов
+static void nvsKeyTB(const char* token, char* key) {
+  size_t len = min(botIdTB(token), (size_t)13);
+  key[0] = 't';
+  key[1] = 'b';
+  memcpy(key + 2, token, len);
+  key[len + 2] = 0;
 }
 
-void TeleBot::_processMsg(JsonObject &msgObj) {
-  MsgTB msg;
-  msg.chat_id = msgObj["chat"]["id"];
-  msg.msg_id = msgObj["message_id"];
-  msg.is_inline = false;
+bool TeleBot::persist(bool enable, const char* path, unsigned long every) {
+  if (!enable) {
+    bool ok = !_persist || _doneID == _savedID || save();
+    _persist = false;
+    return ok;
+  }
   
-  if (msgObj.containsKey("text")) {
-    msg.text = msgObj["text"].as<String>();
+  #ifndef TELEBOT_SD_ENABLE
+  if (path != NULL) {
+    _error = "SD support disabled";
+    return false;
   }
+  #endif
+  
+  _persist = true;
+  _persistPath = path ? path : "";
+  _persistEvery = every;
+  _savedAt = millis();
   
-  if (msgObj["from"].containsKey("username")) {
-    msg.user = msgObj["from"]["username"].as<String>();
+  OffsetRecTB rec;
+  bool found;
+  if (!_loadOffset(rec, found)) {
+    return false;
+  }
+  if (!found) {
+    if (_debug) Serial.println("Offset: nothing saved yet");
+    return true;
   }
   
-  if (msgObj["from"].containsKey("first_name")) {
-    msg.name = msgObj["from"]["first_name"].as<String>();
+  // Чужая запись (другой бот в той же NVS или файле) не подходит
+  uint32_t bot = _hash(_token, botIdTB(_token));
+  if (rec.magic != OFFSET_MAGIC_TB || rec.bot != bot ||
+      rec.crc != crcTB((const uint8_t*)&rec, offsetof(OffsetRecTB, crc))) {
+    _error = "Saved offset invalid";
+    return false;
   }
   
-  // Обработка команд
-  if (msg.text.startsWith("/")) {
-    int spacePos = msg.text.indexOf(' ');
-    String command = spacePos > 0 ? 
-                     msg.text.substring(0, spacePos) : 
-                     msg.text;
-    
-    for (int i = 0; i < _comCount; i++) {
-      if (_comHandlers[i].command == command) {
-        _comHandlers[i].handler(msg);
-        return;
-      }
-    }
+  _advance(rec.offset);
+  if (rec.offset > _doneID) {
+    _doneID = rec.offset;
   }
+  _savedID = rec.offset;
   
-  // Общий обработчик
-  if (_msgHandler != NULL) {
-    _msgHandler(msg);
+  if (_debug) {
+    Serial.print("Offset restored: ");
+    Serial.println(rec.offset);
   }
+  return true;
 }
 
-void TeleBot::_processInline(JsonObject &inlineObj) {
-  MsgTB msg;
-  msg.chat_id = inlineObj["message"]["chat"]["id"];
-  msg.msg_id = inlineObj["message"]["message_id"];
-  msg.is_inline = true;
-  msg.inline_id = inlineObj["id"].as<String>();
-  msg.inline_data = inlineObj["data"].as<String>();
-  
-  if (inlineObj["from"].containsKey("username")) {
-    msg.user = inlineObj["from"]["username"].as<String>();
+bool TeleBot::save() {
+  if (!_persist) {
+    _error = "Persist disabled";
+    return false;
   }
   
-  if (inlineObj["from"].containsKey("first_name")) {
-    msg.name = inlineObj["from"]["first_name"].as<String>();
+  OffsetRecTB rec;
+  rec.magic = OFFSET_MAGIC_TB;
+  rec.bot = _hash(_token, botIdTB(_token));
+  rec.offset = _doneID;
+  rec.crc = crcTB((const uint8_t*)&rec, offsetof(OffsetRecTB, crc));
+  
+  // Даже при ошибке следующая попытка не раньше, чем через _persistEvery
+  _savedAt = millis();
+  if (!_storeOffset(rec)) {
+    return false;
   }
   
-  if (_inlineHandler != NULL) {
-    _inlineHandler(msg);
+  _savedID = _doneID;
+  if (_debug) {
+    Serial.print("Offset saved: ");
+    Serial.println(_doneID);
   }
+  return true;
 }
 
-bool TeleBot::send(long chat_id, const String &text, 
-                   const String &parse, const String &keys) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&text=" + _encode(text);
+// Пишем не чаще раза в _persistEvery и только если offset сдвинулся
+void TeleBot::_persistStep() {
+  if (_doneID != _savedID && millis() - _savedAt >= _persistEvery) {
+    save();
+  }
+}
+
+// found = false и true - записи еще нет (первый запуск), это не ошибка
+bool TeleBot::_loadOffset(OffsetRecTB &out, bool &found) {
+  memset(&out, 0, sizeof(out));
+  found = false;
   
-  if (parse.length() > 0) {
-    params += "&parse_mode=" + parse;
+  #ifdef TELEBOT_SD_ENABLE
+  if (_persistPath.length() > 0) {
+    if (SD.cardType() == CARD_NONE) {
+      _error = "SD not ready";
+      return false;
+    }
+    
+    // Запись прервалась между remove() и rename() - остался .tmp
+    String paths[2] = {_persistPath, _persistPath + ".tmp"};
+    for (int i = 0; i < 2; i++) {
+      if (!SD.exists(paths[i])) {
+        continue;
+      }
+      found = true;
+      File file = SD.open(paths[i], FILE_READ);
+      if (!file) {
+        continue;
+      }
+      size_t got = file.read((uint8_t*)&out, sizeof(out));
+      file.close();
+      if (got == sizeof(out)) {
+        return true;
+      }
+    }
+    if (found) {
+      _error = "Saved offset unreadable";
+    }
+    return !found;
   }
+  #endif
   
-  if (keys.length() > 0) {
-    params += "&reply_markup=" + _encode(keys);
+  // Пространства имен нет, пока в него ничего не писали
+  Preferences prefs;
+  if (!prefs.begin("telebot", true)) {
+    return true;
   }
+  char key[16];
+  nvsKeyTB(_token, key);
+  found = prefs.getBytesLength(key) > 0;
+  size_t got = found ? prefs.getBytes(key, &out, sizeof(out)) : 0;
+  prefs.end();
   
-  String response;
-  bool ok = _request("sendMessage", params, response);
+  if (found && got != sizeof(out)) {
+    _error = "Saved offset unreadable";
+    return false;
+  }
+  return true;
+}
+
+bool TeleBot::_storeOffset(const OffsetRecTB &rec) {
+  #ifdef TELEBOT_SD_ENABLE
+  if (_persistPath.length() > 0) {
+    // Новая запись целиком ложится рядом и только потом заменяет старую
+    String tmp = _persistPath + ".tmp";
+    File file = SD.open(tmp, FILE_WRITE);
+    if (!file) {
+      _error = "Cannot write " + tmp;
+      return false;
+    }
+    size_t put = file.write((const uint8_t*)&rec, sizeof(rec));
+    file.close();
+    if (put != sizeof(rec)) {
+      _error = "Cannot write " + tmp;
+      return false;
+    }
+    SD.remove(_persistPath);
+    if (!SD.rename(tmp, _persistPath)) {
+      _error = "Cannot rename " + tmp;
+      return false;
+    }
+    return true;
+  }
+  #endif
   
-  if (_debug) {
-    Serial.print("Send: ");
-    Serial.println(ok ? "OK" : "FAIL");
+  // NVS сама распределяет запись по страницам flash
+  Preferences prefs;
+  if (!prefs.begin("telebot", false)) {
+    _error = "NVS open failed";
+    return false;
   }
+  char key[16];
+  nvsKeyTB(_token, key);
+  size_t put = prefs.putBytes(key, &rec, sizeof(rec));
+  prefs.end();
   
-  return ok;
+  if (put != sizeof(rec)) {
+    _error = "NVS write failed";
+    return false;
+  }
+  return true;
 }
 
-bool TeleBot::send(long chat_id, const String &text, const String &keys) {
-  return send(chat_id, text, "", keys);
+// Короткий getUpdates с сохраненным offset: сервер забывает все
+// старые апдейты, а соединение уже открыто к первому опросу.
+// Ответ не разбираем - обработчики могут быть еще не назначены,
+// этот апдейт придет снова
+bool TeleBot::_resume() {
+  char req[256];
+  unsigned long start = millis();
+  if (!_updatesReq(req, sizeof(req), 0, 1, !_keepAlive) || 
+      !_open("getUpdates", NULL, 0, req)) {
+    return _statCall(API_GET_UPDATES_TB, start, false);
+  }
+  
+  BodyTB body(*_client, _http);
+  body.skip();
+  _finish(!_http.done() || _http.close());
+  
+  if (_debug) {
+    Serial.print("Resume from: ");
+    Serial.println(_lastID + 1);
+  }
+  return _statCall(API_GET_UPDATES_TB, start, _status == 200);
 }
 
-bool TeleBot::sendIn(long chat_id, const String &text, const String &keys) {
-  return send(chat_id, text, "", keys);
-}
+// ==================== URL КОДИРОВАНИЕ ====================
 
-bool TeleBot::sendChat(long chat_id, const String &action) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&action=" + action;
-  
-  String response;
-  return _request("sendChatAction", params, response);
+// Класс байта: 1 - как есть, 2 - пробел ('+'), 0 - %XX
+static const uint8_t URL_TB[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const char HEX_TB[] = "0123456789ABCDEF";
+
+size_t TeleBot::encLen(const char* str, size_t len) {
+  size_t total = 0;
+  for (size_t i = 0; i < len; i++) {
+    total += URL_TB[(uint8_t)str[i]] ? 1 : 3;
+  }
+  return total;
 }
 
-bool TeleBot::answer(const String &inline_id, const String &text) {
-  String params = "callback_query_id=" + inline_id;
+size_t TeleBot::encode(char* buf, size_t cap, const char* str, size_t len) {
+  size_t pos = 0;
   
-  if (text.length() > 0) {
-    params += "&text=" + _encode(text);
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = str[i];
+    uint8_t cls = URL_TB[c];
+    
+    if (pos + (cls ? 1 : 3) > cap) {
+      break;
+    }
+    
+    if (cls == 1) {
+      buf[pos++] = c;
+    } else if (cls == 2) {
+      buf[pos++] = '+';
+    } else {
+      buf[pos++] = '%';
+      buf[pos++] = HEX_TB[c >> 4];
+      buf[pos++] = HEX_TB[c & 0xF];
+    }
   }
   
-  String response;
-  return _request("answerCallbackQuery", params, response);
+  return pos;
 }
 
-bool TeleBot::edit(long chat_id, long msg_id, const String &text, 
-                   const String &keys) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&message_id=" + String(msg_id) + 
-                  "&text=" + _encode(text);
+size_t TeleBot::encode(Print &out, const char* str, size_t len) {
+  char buf[64];
+  size_t total = 0;
+  size_t i = 0;
   
-  if (keys.length() > 0) {
-    params += "&reply_markup=" + _encode(keys);
+  // По 21 символу за раз: в худшем случае это 63 байта
+  while (i < len) {
+    size_t n = min(len - i, sizeof(buf) / 3);
+    size_t w = encode(buf, sizeof(buf), str + i, n);
+    total += out.write((const uint8_t*)buf, w);
+    i += n;
   }
   
-  String response;
-  return _request("editMessageText", params, response);
+  return total;
 }
 
-bool TeleBot::del(long chat_id, long msg_id) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&message_id=" + String(msg_id);
-  
-  String response;
-  return _request("deleteMessage", params, response);
+String TeleBot::encode(const String &str) {
+  String encoded;
+  encoded.reserve(encLen(str.c_str(), str.length()));
+  StrPrintTB out(encoded);
+  encode(out, str.c_str(), str.length());
+  return encoded;
 }
 
-bool TeleBot::photo(long chat_id, const String &photo_url, const String &caption) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&photo=" + _encode(photo_url);
-  
-  if (caption.length() > 0) {
-    params += "&caption=" + _encode(caption);
+String TeleBot::_encode(const String &str) {
+  return encode(str);
+}
+
+
+void TeleBot::on(MsgHandlerTB handler) {
+  _msgHandler = handler;
+  _msgView = NULL;
+}
+
+void TeleBot::on(ViewHandlerTB handler) {
+  _msgView = handler;
+  _msgHandler = NULL;
+}
+
+void TeleBot::com(const String &command, MsgHandlerTB handler) {
+  _addRoute(command.c_str(), command.length(), handler, NULL, true);
+}
+
+void TeleBot::com(const String &command, ViewHandlerTB handler) {
+  _addRoute(command.c_str(), command.length(), NULL, handler, true);
+}
+
+void TeleBot::com(const ComTB* table, size_t count) {
+  // Имена не копируем: таблица живет все время работы программы
+  for (size_t i = 0; i < count; i++) {
+    _addRoute(table[i].name, strlen(table[i].name), table[i].handler, NULL,
+              false);
   }
-  
-  String response;
-  return _request("sendPhoto", params, response);
 }
 
-bool TeleBot::document(long chat_id, const String &doc_url, const String &caption) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&document=" + _encode(doc_url);
+void TeleBot::name(const String &username) {
+  _botName = username.startsWith("@") ? username.substring(1) : username;
+}
+
+void TeleBot::inl(MsgHandlerTB handler) {
+  _inlineHandler = handler;
+  _inlineView = NULL;
+}
+
+void TeleBot::inl(ViewHandlerTB handler) {
+  _inlineView = handler;
+  _inlineHandler = NULL;
+}
+
+void TeleBot::server(unsigned long interval) {
+  _checkTime = interval;
+}
+
+void TeleBot::debug(bool enable) {
+  _debug = enable;
+}
+
+void TeleBot::insecure(bool enable) {
+  _insecure = enable;
+  if (enable) {
+    _ca = NULL;
+  }
+}
+
+// Указатель хранится: строка должна жить все время работы бота
+void TeleBot::cert(const char* ca) {
+  _ca = ca;
+  _insecure = ca == NULL;
+}
+
+// Старое имя: на деле включало и выключало проверку сертификата
+void TeleBot::useDNS(bool enable) {
+  insecure(enable);
+}
+
+void TeleBot::nonBlock(bool enable, int longPoll) {
+  _nonBlock = enable;
+  _longPoll = longPoll;
   
-  if (caption.length() > 0) {
-    params += "&caption=" + _encode(caption);
+  if (!enable && _pollSt != POLL_IDLE_TB) {
+    _pollReset(true);
   }
+}
+
+void TeleBot::keepAlive(bool enable, unsigned long idle) {
+  _keepAlive = enable;
+  _idleTime = idle;
   
-  String response;
-  return _request("sendDocument", params, response);
+  // Сокет хаба может быть занят опросом другого бота
+  if (!enable && _hub == NULL && _client->connected()) {
+    _client->stop();
+  }
+}
+
+String TeleBot::lastError() {
+  return _error;
+}
+
+long TeleBot::lastUpdate() {
+  return _lastID;
+}
+
+ConnStatTB TeleBot::connStat() {
+  ConnStatTB conn = _connStat;
+  mergeTB(conn, _netConn);
+  return conn;
+}
+
+PollStTB TeleBot::pollState() {
+  return _pollSt;
+}
+
+int TeleBot::lastStatus() {
+  return _status;
+}
+
+void TeleBot::onHeader(HeaderHandlerTB handler) {
+  _headerHandler = handler;
+}
+
+// ==================== СТАТИСТИКА ====================
+
+// Имена в порядке ApiTB
+static const char* const API_NAMES_TB[API_COUNT_TB] = {
+  "getUpdates", "sendMessage", "editMessageText", "deleteMessage",
+  "answerCallbackQuery", "sendPhoto", "sendDocument", "sendLocation",
+  "sendChatAction", "getMe", "setWebhook", "deleteWebhook",
+  "editMessageLiveLocation", "stopMessageLiveLocation", "other"
+};
+
+void HistTB::add(uint32_t value) {
+  // Номер корзины - число бит в (value - 1): 1 -> 0, 2 -> 1, 3..4 -> 2
+  uint8_t i = value <= 1 ? 0 : 32 - __builtin_clz(value - 1);
+  buckets[i < HIST_TB ? i : HIST_TB - 1]++;
+  count++;
+  sum += value;
+  if (value > max) {
+    max = value;
+  }
 }
 
-bool TeleBot::location(long chat_id, float lat, float lon) {
-  String params = "chat_id=" + String(chat_id) + 
-                  "&latitude=" + String(lat, 6) + 
-                  "&longitude=" + String(lon, 6);
+void HistTB::merge(const HistTB &other) {
+  for (uint8_t i = 0; i < HIST_TB; i++) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  sum += other.sum;
+  if (other.max > max) {
+    max = other.max;
+  }
+}
+
+uint32_t HistTB::quantile(float q) const {
+  if (count == 0) {
+    return 0;
+  }
   
-  String response;
-  return _request("sendLocation", params, response);
+  uint32_t need = (uint32_t)(q * count + 0.999f);
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < HIST_TB - 1; i++) {
+    seen += buckets[i];
+    if (seen >= need) {
+      return min((uint32_t)1 << i, max);
+    }
+  }
+  return max;
 }
 
-String TeleBot::get() {
-  String response;
-  if (_request("getMe", "", response)) {
-    return response;
+uint8_t TeleBot::_api(const String &method) {
+  for (uint8_t i = 0; i < API_OTHER_TB; i++) {
+    if (method == API_NAMES_TB[i]) {
+      return i;
+    }
   }
-  return "";
+  return API_OTHER_TB;
 }
 
-String TeleBot::createKey(const String keys[][2], int rows, 
-                         bool resize, bool once) {
-  DynamicJsonDocument doc(1024);
-  JsonArray keyboard = doc.createNestedArray("keyboard");
+bool TeleBot::_statCall(uint8_t api, unsigned long start, bool ok) {
+  return _statCall(_stats, api, start, ok);
+}
+
+bool TeleBot::_statCall(StatsTB &stats, uint8_t api, unsigned long start, 
+                        bool ok) {
+  uint32_t ms = millis() - start;
+  MethodStatTB &m = stats.api[api];
+  m.calls++;
+  if (!ok) {
+    m.failed++;
+  }
+  m.time.add(ms);
   
-  for (int i = 0; i < rows; i++) {
-    JsonArray row = keyboard.createNestedArray();
-    row.add(keys[i][0]);
-    if (keys[i][1].length() > 0) {
-      row.add(keys[i][1]);
+  // Ответ на getUpdates сервер задерживает на long poll: в общие
+  // задержки он не идет
+  if (api != API_GET_UPDATES_TB) {
+    stats.total.add(ms);
+    if (_ttfb >= 0) {
+      stats.ttfb.add(_ttfb);
     }
   }
+  return ok;
+}
+
+// Опрос в dual() ведет задача: счетчики у нее свои, а loop() их только
+// читает. Без задачи опрос идет из loop() и пишет в общие
+StatsTB &TeleBot::_pollStats() {
+  return _taskLive ? _netStats : _stats;
+}
+
+ConnStatTB &TeleBot::_pollConn() {
+  return _taskLive ? _netConn : _connStat;
+}
+
+// offset только растет: задача dual() и persist() двигают его вместе
+void TeleBot::_advance(long id) {
+  long last = _lastID;
+  while (id > last && !_lastID.compare_exchange_weak(last, id)) {
+  }
+}
+
+StatsTB TeleBot::stats() {
+  StatsTB snap = _stats;
+  // Копия на ходу задачи: счетчики в ней могут разойтись на один вызов
+  if (!_netReset) {
+    mergeTB(snap, _netStats);
+  }
+  snap.bytesIn = _http.bytes() + _pollHttp.bytes() - _inBase;
+  snap.queueDepth = _qStat.depth;
+  snap.queuePeak = _qStat.peak;
+  snap.freeHeap = ESP.getFreeHeap();
+  snap.minFreeHeap = ESP.getMinFreeHeap();
+  snap.maxAlloc = ESP.getMaxAllocHeap();
+  snap.uptime = millis() - _statsStart;
+  return snap;
+}
+
+void TeleBot::resetStats() {
+  _stats = StatsTB();
+  for (uint8_t i = 0; i < API_COUNT_TB; i++) {
+    _stats.api[i].name = API_NAMES_TB[i];
+  }
+  _statsStart = millis();
+  _inBase = _http.bytes() + _pollHttp.bytes();
+  // Свои счетчики задача dual() обнулит сама
+  _netReset = _taskLive.load();
+}
+
+String TeleBot::statsText() {
+  StatsTB st = stats();
+  String out;
+  out.reserve(512);
   
-  doc["resize_keyboard"] = resize;
-  doc["one_time_keyboard"] = once;
+  unsigned long sec = st.uptime / 1000;
+  out += "up " + String(sec / 3600) + "h" + String(sec / 60 % 60) + "m";
+  out += " heap " + String(st.freeHeap) + " min " + String(st.minFreeHeap) +
+         " blk " + String(st.maxAlloc) + "\n";
+  out += "upd " + String(st.updates) + " polls " + String(st.batch.count) +
+         " max " + String(st.batch.max) + "\n";
+  out += "in " + String(st.bytesIn) + " out " + String(st.bytesOut) + " B";
+  out += " q " + String(st.queueDepth) + "/" + String(st.queuePeak) + "\n";
+  out += "conn " + String(st.connect.count) + " p50 " + String(st.connect.quantile(0.5f)) +
+         " p99 " + String(st.connect.quantile(0.99f)) + " ms\n";
+  out += "ttfb p50 " + String(st.ttfb.quantile(0.5f)) +
+         " p99 " + String(st.ttfb.quantile(0.99f)) + " ms\n";
   
-  String output;
-  serializeJson(doc, output);
-  return output;
+  // Только методы, которые вызывались: вызовы/ошибки p50/p99 мс
+  for (uint8_t i = 0; i < API_COUNT_TB; i++) {
+    const MethodStatTB &m = st.api[i];
+    if (m.calls == 0) {
+      continue;
+    }
+    out += String(m.name) + " " + String(m.calls) + "/" + String(m.failed) +
+           " " + String(m.time.quantile(0.5f)) + "/" + String(m.time.quantile(0.99f)) + "\n";
+  }
+  return out;
 }
 
-String TeleBot::createIn(const String keys[][3], int rows, bool delBtn) {
-  DynamicJsonDocument doc(1024);
-  JsonArray keyboard = doc.createNestedArray("inline_keyboard");
-  
-  for (int i = 0; i < rows; i++) {
-    JsonArray row = keyboard.createNestedArray();
-    JsonObject btn = row.createNestedObject();
-    btn["text"] = keys[i][0];
-    btn["callback_data"] = keys[i][1];
-    
-    if (keys[i][2].length() > 0) {
-      btn["url"] = keys[i][2];
+// Гистограмма Prometheus: корзины накопительные, le - верхняя граница
+static void histPromTB(Print &out, const char* name, const char* label, 
+                       const HistTB &h) {
+  uint32_t seen = 0;
+  for (uint8_t i = 0; i < HIST_TB; i++) {
+    seen += h.buckets[i];
+    out.print(name);
+    out.print("_bucket{");
+    out.print(label);
+    if (i < HIST_TB - 1) {
+      out.printf("le=\"%lu\"} %lu\n", 1UL << i, (unsigned long)seen);
+    } else {
+      out.printf("le=\"+Inf\"} %lu\n", (unsigned long)seen);
     }
   }
   
-  if (delBtn) {
-    JsonArray row = keyboard.createNestedArray();
-    JsonObject btn = row.createNestedObject();
-    btn["text"] = "❌ Удалить";
-    btn["callback_data"] = "delete";
+  // Без меток имя идет без фигурных скобок
+  const char* open = *label ? "{" : "";
+  const char* close = *label ? "}" : "";
+  size_t len = *label ? strlen(label) - 1 : 0;   // Без завершающей запятой
+  out.printf("%s_sum%s%.*s%s %lu\n", name, open, (int)len, label, close, (unsigned long)h.sum);
+  out.printf("%s_count%s%.*s%s %lu\n", name, open, (int)len, label, close, (unsigned long)h.count);
+}
+
+void TeleBot::statsProm(Print &out) {
+  StatsTB st = stats();
+  char label[40];
+  
+  out.println("# TYPE telebot_api_calls_total counter");
+  for (uint8_t i = 0; i < API_COUNT_TB; i++) {
+    out.printf("telebot_api_calls_total{method=\"%s\"} %lu\n", 
+               st.api[i].name, (unsigned long)st.api[i].calls);
+  }
+  out.println("# TYPE telebot_api_failures_total counter");
+  for (uint8_t i = 0; i < API_COUNT_TB; i++) {
+    out.printf("telebot_api_failures_total{method=\"%s\"} %lu\n", 
+               st.api[i].name, (unsigned long)st.api[i].failed);
+  }
+  out.println("# TYPE telebot_api_duration_ms histogram");
+  for (uint8_t i = 0; i < API_COUNT_TB; i++) {
+    if (st.api[i].calls == 0) {
+      continue;
+    }
+    snprintf(label, sizeof(label), "method=\"%s\",", st.api[i].name);
+    histPromTB(out, "telebot_api_duration_ms", label, st.api[i].time);
   }
   
-  String output;
-  serializeJson(doc, output);
-  return output;
+  out.println("# TYPE telebot_connect_ms histogram");
+  histPromTB(out, "telebot_connect_ms", "", st.connect);
+  out.println("# TYPE telebot_ttfb_ms histogram");
+  histPromTB(out, "telebot_ttfb_ms", "", st.ttfb);
+  out.println("# TYPE telebot_request_ms histogram");
+  histPromTB(out, "telebot_request_ms", "", st.total);
+  out.println("# TYPE telebot_updates_per_poll histogram");
+  histPromTB(out, "telebot_updates_per_poll", "", st.batch);
+  
+  out.println("# TYPE telebot_updates_total counter");
+  out.printf("telebot_updates_total %lu\n", (unsigned long)st.updates);
+  out.println("# TYPE telebot_bytes_in_total counter");
+  out.printf("telebot_bytes_in_total %lu\n", (unsigned long)st.bytesIn);
+  out.println("# TYPE telebot_bytes_out_total counter");
+  out.printf("telebot_bytes_out_total %lu\n", (unsigned long)st.bytesOut);
+  out.println("# TYPE telebot_queue_depth gauge");
+  out.printf("telebot_queue_depth %u\n", st.queueDepth);
+  out.println("# TYPE telebot_queue_peak gauge");
+  out.printf("telebot_queue_peak %u\n", st.queuePeak);
+  out.println("# TYPE telebot_heap_free_bytes gauge");
+  out.printf("telebot_heap_free_bytes %lu\n", (unsigned long)st.freeHeap);
+  out.println("# TYPE telebot_heap_min_free_bytes gauge");
+  out.printf("telebot_heap_min_free_bytes %lu\n", (unsigned long)st.minFreeHeap);
+  out.println("# TYPE telebot_heap_max_alloc_bytes gauge");
+  out.printf("telebot_heap_max_alloc_bytes %lu\n", (unsigned long)st.maxAlloc);
+  out.println("# TYPE telebot_uptime_seconds counter");
+  out.printf("telebot_uptime_seconds %lu\n", st.uptime / 1000);
 }
 
-String TeleBot::createURL(const String keys[][2], int rows) {
-  DynamicJsonDocument doc(1024);
-  JsonArray keyboard = doc.createNestedArray("inline_keyboard");
+// ==================== ХАБ БОТОВ ====================
+
+TeleBotHub::TeleBotHub(uint8_t conns, int wait) : _wait(wait) {
+  _size = conns < 1 ? 1 : (conns > HUB_CONNS_TB ? HUB_CONNS_TB : conns);
+  _conns = new ConnTB[_size];
   
-  for (int i = 0; i < rows; i++) {
-    JsonArray row = keyboard.createNestedArray();
-    JsonObject btn = row.createNestedObject();
-    btn["text"] = keys[i][0];
-    btn["url"] = keys[i][1];
+  for (uint8_t i = 0; i < _size; i++) {
+    _conns[i].client.setInsecure();
   }
-  
-  String output;
-  serializeJson(doc, output);
-  return output;
 }
 
-bool TeleBot::_request(const String &method, const String &params, 
-                       String &response) {
-  if (!_client->connect("api.telegram.org", 443)) {
-    if (_debug) Serial.println("Connect FAIL");
+TeleBotHub::~TeleBotHub() {
+  // Боты возвращаются к своим клиентам
+  for (uint8_t i = 0; i < _count; i++) {
+    TeleBot *bot = _bots[i];
+    if (bot->_pollSt != POLL_IDLE_TB) {
+      bot->_pollReset(true);
+    }
+    bot->_hub = NULL;
+    bot->_client = _own[i];
+    bot->_poll = &bot->_pollClient;
+  }
+  delete[] _conns;
+}
+
+bool TeleBotHub::add(TeleBot &bot) {
+  if (_count >= HUB_BOTS_TB || bot._hub != NULL) {
     return false;
   }
   
-  String req = "POST /bot" + String(_token) + "/" + method + " HTTP/1.1\r\n";
-  req += "Host: api.telegram.org\r\n";
-  req += "Content-Type: application/x-www-form-urlencoded\r\n";
-  req += "Content-Length: " + String(params.length()) + "\r\n";
-  req += "Connection: close\r\n\r\n";
-  req += params;
-  
-  _client->print(req);
-  
-  unsigned long timeout = millis() + 5000;
-  while (!_client->available() && millis() < timeout) {
-    delay(10);
+  if (bot._pollSt != POLL_IDLE_TB) {
+    bot._pollReset(true);
   }
+  bot._client->stop();
   
-  while (_client->available()) {
-    String line = _client->readStringUntil('\n');
-    if (line == "\r") {
-      break;
-    }
+  // Опрос всегда неблокирующий: пока один бот ждет ответа,
+  // остальные работают
+  _own[_count] = bot._client;
+  bot._hub = this;
+  bot._nonBlock = true;
+  bot._longPoll = _wait;
+  _bots[_count++] = &bot;
+  return true;
+}
+
+void TeleBotHub::loop() {
+  if (_count == 0) {
+    return;
   }
   
-  response = "";
-  while (_client->available()) {
-    response += _client->readString();
+  if (WiFi.status() != WL_CONNECTED) {
+    for (uint8_t i = 0; i < _count; i++) {
+      if (_bots[i]->_pollSt != POLL_IDLE_TB) {
+        _bots[i]->_pollReset(true);
+      }
+      _release(_bots[i]);
+    }
+    // Реконнект по настройкам первого бота
+    _bots[0]->loop();
+    return;
   }
   
-  _client->stop();
-  
-  DynamicJsonDocument doc(512);
-  DeserializationError error = deserializeJson(doc, response);
-  
-  if (!error && doc["ok"] == true) {
-    return true;
+  // Подключение записывает в кэш точку и историю сети
+  if (_bots[0]->_apCount > 0) {
+    _bots[0]->_wifiStep();
   }
   
-  return false;
-}
-
-String TeleBot::_encode(const String &str) {
-  String encoded = "";
-  char c;
-  
-  for (unsigned int i = 0; i < str.length(); i++) {
-    c = str[i];
+  // Каждый круг начинается со следующего бота: свободное соединение
+  // и первая отправка из очереди достаются всем по очереди
+  for (uint8_t n = 0; n < _count; n++) {
+    TeleBot *bot = _bots[(_next + n) % _count];
     
-    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
-      encoded += c;
-    } else if (c == ' ') {
-      encoded += '+';
-    } else {
-      encoded += '%';
-      encoded += String((c >> 4) & 0xF, HEX);
-      encoded += String(c & 0xF, HEX);
+    if (bot->_persist) {
+      bot->_persistStep();
+    }
+    
+    // Очередь ждет свободный сокет, а не прерывает чужой опрос
+    if (bot->_qCount > 0 && _free() != NULL) {
+      bot->_drainQueue();
+    }
+    if (bot->_livePend > 0 && _free() != NULL) {
+      bot->_liveStep();
+    }
+    if (bot->_aCount > 0 && _free() != NULL) {
+      bot->_pipeBatch();
+    }
+    
+    if (bot->_pollSt == POLL_IDLE_TB) {
+      if (millis() - bot->_lastCheck <= bot->_checkTime) {
+        continue;
+      }
+      
+      ConnTB *conn = _free();
+      if (conn == NULL) {
+        continue;
+      }
+      
+      // Простаивавший сокет сервер мог уже закрыть
+      if (conn->client.connected() && 
+          millis() - conn->lastUse >= bot->_idleTime) {
+        conn->client.stop();
+      }
+      conn->owner = bot;
+      bot->_poll = &conn->client;
+    }
+    
+    bot->_pollStep();
+    
+    if (bot->_pollSt == POLL_IDLE_TB) {
+      _release(bot);
     }
   }
   
-  return encoded;
+  _next = (_next + 1) % _count;
 }
 
-void TeleBot::on(MsgHandlerTB handler) {
-  _msgHandler = handler;
+uint8_t TeleBotHub::count() {
+  return _count;
 }
 
-void TeleBot::com(const String &command, MsgHandlerTB handler) {
-  if (_comCount < 15) {
-    _comHandlers[_comCount].command = command;
-    _comHandlers[_comCount].handler = handler;
-    _comCount++;
+uint8_t TeleBotHub::active() {
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < _size; i++) {
+    if (_conns[i].client.connected()) {
+      n++;
+    }
   }
+  return n;
 }
 
-void TeleBot::inl(MsgHandlerTB handler) {
-  _inlineHandler = handler;
-}
-
-void TeleBot::server(unsigned long interval) {
-  _checkTime = interval;
+bool TeleBotHub::_busy(ConnTB &conn) {
+  return conn.owner != NULL && conn.owner->_pollSt != POLL_IDLE_TB;
 }
 
-void TeleBot::debug(bool enable) {
-  _debug = enable;
+// Свободное соединение: сначала уже открытое, потом любое
+TeleBotHub::ConnTB *TeleBotHub::_free() {
+  ConnTB *cold = NULL;
+  
+  for (uint8_t i = 0; i < _size; i++) {
+    if (_busy(_conns[i])) {
+      continue;
+    }
+    if (_conns[i].client.connected()) {
+      return &_conns[i];
+    }
+    if (cold == NULL) {
+      cold = &_conns[i];
+    }
+  }
+  return cold;
 }
 
-void TeleBot::useDNS(bool enable) {
-  _useDNS = enable;
+WiFiClientSecure *TeleBotHub::_take(TeleBot &bot) {
+  ConnTB *conn = _free();
+  
+  if (conn == NULL) {
+    // Все сокеты заняты опросом: отправка важнее, опрос повторится
+    conn = &_conns[_next % _size];
+    conn->owner->_pollReset(true);
+    _release(conn->owner);
+  }
+  
+  bot._lastUse = conn->lastUse;
+  return &conn->client;
 }
 
-String TeleBot::lastError() {
-  return _error;
+void TeleBotHub::_used(WiFiClientSecure *client) {
+  for (uint8_t i = 0; i < _size; i++) {
+    if (&_conns[i].client == client) {
+      _conns[i].lastUse = millis();
+      return;
+    }
+  }
 }
 
-long TeleBot::lastUpdate() {
-  return _lastID;
+void TeleBotHub::_release(TeleBot *bot) {
+  for (uint8_t i = 0; i < _size; i++) {
+    if (_conns[i].owner == bot) {
+      _conns[i].owner = NULL;
+      _conns[i].lastUse = millis();
+    }
+  }
+  bot->_poll = &bot->_pollClient;
 }
 
 // ==================== SD КАРТА МЕТОДЫ ====================
@@ -635,7 +5152,7 @@ bool TeleBot::initSD(int csPin, uint32_t freq) {
     }
     
     uint64_t cardSize = SD.cardSize() / (1024 * 1024);
-    Serial.printf("SD Card Size: %lluMB\n", cardSize);
+    Serial.printf("SD Card Size: %lluMB\n", (unsigned long long)cardSize);
   }
   
   return true;
@@ -656,33 +5173,143 @@ bool TeleBot::initSD(const char* mountPoint) {
   return true;
 }
 
-String TeleBot::readSD(const String &path, FileTypeTB type) {
+SDReaderTB::~SDReaderTB() {
+  close();
+}
+
+bool SDReaderTB::open(const String &path) {
+  close();
+  _file = SD.open(path);
+  if (_file && _file.isDirectory()) {
+    _file.close();
+  }
+  return (bool)_file;
+}
+
+void SDReaderTB::close() {
+  if (_file) {
+    _file.close();
+  }
+  _pos = 0;
+  _len = 0;
+  _read = 0;
+}
+
+bool SDReaderTB::isOpen() {
+  return (bool)_file;
+}
+
+// Целый сектор за одно обращение к карте
+bool SDReaderTB::_fill() {
+  if (!_file) {
+    return false;
+  }
+  _len = _file.read(_buf, sizeof(_buf));
+  _pos = 0;
+  return _len > 0;
+}
+
+size_t SDReaderTB::read(uint8_t* buf, size_t cap) {
+  size_t total = 0;
+  
+  while (total < cap) {
+    if (_pos >= _len) {
+      // Целые сектора читаем прямо в буфер вызывающего
+      if (cap - total >= sizeof(_buf) && _file) {
+        size_t n = _file.read(buf + total, (cap - total) / sizeof(_buf) * 
+                                           sizeof(_buf));
+        if (n == 0) {
+          break;
+        }
+        total += n;
+        continue;
+      }
+      if (!_fill()) {
+        break;
+      }
+    }
+    
+    size_t n = min(cap - total, _len - _pos);
+    memcpy(buf + total, _buf + _pos, n);
+    _pos += n;
+    total += n;
+  }
+  
+  _read += total;
+  return total;
+}
+
+int SDReaderTB::line(char* buf, size_t cap, char sep) {
+  size_t len = 0;
+  bool any = false;
+  
+  while (true) {
+    if (_pos >= _len && !_fill()) {
+      break;
+    }
+    any = true;
+    
+    // Разделитель ищем в буфере сектора, а не по байту из файла
+    const uint8_t* start = _buf + _pos;
+    const uint8_t* end = (const uint8_t*)memchr(start, sep, _len - _pos);
+    size_t n = end ? end - start : _len - _pos;
+    
+    // Не поместившийся хвост длинной строки отбрасываем
+    size_t copy = min(n, cap - 1 - len);
+    memcpy(buf + len, start, copy);
+    len += copy;
+    
+    _pos += n;
+    _read += n;
+    if (end != NULL) {
+      _pos++;
+      _read++;
+      break;
+    }
+  }
+  
+  if (!any) {
+    return -1;
+  }
+  
+  if (sep == '\n' && len > 0 && buf[len - 1] == '\r') {
+    len--;
+  }
+  buf[len] = 0;
+  return len;
+}
+
+size_t SDReaderTB::size() {
+  return _file ? _file.size() : 0;
+}
+
+size_t SDReaderTB::position() {
+  return _read;
+}
+
+String TeleBot::readSD(const String &path, FileTypeTB) {
   if (!_sdInitialized) {
     _error = "SD not initialized";
     return "";
   }
   
-  File file = SD.open(path);
-  if (!file) {
+  // Текст и бинарные файлы читаются одинаково: блоками по сектору
+  // в строку, выделенную один раз под размер файла
+  SDReaderTB reader;
+  if (!reader.open(path)) {
     _error = "File not found: " + path;
     if (_debug) Serial.println("Failed to open file: " + path);
     return "";
   }
   
-  String content = "";
-  if (type == FILE_BIN_TB) {
-    // Для бинарных файлов читаем как байты
-    while (file.available()) {
-      content += (char)file.read();
-    }
-  } else {
-    // Для текстовых файлов
-    while (file.available()) {
-      content += file.readString();
-    }
-  }
+  String content;
+  content.reserve(reader.size());
   
-  file.close();
+  uint8_t buf[SD_BLOCK_TB];
+  size_t n;
+  while ((n = reader.read(buf, sizeof(buf))) > 0) {
+    content.concat((const char*)buf, n);
+  }
   
   if (_debug) {
     Serial.print("Read from SD: ");
@@ -695,7 +5322,324 @@ String TeleBot::readSD(const String &path, FileTypeTB type) {
   return content;
 }
 
-bool TeleBot::recordSD(const String &path, const String &data, FileTypeTB type) {
+size_t TeleBot::readSD(const String &path, ChunkHandlerTB handler, 
+                       void* arg, size_t block) {
+  if (!_sdInitialized) {
+    _error = "SD not initialized";
+    return 0;
+  }
+  
+  SDReaderTB reader;
+  if (!reader.open(path)) {
+    _error = "File not found: " + path;
+    return 0;
+  }
+  
+  // Блок кратен сектору: каждое чтение - целые сектора карты
+  block = max((size_t)SD_BLOCK_TB, block / SD_BLOCK_TB * SD_BLOCK_TB);
+  uint8_t* buf = (uint8_t*)malloc(block);
+  if (buf == NULL) {
+    _error = "No memory for SD block";
+    return 0;
+  }
+  
+  size_t total = 0;
+  size_t n;
+  while ((n = reader.read(buf, block)) > 0) {
+    total += n;
+    if (!handler(buf, n, arg)) {
+      break;
+    }
+  }
+  
+  free(buf);
+  return total;
+}
+
+size_t TeleBot::linesSD(const String &path, LineHandlerTB handler,
+                        void* arg, char sep) {
+  if (!_sdInitialized) {
+    _error = "SD not initialized";
+    return 0;
+  }
+  
+  SDReaderTB reader;
+  if (!reader.open(path)) {
+    _error = "File not found: " + path;
+    return 0;
+  }
+  
+  char line[SD_LINE_TB];
+  size_t count = 0;
+  int len;
+  while ((len = reader.line(line, sizeof(line), sep)) >= 0) {
+    count++;
+    if (!handler(line, len, arg)) {
+      break;
+    }
+  }
+  
+  return count;
+}
+
+size_t TeleBot::csvSD(const String &path, CsvHandlerTB handler,
+                      void* arg, char delim) {
+  if (!_sdInitialized) {
+    _error = "SD not initialized";
+    return 0;
+  }
+  
+  SDReaderTB reader;
+  if (!reader.open(path)) {
+    _error = "File not found: " + path;
+    return 0;
+  }
+  
+  char line[SD_LINE_TB];
+  ArgTB fields[MAX_FIELDS_TB];
+  size_t count = 0;
+  int len;
+  
+  while ((len = reader.line(line, sizeof(line))) >= 0) {
+    if (len == 0) {
+      continue;
+    }
+    
+    // Поля указывают внутрь line; кавычки вокруг поля снимаются,
+    // разделитель внутри кавычек не поддерживается
+    uint8_t n = 0;
+    char* p = line;
+    char* end = line + len;
+    while (n < MAX_FIELDS_TB) {
+      char* next = (char*)memchr(p, delim, end - p);
+      char* stop = next ? next : end;
+      
+      ArgTB &f = fields[n++];
+      if (stop - p >= 2 && *p == '"' && stop[-1] == '"') {
+        f.ptr = p + 1;
+        f.len = stop - p - 2;
+      } else {
+        f.ptr = p;
+        f.len = stop - p;
+      }
+      
+      if (next == NULL) {
+        break;
+      }
+      p = next + 1;
+    }
+    
+    count++;
+    if (!handler(fields, n, arg)) {
+      break;
+    }
+  }
+  
+  return count;
+}
+
+// ==================== ЖУРНАЛ НА SD ====================
+
+LogTB::LogTB(size_t bufSize) : _cap(bufSize) {
+  _buf = (uint8_t*)malloc(bufSize);
+  if (_buf == NULL) {
+    _cap = 0;
+  }
+}
+
+LogTB::~LogTB() {
+  end();
+  free(_buf);
+}
+
+bool LogTB::begin(const String &path, unsigned long flushMs, 
+                  size_t maxSize, bool daily) {
+  end();
+  _path = path;
+  _flushMs = flushMs;
+  _maxSize = maxSize;
+  _daily = daily;
+  _day = _today();
+  _lastFlush = millis();
+  return _cap > 0 && _open();
+}
+
+void LogTB::end() {
+  if (_file) {
+    flush();
+    _file.close();
+  }
+}
+
+bool LogTB::_open() {
+  _file = SD.open(_path, FILE_APPEND);
+  if (!_file) {
+    _stat.errors++;
+    return false;
+  }
+  _fileSize = _file.size();
+  return true;
+}
+
+// День по часам ESP32 (после SNTP), -1 - время не установлено
+int LogTB::_today() {
+  time_t now = time(NULL);
+  if (now < 1600000000) {
+    return -1;
+  }
+  struct tm t;
+  localtime_r(&now, &t);
+  return (t.tm_year + 1900) * 10000 + (t.tm_mon + 1) * 100 + t.tm_mday;
+}
+
+bool LogTB::add(const char* data, size_t len) {
+  return _record(data, len, NULL, 0);
+}
+
+bool LogTB::add(const String &data) {
+  return _record(data.c_str(), data.length(), NULL, 0);
+}
+
+bool LogTB::line(const String &text) {
+  return _record(text.c_str(), text.length(), "\n", 1);
+}
+
+// Запись попадает в буфер целиком или не попадает вовсе
+bool LogTB::_record(const char* data, size_t len, 
+                    const char* tail, size_t tailLen) {
+  size_t total = len + tailLen;
+  if (_cap == 0 || total > _cap) {
+    _stat.dropped++;
+    return false;
+  }
+  
+  // Места нет - сначала пробуем освободить буфер
+  if (_count + total > _cap) {
+    flush();
+    if (_count + total > _cap) {
+      _stat.dropped++;
+      return false;
+    }
+  }
+  
+  _push(data, len);
+  _push(tail, tailLen);
+  _stat.records++;
+  
+  // Накопился сектор (с учетом выравнивания файла) - пишем
+  size_t align = SD_BLOCK_TB - _fileSize % SD_BLOCK_TB;
+  if (_count >= align + SD_BLOCK_TB || _count >= _cap / 2) {
+    size_t n = _count < align ? 0 : 
+               align + (_count - align) / SD_BLOCK_TB * SD_BLOCK_TB;
+    // Пустая запись сдвинула бы срок сброса по времени
+    if (n > 0) {
+      _write(n);
+    }
+  }
+  
+  return true;
+}
+
+void LogTB::_push(const char* data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  size_t tail = (_head + _count) % _cap;
+  size_t first = min(len, _cap - tail);
+  memcpy(_buf + tail, data, first);
+  memcpy(_buf, data + first, len - first);
+  _count += len;
+}
+
+void LogTB::loop() {
+  if (_daily) {
+    int day = _today();
+    if (day > 0 && _day > 0 && day != _day) {
+      // Архив получает дату закрываемого дня
+      flush();
+      _rotate(_path + "." + String(_day));
+    }
+    if (day > 0) {
+      _day = day;
+    }
+  }
+  
+  if (_count > 0 && millis() - _lastFlush > _flushMs) {
+    flush();
+  }
+}
+
+bool LogTB::flush() {
+  return _write(_count);
+}
+
+bool LogTB::_write(size_t n) {
+  // Срок сброса по времени отсчитывается от последней записи на карту
+  if (n == 0) {
+    return true;
+  }
+  _lastFlush = millis();
+  if (!_file) {
+    return false;
+  }
+  
+  if (_maxSize > 0 && _fileSize > 0 && _fileSize + n > _maxSize) {
+    // Сдвигаем архивы: path.1 -> path.2 ...
+    for (int i = LOG_KEEP_TB - 1; i >= 1; i--) {
+      String from = _path + "." + String(i);
+      if (SD.exists(from)) {
+        SD.remove(_path + "." + String(i + 1));
+        SD.rename(from, _path + "." + String(i + 1));
+      }
+    }
+    _rotate(_path + ".1");
+  }
+  
+  unsigned long start = micros();
+  
+  size_t first = min(n, _cap - _head);
+  size_t written = _file.write(_buf + _head, first);
+  if (written == first && n > first) {
+    written += _file.write(_buf, n - first);
+  }
+  _file.flush();
+  
+  uint32_t took = micros() - start;
+  
+  _head = (_head + written) % _cap;
+  _count -= written;
+  _fileSize += written;
+  
+  _stat.flushes++;
+  _stat.bytes += written;
+  _flushTotal += took;
+  _stat.flushAvg = _flushTotal / _stat.flushes;
+  if (took > _stat.flushMax) {
+    _stat.flushMax = took;
+  }
+  
+  if (written != n) {
+    _stat.errors++;
+    return false;
+  }
+  return true;
+}
+
+bool LogTB::_rotate(const String &archive) {
+  _file.close();
+  SD.remove(archive);
+  SD.rename(_path, archive);
+  _stat.rotations++;
+  return _open();
+}
+
+LogStatTB LogTB::stat() {
+  LogStatTB stat = _stat;
+  stat.buffered = _count;
+  return stat;
+}
+
+bool TeleBot::recordSD(const String &path, const String &data, FileTypeTB) {
   if (!_sdInitialized) {
     _error = "SD not initialized";
     return false;
@@ -4,6 +4,7 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <ArduinoJson.h>
+#include <atomic>
 
 // Опционально: поддержка SD карты
 #ifdef TELEBOT_SD_ENABLE
@@ -14,6 +15,76 @@
 // Максимальный размер сообщения
 #define MAX_MSG_SIZE 4096
 
+// Сколько байт ответа неблокирующий loop() читает за один вызов
+#define POLL_STEP_TB 512
+
+// Ожидание заголовков ответа, мс. Long poll getUpdates - плюс его
+// timeout, иначе простой бот рвет соединение на каждом опросе
+#define READ_TIMEOUT_TB 5000
+#define LONG_POLL_TB 5
+
+// Размер блока, которым запрос уходит в сокет
+#define TX_BUF_TB 512
+
+// Блок, которым файл уходит в сокет при загрузке
+#define UPLOAD_CHUNK_TB 1024
+
+// Больше этого неблокирующий опрос не буферизует
+#define POLL_BODY_MAX_TB (MAX_MSG_SIZE * 4)
+
+// Очередь отправки и лимиты Telegram
+#define QUEUE_SIZE_TB 16       // Сообщений в очереди по умолчанию
+#define QUEUE_TRIES_TB 5       // Попыток на одно сообщение
+#define RATE_GLOBAL_TB 30      // Сообщений в секунду на бота
+#define RATE_CHAT_MS_TB 1000   // Интервал для личного чата
+#define RATE_GROUP_MS_TB 3000  // Интервал для группы (20 в минуту)
+#define RATE_CHATS_TB 16       // Сколько чатов отслеживаем одновременно
+
+// Корзины гистограмм статистики: до 1, 2, 4 ... 1024 и больше
+#define HIST_TB 12
+
+// dual(): слотов кольца по умолчанию и стек задачи сети
+#define RING_SLOTS_TB 4
+#define TASK_STACK_TB 8192
+
+// WiFi: сетей-кандидатов, первая пауза между кругами попыток,
+// ожидание прямого подключения по кэшу и обычного (мс)
+#define WIFI_APS_TB 4
+#define WIFI_RETRY_TB 500
+#define WIFI_FAST_MS_TB 3000
+#define WIFI_TRY_MS_TB 10000
+
+// Живые сообщения: слотов и интервал правок одного сообщения (мс)
+#define LIVE_SLOTS_TB 4
+#define LIVE_MS_TB 3000
+
+// sendAsync(): запросов в ожидании и в одной пачке на сокете
+#define ASYNC_SLOTS_TB 16
+#define PIPE_DEPTH_TB 8
+
+// push()/noAck(): ответов в полете на сокете
+#define NOACK_DEPTH_TB 8
+
+// Сколько доверять адресу api.telegram.org без DNS (мс). При отказе
+// подключения по нему адрес запрашивается заново раньше срока
+#define DNS_TTL_TB 3600000UL
+
+// persist(): как часто offset пишется во flash или на SD (мс)
+#define PERSIST_MS_TB 10000
+
+// Клавиатур в кэше cacheKey()/cacheIn()/cacheURL()
+#define KEY_CACHE_TB 8
+
+// Webhook: входящих соединений в очереди, ожидание запроса (мс),
+// длина секрета (заголовок целиком должен влезть в буфер HttpTB)
+#define HOOK_CONNS_TB 4
+#define HOOK_TIMEOUT_TB 2000
+#define HOOK_SECRET_TB 64
+
+// TeleBotHub: ботов на хаб и соединений в пуле
+#define HUB_BOTS_TB 8
+#define HUB_CONNS_TB 4
+
 // Статусы WiFi - переименуем чтобы избежать конфликта
 enum WiFiStatTB {
   WIFI_DISCONNECTED_TB,
@@ -22,13 +93,33 @@ enum WiFiStatTB {
   WIFI_FAILED_TB
 };
 
+// Состояния неблокирующего опроса
+enum PollStTB {
+  POLL_IDLE_TB,
+  POLL_CONNECT_TB,
+  POLL_SEND_TB,
+  POLL_HEAD_TB,
+  POLL_BODY_TB,
+  POLL_PARSE_TB
+};
+
+// Шаги подключения WiFi
+enum WiFiStepTB {
+  WIFI_IDLE_TB,      // Подключены или не подключаемся
+  WIFI_FAST_TB,      // Прямо на BSSID и канал из кэша
+  WIFI_SCAN_TB,      // Сканирование для выбора сети
+  WIFI_TRY_TB,       // Очередная сеть из списка
+  WIFI_PAUSE_TB      // Пауза перед следующим кругом
+};
+
 // Конфигурация WiFi
 struct WiFiConfTB {
   const char* ssid;
   const char* password;
   const char* hostname = NULL;
-  int timeout = 20000;
+  int timeout = 20000;   // 0 - не ждать подключения
   bool staticIP = false;
+  bool fastIP = false;   // Прямое подключение с прошлым адресом, без DHCP
   IPAddress ip;
   IPAddress gateway;
   IPAddress subnet;
@@ -36,6 +127,36 @@ struct WiFiConfTB {
   IPAddress dns2;
 };
 
+// Сеть-кандидат: история подключений для ранжирования
+struct ApTB {
+  const char* ssid = NULL;
+  const char* pass = NULL;
+  uint8_t ok = 0;      // Удачных подключений
+  uint8_t fail = 0;    // Неудач подряд
+};
+
+// Последнее удачное подключение (хранится в NVS)
+// Поля без выравнивания между ними: запись сравнивается целиком
+struct WiFiCacheTB {
+  uint32_t ssid = 0;      // Хэш имени сети
+  uint32_t ip = 0;
+  uint32_t gateway = 0;
+  uint32_t subnet = 0;
+  uint32_t dns = 0;
+  uint8_t bssid[6] = {0};
+  uint16_t channel = 0;   // 0 - кэша нет
+};
+
+// Счетчики подключений WiFi
+struct WiFiInfoTB {
+  uint32_t fast = 0;          // Подключений по кэшу, без сканирования
+  uint32_t scans = 0;         // Сканирований
+  uint32_t attempts = 0;      // Попыток всего
+  uint32_t failed = 0;        // Неудачных попыток
+  unsigned long lastMs = 0;   // Последнее подключение от обрыва, мс
+  unsigned long pause = 0;    // Текущая пауза между кругами, мс
+};
+
 // Поддерживаемые расширения файлов
 enum FileTypeTB {
   FILE_TXT_TB,
@@ -48,6 +169,25 @@ enum FileTypeTB {
   FILE_BIN_TB
 };
 
+// Сколько аргументов команды разбирается заранее
+#define MAX_ARGS_TB 8
+
+// Кусок текста без копирования (команда, аргумент)
+struct ArgTB {
+  const char* ptr = NULL;
+  uint16_t len = 0;
+  
+  String str() const;
+  bool equals(const char* str) const;
+  long toInt() const;
+};
+
+// Кусок text по смещению: в отличие от указателя, верен и в копии
+struct SpanTB {
+  uint16_t pos = 0;
+  uint16_t len = 0;
+};
+
 // Структура сообщения
 struct MsgTB {
   long chat_id;
@@ -58,17 +198,529 @@ struct MsgTB {
   bool is_inline;
   String inline_data;
   String inline_id;
+  
+  // Команда без @бота и ее аргументы. Хранятся смещениями в text,
+  // поэтому копию сообщения можно сохранить и разобрать позже
+  ArgTB cmd() const;
+  ArgTB arg(uint8_t i) const;
+  uint8_t argc = 0;
+  
+  private:
+    friend struct MsgViewTB;
+    ArgTB _span(const SpanTB &span) const;
+    
+    SpanTB _cmd;
+    SpanTB _args[MAX_ARGS_TB];
+};
+
+// Сообщение без копирования: поля читаются из JSON апдейта по запросу
+// и действительны только во время вызова обработчика.
+// Чтобы сохранить сообщение - materialize()
+struct MsgViewTB {
+  long chat_id = 0;
+  long msg_id = 0;
+  bool is_inline = false;
+  uint8_t argc = 0;
+  
+  ArgTB text() const;
+  ArgTB user() const;
+  ArgTB name() const;
+  ArgTB data() const;          // inline: callback data
+  ArgTB id() const;            // inline: id для answer()
+  ArgTB cmd() const;
+  ArgTB arg(uint8_t i) const;
+  void materialize(MsgTB &msg) const;
+  
+  JsonObject obj;              // message или callback_query
+  
+  private:
+    friend class TeleBot;
+    ArgTB _cmd;
+    ArgTB _args[MAX_ARGS_TB];
+};
+
+#ifdef TELEBOT_SD_ENABLE
+// Блок чтения с SD: размер сектора карты
+#define SD_BLOCK_TB 512
+
+// Самая длинная строка для построчного чтения и CSV
+#define SD_LINE_TB 256
+
+// Полей в одной строке CSV
+#define MAX_FIELDS_TB 16
+
+// Обработчики потокового чтения SD: false - остановить чтение
+typedef bool (*ChunkHandlerTB)(const uint8_t* data, size_t len, void* arg);
+typedef bool (*LineHandlerTB)(const char* line, size_t len, void* arg);
+typedef bool (*CsvHandlerTB)(const ArgTB* fields, uint8_t count, void* arg);
+
+// Чтение файла блоками размером с сектор в собственный буфер:
+// целиком файл в память не попадает
+class SDReaderTB {
+  public:
+    ~SDReaderTB();
+    
+    bool open(const String &path);
+    void close();
+    bool isOpen();
+    
+    size_t read(uint8_t* buf, size_t cap);   // 0 - конец файла
+    int line(char* buf, size_t cap, char sep = '\n');   // -1 - конец файла
+    
+    size_t size();
+    size_t position();
+    
+  private:
+    bool _fill();
+    
+    File _file;
+    uint8_t _buf[SD_BLOCK_TB];
+    size_t _pos = 0;
+    size_t _len = 0;
+    size_t _read = 0;
 };
 
+// Буфер журнала по умолчанию и сколько старых файлов хранить
+#define LOG_BUF_TB 2048
+#define LOG_KEEP_TB 3
+
+// Статистика журнала
+struct LogStatTB {
+  uint32_t records = 0;
+  uint32_t dropped = 0;     // не поместилось в буфер
+  uint32_t bytes = 0;       // записано на карту
+  uint32_t flushes = 0;
+  uint32_t errors = 0;
+  uint32_t rotations = 0;
+  uint32_t flushMax = 0;    // мкс
+  uint32_t flushAvg = 0;    // мкс
+  uint32_t buffered = 0;    // сейчас в буфере
+};
+
+// Журнал на SD: файл открыт постоянно, записи копятся в кольцевом
+// буфере и уходят на карту целыми секторами
+class LogTB {
+  public:
+    LogTB(size_t bufSize = LOG_BUF_TB);
+    ~LogTB();
+    // Буфер и файл у лога свои: копия освободила бы буфер второй раз
+    LogTB(const LogTB&) = delete;
+    LogTB &operator=(const LogTB&) = delete;
+    
+    // maxSize - ротация по размеру (0 - нет), daily - по дате
+    bool begin(const String &path, unsigned long flushMs = 5000,
+               size_t maxSize = 0, bool daily = false);
+    void end();
+    
+    bool add(const char* data, size_t len);
+    bool add(const String &data);
+    bool line(const String &text);   // С переводом строки
+    
+    void loop();     // Сброс по времени и смена даты
+    bool flush();    // Сбросить все, включая неполный сектор
+    
+    LogStatTB stat();
+    
+  private:
+    bool _record(const char* data, size_t len, 
+                 const char* tail, size_t tailLen);
+    void _push(const char* data, size_t len);
+    bool _write(size_t n);
+    bool _open();
+    bool _rotate(const String &archive);
+    int _today();
+    
+    String _path;
+    File _file;
+    uint8_t* _buf;
+    size_t _cap;
+    size_t _head = 0;
+    size_t _count = 0;
+    size_t _fileSize = 0;
+    size_t _maxSize = 0;
+    bool _daily = false;
+    int _day = -1;
+    unsigned long _flushMs = 5000;
+    unsigned long _lastFlush = 0;
+    uint64_t _flushTotal = 0;
+    LogStatTB _stat;
+};
+#endif
+
+// Статистика соединения с api.telegram.org
+struct ConnStatTB {
+  uint32_t opened = 0;   // новых TLS подключений
+  uint32_t reused = 0;   // запросов по уже открытому соединению
+  uint32_t stale = 0;    // переподключений из-за "мертвого" сокета
+  uint32_t failed = 0;   // неудачных подключений
+  uint32_t resolved = 0; // запросов DNS
+  uint32_t cached = 0;   // подключений по сохраненному адресу без DNS
+};
+
+// Статистика очереди отправки
+struct QueueStatTB {
+  uint16_t depth = 0;    // сейчас в очереди
+  uint16_t peak = 0;     // максимум за все время
+  uint32_t sent = 0;
+  uint32_t retried = 0;  // повторов после ошибок и 429
+  uint32_t failed = 0;   // отказ 4xx или QUEUE_TRIES_TB неудачных попыток
+  uint32_t dropped = 0;  // не поместилось или выброшено queue()
+};
+
+// Счетчики живых сообщений
+struct LiveStatTB {
+  uint32_t updates = 0;   // вызовов live()/liveLoc()
+  uint32_t sent = 0;      // правок ушло в Telegram
+  uint32_t merged = 0;    // заменено более новым до отправки
+  uint32_t same = 0;      // пропущено: уже показано то же самое
+  uint32_t failed = 0;    // не отправлено после QUEUE_TRIES_TB попыток
+};
+
+// Итог запроса sendAsync()/editAsync()/...
+struct DoneTB {
+  uint32_t ticket = 0;
+  bool ok = false;
+  int code = 0;       // error_code Telegram или HTTP статус, 0 - ответа нет
+  int retry = 0;      // retry_after при 429, с
+  long msg_id = 0;    // message_id из result
+};
+typedef void (*DoneHandlerTB)(DoneTB &done);
+
+// Счетчики push()/noAck()
+struct AckStatTB {
+  uint32_t sent = 0;      // записано в сокет
+  uint32_t ok = 0;        // ответ "ok":true
+  uint32_t failed = 0;    // ответ с ошибкой
+  uint32_t lost = 0;      // обрыв до ответа
+  uint8_t pending = 0;    // ответов еще не прочитано
+  int code = 0;           // error_code (или HTTP статус) последней ошибки
+};
+
+// Счетчики webhook
+struct HookStatTB {
+  uint32_t received = 0;   // апдейтов принято и отдано обработчикам
+  uint32_t rejected = 0;   // не POST, чужой секрет, слишком большое тело
+  uint32_t failed = 0;     // обрыв, таймаут, битый JSON
+  uint32_t dropped = 0;    // подтвержден, но не влез в документ
+};
+
+// Счетчики кольца dual()
+struct RingStatTB {
+  uint8_t slots = 0;
+  uint8_t depth = 0;     // разобрано, ждет обработчика
+  uint8_t peak = 0;
+  uint32_t pushed = 0;
+  uint32_t popped = 0;
+  uint32_t stalls = 0;   // сеть ждала свободный слот
+};
+
+// Счетчики арены
+struct ArenaStatTB {
+  size_t size = 0;
+  size_t used = 0;        // занято сейчас
+  size_t peak = 0;        // максимум за все время
+  uint32_t overflows = 0; // не поместилось, взято из кучи
+};
+
+// Методы API в статистике
+enum ApiTB : uint8_t {
+  API_GET_UPDATES_TB,
+  API_SEND_MESSAGE_TB,
+  API_EDIT_TEXT_TB,
+  API_DELETE_TB,
+  API_ANSWER_TB,
+  API_PHOTO_TB,
+  API_DOCUMENT_TB,
+  API_LOCATION_TB,
+  API_CHAT_ACTION_TB,
+  API_GET_ME_TB,
+  API_SET_WEBHOOK_TB,
+  API_DELETE_WEBHOOK_TB,
+  API_LIVE_LOCATION_TB,
+  API_STOP_LOCATION_TB,
+  API_OTHER_TB,
+  API_COUNT_TB
+};
+
+// Гистограмма по степеням двойки: корзина i - значения до 2^i,
+// последняя - все, что больше. Добавление - несколько инструкций
+struct HistTB {
+  uint32_t count = 0;
+  uint32_t sum = 0;
+  uint32_t max = 0;
+  uint32_t buckets[HIST_TB] = {0};
+  
+  void add(uint32_t value);
+  void merge(const HistTB &other);
+  uint32_t quantile(float q) const;   // Верхняя граница корзины
+};
+
+struct MethodStatTB {
+  const char* name = "";
+  uint32_t calls = 0;
+  uint32_t failed = 0;
+  HistTB time;           // Полное время вызова, мс
+};
+
+// Снимок статистики бота
+struct StatsTB {
+  MethodStatTB api[API_COUNT_TB];
+  HistTB connect;        // Подключение с TLS рукопожатием, мс
+  HistTB ttfb;           // От отправки запроса до первого байта ответа, мс
+  HistTB total;          // Весь вызов API, мс
+                         // (ttfb и total - без getUpdates: он ждет long poll)
+  HistTB batch;          // Обновлений за один getUpdates
+  uint32_t updates = 0;
+  uint32_t bytesOut = 0;
+  uint32_t bytesIn = 0;
+  uint16_t queueDepth = 0;
+  uint16_t queuePeak = 0;
+  uint32_t freeHeap = 0;
+  uint32_t minFreeHeap = 0;   // Минимум с момента запуска
+  uint32_t maxAlloc = 0;      // Самый большой свободный блок
+  unsigned long uptime = 0;   // мс с последнего resetStats()
+};
+
+// Параметр запроса: value кодируется при записи в сокет,
+// NULL - параметр не передается
+struct ParamTB {
+  const char* key;
+  const char* value;
+  size_t len;
+  bool encode;
+};
+
+// Обработчик заголовков HTTP ответа
+typedef void (*HeaderHandlerTB)(const char* name, const char* value);
+
+// Разбор HTTP/1.1 ответа по байту, без выделения памяти:
+// статус, заголовки, Content-Length и chunked тело
+class HttpTB {
+  public:
+    void reset();
+    void onHeader(HeaderHandlerTB handler);
+    void request(const char* secret);   // Разбирать запрос (webhook)
+    
+    int head(char c);           // 1 - заголовки приняты, -1 - ошибка
+    int frame(char c);          // Разметка chunked: 2 - тело закончилось
+    long data();                // Байт тела можно читать подряд
+    void consume(size_t n);     // Прочитано n байт тела
+    void eof();                 // Сокет закрыт
+    void fail();
+    
+    bool inBody();
+    bool done();
+    bool failed();
+    int status();
+    long length();              // Content-Length, -1 если нет
+    bool chunked();
+    bool close();               // Сервер закроет соединение
+    bool post();                // Запрос: метод POST
+    bool auth();                // Запрос: секрет совпал или не нужен
+    uint32_t bytes();           // Всего принято байт, reset() не сбрасывает
+    
+  private:
+    enum StTB : uint8_t {
+      ST_STATUS, ST_HEADER, ST_BODY, ST_SIZE, ST_DATA, 
+      ST_CRLF, ST_TRAILER, ST_DONE, ST_ERROR
+    };
+    
+    StTB _st = ST_STATUS;
+    char _buf[128];
+    size_t _pos = 0;
+    int _status = 0;
+    long _length = -1;
+    long _left = 0;
+    bool _chunked = false;
+    bool _close = false;
+    bool _http10 = false;
+    bool _ext = false;
+    bool _request = false;
+    bool _post = false;
+    bool _auth = true;
+    const char* _secret = NULL;
+    HeaderHandlerTB _handler = NULL;
+    uint32_t _bytes = 0;
+};
+
+// Тело HTTP ответа как Stream: читает ровно то, что указано
+// в разметке, чтобы JSON можно было разбирать прямо из сокета
+class BodyTB : public Stream {
+  public:
+    BodyTB(Client &client, HttpTB &http, unsigned long timeout = 5000);
+    
+    int available();
+    int read();
+    int read(uint8_t* buf, size_t len);
+    int peek();
+    size_t write(uint8_t) { return 0; }
+    
+    void skip();   // Дочитать остаток тела
+    bool detach(size_t max);   // Забрать остаток в память и отпустить сокет
+    
+  private:
+    bool _next();
+    
+    Client &_client;
+    HttpTB &_http;
+    unsigned long _wait_ms;
+    bool _detached = false;
+    String _rest;
+    size_t _pos = 0;
+};
+
+// Поиск "ok" и "error_code" верхнего уровня в теле ответа по байту,
+// без JSON документа
+class AckTB {
+  public:
+    void reset();
+    void feed(char c);
+    
+    bool ok();     // Было "ok":true
+    int code();    // error_code, 0 если нет
+    
+  private:
+    enum FieldTB : uint8_t { FIELD_NONE, FIELD_OK, FIELD_CODE };
+    
+    char _key[12];
+    uint8_t _len = 0;
+    uint8_t _depth = 0;
+    bool _str = false;
+    bool _esc = false;
+    FieldTB _field = FIELD_NONE;
+    bool _ok = false;
+    int _code = 0;
+};
+
+// Буфер в памяти как Stream (для уже принятого тела)
+class BufTB : public Stream {
+  public:
+    BufTB(const char* data, size_t len);
+    
+    int available();
+    int read();
+    int peek();
+    size_t write(uint8_t) { return 0; }
+    
+  private:
+    const char* _data;
+    size_t _len;
+    size_t _pos = 0;
+};
+
+// Кольцо разобранных апдейтов: пишет только задача сети, читает
+// только loop(). Документы выделены заранее, блокировок нет
+class RingTB {
+  public:
+    ~RingTB();
+    bool begin(uint8_t slots, size_t slotSize);
+    void end();
+    
+    JsonDocument *slot();        // Свободный слот писателя или NULL
+    void push();
+    void stall();
+    JsonDocument *front();       // Готовый слот читателя или NULL
+    void pop();
+    
+    uint8_t size();
+    RingStatTB stat();
+    
+  private:
+    DynamicJsonDocument **_docs = NULL;
+    uint8_t _size = 0;
+    std::atomic<uint32_t> _head{0};   // Двигает только писатель
+    std::atomic<uint32_t> _tail{0};   // Двигает только читатель
+    uint8_t _peak = 0;
+    uint32_t _stalls = 0;
+};
+
+// Арена: один буфер, выделенный заранее. Выделение - сдвиг указателя,
+// освобождение - откат к метке всего, что выделено после нее
+class ArenaTB {
+  public:
+    ~ArenaTB();
+    bool begin(size_t size);
+    void end();
+    
+    void* alloc(size_t n);      // NULL - арены нет или не хватило места
+    bool owns(const void* p);
+    size_t mark();
+    void rewind(size_t mark);
+    ArenaStatTB stat();
+    
+  private:
+    uint8_t* _buf = NULL;
+    size_t _size = 0;
+    size_t _used = 0;
+    size_t _peak = 0;
+    uint32_t _overflows = 0;
+};
+
+// Память документа ArduinoJson из арены; без нее - из кучи
+struct ArenaAllocTB {
+  ArenaAllocTB(ArenaTB *arena = NULL) : arena(arena) {}
+  void* allocate(size_t n);
+  void deallocate(void* p);
+  void* reallocate(void* p, size_t n);
+  ArenaTB *arena;
+};
+typedef BasicJsonDocument<ArenaAllocTB> ArenaDocTB;
+
 // Типы обработчиков
 typedef void (*MsgHandlerTB)(MsgTB &msg);
+typedef void (*ViewHandlerTB)(MsgViewTB &msg);
+
+// Строка таблицы команд: можно объявить constexpr, она останется во flash
+struct ComTB {
+  const char* name;
+  MsgHandlerTB handler;
+};
 typedef void (*WiFiHandlerTB)(WiFiStatTB status);
 
+// Кнопка для таблиц клавиатур: можно объявить constexpr (flash).
+// ROW_TB начинает новый ряд
+struct BtnTB {
+  const char* text;
+  const char* data;    // callback_data (inline)
+  const char* url;     // ссылка (inline)
+};
+#define ROW_TB {NULL, NULL, NULL}
+
+// Готовая клавиатура: JSON собирается и URL-кодируется один раз,
+// send()/edit() отдают ее в сокет как есть
+class KeyTB {
+  public:
+    KeyTB() {}
+    template <size_t N>
+    KeyTB(const BtnTB (&btns)[N]) { inl(btns, N); }
+    
+    bool inl(const BtnTB* btns, size_t count);     // inline_keyboard
+    bool reply(const BtnTB* btns, size_t count, 
+               bool resize = true, bool once = false);
+    bool json(const String &markup);              // Готовый reply_markup
+    
+    const char* c_str() const;   // Уже URL-кодировано
+    size_t length() const;
+    
+  private:
+    String _enc;
+};
+
+// Счетчики кэша клавиатур
+struct KeyStatTB {
+  uint32_t hits = 0;     // взято из кэша
+  uint32_t built = 0;    // собрано заново
+};
+
+class TeleBotHub;
+struct OffsetRecTB;
+
 class TeleBot {
   public:
     // Конструкторы
     TeleBot(const char* token, WiFiClientSecure &client);
     TeleBot(const char* token);
+    ~TeleBot();
     
     // Основные методы
     bool begin();
@@ -83,6 +735,27 @@ class TeleBot {
     
     bool sendIn(long chat_id, const String &text, const String &keys);
     
+    bool send(long chat_id, const String &text, const KeyTB &keys,
+              const String &parse = "");
+    
+    // Асинхронно: сразу билет (0 - места нет), итог приходит в onDone().
+    // loop() отправляет ожидающие пачками до PIPE_DEPTH_TB подряд по
+    // одному keep-alive сокету и разбирает ответы по порядку
+    uint32_t sendAsync(long chat_id, const String &text, 
+                       const String &parse = "", const String &keys = "");
+    uint32_t editAsync(long chat_id, long msg_id, const String &text, 
+                       const String &keys = "");
+    uint32_t delAsync(long chat_id, long msg_id);
+    uint32_t callAsync(const String &method, const String &params);
+    void onDone(DoneHandlerTB handler);
+    bool flush();    // Отправить все ожидающие, не дожидаясь loop()
+    
+    // Без ожидания ответа: запрос пишется в сокет, ответ loop() дочитает
+    // позже и проверит только "ok". Ошибки - в ackStat()
+    bool push(long chat_id, const String &text, const String &parse = "");
+    void noAck(bool enable);   // То же для send(), sendChat(), edit(), del()...
+    AckStatTB ackStat();
+    
     // Отправка медиа
     bool photo(long chat_id, const String &photo_url, 
                const String &caption = "");
@@ -90,7 +763,19 @@ class TeleBot {
     bool document(long chat_id, const String &doc_url,
                   const String &caption = "");
     
-    bool location(long chat_id, float lat, float lon);
+    bool location(long chat_id, float lat, float lon, int live = 0);
+    
+    // Загрузка файла (multipart/form-data) из любого Stream
+    bool photo(long chat_id, Stream &data, size_t size,
+               const String &filename, const String &caption = "");
+    
+    bool document(long chat_id, Stream &data, size_t size,
+                  const String &filename, const String &caption = "");
+    
+    #ifdef TELEBOT_SD_ENABLE
+    bool photo(long chat_id, fs::File &file, const String &caption = "");
+    bool document(long chat_id, fs::File &file, const String &caption = "");
+    #endif
     
     // Действия чата
     bool sendChat(long chat_id, const String &action);
@@ -98,8 +783,20 @@ class TeleBot {
     // Работа с сообщениями
     bool edit(long chat_id, long msg_id, const String &text, 
               const String &keys = "");
+    bool edit(long chat_id, long msg_id, const String &text, 
+              const KeyTB &keys);
     
     bool del(long chat_id, long msg_id);
+    long lastMsg();    // message_id из ответа последнего вызова
+    
+    // Живые сообщения: правки копятся в loop(), уходит только
+    // последняя и не чаще раза в liveRate() мс на сообщение
+    bool live(long chat_id, long msg_id, const String &text, 
+              const String &keys = "");
+    bool liveLoc(long chat_id, long msg_id, float lat, float lon);
+    bool liveStop(long chat_id, long msg_id);   // Дослать и освободить
+    void liveRate(unsigned long ms);
+    LiveStatTB liveStat();
     
     bool answer(const String &inline_id, const String &text = "");
     
@@ -108,8 +805,15 @@ class TeleBot {
     
     // Обработчики
     void on(MsgHandlerTB handler);
+    void on(ViewHandlerTB handler);      // Без копирования полей
     void com(const String &command, MsgHandlerTB handler);
+    void com(const String &command, ViewHandlerTB handler);
+    void com(const ComTB* table, size_t count);
+    template <size_t N>
+    void com(const ComTB (&table)[N]) { com(table, N); }
+    void name(const String &username);   // Для команд вида /cmd@MyBot
     void inl(MsgHandlerTB handler);
+    void inl(ViewHandlerTB handler);
     
     // Создание клавиатур
     static String createKey(const String keys[][2], int rows, 
@@ -120,14 +824,68 @@ class TeleBot {
     
     static String createURL(const String keys[][2], int rows);
     
+    // То же с кэшем по содержимому: повторный вызов не собирает
+    // разметку. Ссылка живет, пока клавиатуру не вытеснят
+    const KeyTB &cacheKey(const String keys[][2], int rows,
+                          bool resize = true, bool once = false);
+    const KeyTB &cacheIn(const String keys[][3], int rows, 
+                         bool delBtn = false);
+    const KeyTB &cacheURL(const String keys[][2], int rows);
+    // Кэш по id клавиатуры от вызывающего: кнопки не хэшируются вовсе.
+    // id - на клавиатуру целиком, с флагами; другие кнопки - другой id
+    const KeyTB &cacheKey(uint32_t id, const String keys[][2], int rows,
+                          bool resize = true, bool once = false);
+    const KeyTB &cacheIn(uint32_t id, const String keys[][3], int rows, 
+                         bool delBtn = false);
+    const KeyTB &cacheURL(uint32_t id, const String keys[][2], int rows);
+    KeyStatTB keyStat();
+    
+    // URL-кодирование (application/x-www-form-urlencoded)
+    static size_t encLen(const char* str, size_t len);
+    static size_t encode(char* buf, size_t cap, const char* str, size_t len);
+    static size_t encode(Print &out, const char* str, size_t len);
+    static String encode(const String &str);
+    
     // Настройки
     void server(unsigned long interval);
     void debug(bool enable);
-    void useDNS(bool enable);
+    // TLS по умолчанию БЕЗ проверки сертификата: пока не вызван cert(),
+    // соединение шифруется, но подменный сервер не отличить
+    void insecure(bool enable);
+    // Проверка цепочки по корневому CA в PEM. Это не pinning: подойдет
+    // любой сертификат api.telegram.org, выданный от этого CA
+    void cert(const char* ca);
+    void useDNS(bool enable);      // Устарело: то же, что insecure()
+    void keepAlive(bool enable, unsigned long idle = 60000);
+    void nonBlock(bool enable, int longPoll = 50);
+    void queue(bool enable, uint16_t size = QUEUE_SIZE_TB);
+    // Сеть и разбор в задаче на ядре 0, обработчики в loop() на ядре 1.
+    // dual(false) ждет выхода задачи, а TLS подключение она не прерывает:
+    // остановка может занять весь таймаут подключения
+    bool dual(bool enable, uint8_t slots = RING_SLOTS_TB, 
+              size_t slotSize = MAX_MSG_SIZE);
+    // Документы JSON ответов и апдейтов и тело опроса nonBlock() - из
+    // одного буфера size байт на цикл вместо кучи. 0 - выключить
+    bool arena(size_t size);
+    // Прием апдейтов на встроенном сервере вместо опроса.
+    // url - https адрес прокси перед платой, "" - не звать setWebhook
+    bool hook(uint16_t port, const String &url = "", 
+              const String &secret = "");
+    bool unhook();                       // deleteWebhook, снова опрос
+    
+    // Offset между перезагрузками: NVS (path = NULL) или файл на SD.
+    // Вызывать до begin(): он продолжит с сохраненного места.
+    // true - восстановлен или записи еще нет (первый запуск); false -
+    // запись есть, но не читается или чужая, причина в lastError().
+    // Сохранение включается в обоих случаях
+    bool persist(bool enable, const char* path = NULL, 
+                 unsigned long every = PERSIST_MS_TB);
+    bool save();     // Записать сейчас (перед ESP.restart() или OTA)
     
     // WiFi методы
     bool conWiFi(const char* ssid, const char* pass);
     bool conWiFi(WiFiConfTB &conf);
+    bool addAP(const char* ssid, const char* pass);   // Запасная сеть
     void deconWiFi();
     void autoWiFi(bool enable, unsigned long interval = 30000);
     bool isWiFi();
@@ -137,7 +895,14 @@ class TeleBot {
     #ifdef TELEBOT_SD_ENABLE
     bool initSD(int csPin = 5, uint32_t freq = 4000000);
     bool initSD(const char* mountPoint = "/sd");
+    // type оставлен для совместимости: файл читается и пишется как есть
     String readSD(const String &path, FileTypeTB type = FILE_TXT_TB);
+    size_t readSD(const String &path, ChunkHandlerTB handler, 
+                  void* arg = NULL, size_t block = SD_BLOCK_TB);
+    size_t linesSD(const String &path, LineHandlerTB handler,
+                   void* arg = NULL, char sep = '\n');
+    size_t csvSD(const String &path, CsvHandlerTB handler,
+                 void* arg = NULL, char delim = ',');
     bool recordSD(const String &path, const String &data, 
                   FileTypeTB type = FILE_TXT_TB);
     bool appendSD(const String &path, const String &data);
@@ -151,17 +916,110 @@ class TeleBot {
     String lastError();
     long lastUpdate();
     WiFiStatTB wifiStatus();
+    WiFiInfoTB wifiInfo();
+    ConnStatTB connStat();
+    PollStTB pollState();
+    QueueStatTB queueStat();
+    RingStatTB ringStat();
+    ArenaStatTB arenaStat();
+    HookStatTB hookStat();
+    int lastStatus();                        // HTTP статус последнего ответа
+    void onHeader(HeaderHandlerTB handler);  // Заголовки ответов API
+    
+    // Статистика
+    StatsTB stats();                 // Снимок счетчиков
+    void resetStats();
+    String statsText();              // Кратко, для команды /stats
+    void statsProm(Print &out);      // Текстовый формат Prometheus
     
   private:
+#ifdef TELEBOT_HOST
+    friend struct BenchTB;    // host/bench.cpp меряет внутренние шаги
+#endif
+    friend class TeleBotHub;
     const char* _token;
     WiFiClientSecure *_client;
     WiFiClientSecure _localClient;
     unsigned long _lastCheck = 0;
     unsigned long _checkTime = 1000;
-    long _lastID = 0;
+    std::atomic<long> _lastID{0};   // В dual() двигает задача сети
+    bool _skipBig = false;    // Первый апдейт пачки не влез в документ
+    
+    // persist(): обработанный и записанный offset
+    bool _persist = false;
+    String _persistPath;
+    unsigned long _persistEvery = PERSIST_MS_TB;
+    unsigned long _savedAt = 0;
+    long _doneID = 0;
+    long _savedID = 0;
+    
     bool _debug = false;
-    bool _useDNS = true;
+    bool _insecure = true;
+    const char* _ca = NULL;
     String _error = "";
+    int _lastCode = 0;
+    int _retryAfter = 0;
+    int _status = 0;
+    HttpTB _http;
+    HeaderHandlerTB _headerHandler = NULL;
+    
+    // Keep-alive соединение
+    bool _keepAlive = true;
+    unsigned long _idleTime = 60000;
+    
+    // Адрес api.telegram.org общий для всех ботов и хаба
+    static uint32_t _dnsIP;
+    static unsigned long _dnsAt;
+    static portMUX_TYPE _dnsMux;   // Задача сети и loop() ходят в кэш вместе
+    unsigned long _lastUse = 0;
+    ConnStatTB _connStat;
+    
+    // Статистика: счетчики в _stats, снимок дополняет stats()
+    StatsTB _stats;
+    unsigned long _statsStart = 0;
+    uint32_t _inBase = 0;
+    long _ttfb = -1;          // Первый байт последнего ответа, мс
+    bool _eof = false;        // Сокет закрылся, не ответив ни байта
+    
+    // Неблокирующий опрос: отдельный сокет, т.к. long polling
+    // держит его занятым, пока send() работает через _client
+    bool _nonBlock = false;
+    int _longPoll = 50;
+    WiFiClientSecure _pollClient;
+    WiFiClientSecure *_poll;
+    PollStTB _pollSt = POLL_IDLE_TB;
+    unsigned long _pollStart = 0;
+    HttpTB _pollHttp;
+    String _pollBody;
+    char* _pollBuf = NULL;    // Тело опроса в арене вместо _pollBody
+    size_t _pollLen = 0;
+    size_t _pollMark = 0;
+    ArenaTB _arena;
+    BodyTB* _body = NULL;     // Тело getUpdates, которое сейчас читается
+    TeleBotHub* _hub = NULL;  // Соединения и опрос у хаба
+    
+    // dual(): задача сети пишет в кольцо, loop() читает.
+    // Задача трогает только _poll, _pollHttp и состояние опроса
+    RingTB _ring;
+    TaskHandle_t _task = NULL;
+    std::atomic<bool> _taskRun{false};    // loop() просит задачу работать
+    std::atomic<bool> _taskLive{false};   // Задача еще не вышла
+    // Счетчики опроса задача ведет свои: stats() и connStat() складывают
+    // их с общими, resetStats() просит задачу обнулить их самой
+    StatsTB _netStats;
+    ConnStatTB _netConn;
+    std::atomic<bool> _netReset{false};
+    
+    // Webhook
+    WiFiServer *_hookServer = NULL;
+    String _hookSecret;
+    HookStatTB _hookStat;
+    // Запрос, который читается сейчас: по куску за вызов loop()
+    WiFiClient _hookClient;
+    bool _hookBusy = false;
+    HttpTB _hookHttp;
+    String _hookBody;
+    unsigned long _hookStart = 0;
     
     // WiFi
     WiFiConfTB _wifiConf;
@@ -169,7 +1027,32 @@ class TeleBot {
     WiFiHandlerTB _wifiHandler = NULL;
     unsigned long _lastTry = 0;
     bool _autoReconnect = true;
-    unsigned long _reconnectTime = 30000;
+    unsigned long _reconnectTime = 30000;   // Предел паузы между кругами
+    
+    // Подключение: кандидаты, кэш, шаг. События WiFi приходят
+    // из другой задачи и только ставят флаги для _wifiStep()
+    struct RankTB {
+      uint8_t ap;
+      uint8_t bssid[6];
+      uint8_t channel;
+      int16_t score;
+    };
+    ApTB _aps[WIFI_APS_TB];
+    uint8_t _apCount = 0;
+    RankTB _rank[WIFI_APS_TB];
+    uint8_t _rankCount = 0;
+    uint8_t _rankPos = 0;
+    WiFiCacheTB _wifiCache;
+    WiFiInfoTB _wifiInfo;
+    WiFiStepTB _wifiSt = WIFI_IDLE_TB;
+    uint8_t _wifiAp = 0;
+    unsigned long _wifiAt = 0;       // Начало шага
+    unsigned long _wifiSince = 0;    // Начало подключения
+    bool _wifiIP = false;            // Стоит адрес из кэша
+    bool _wifiOff = true;            // deconWiFi() или еще не conWiFi()
+    bool _wifiEvents = false;
+    volatile bool _wifiUp = false;
+    volatile bool _wifiDown = false;
     
     // SD карта
     #ifdef TELEBOT_SD_ENABLE
@@ -177,30 +1060,235 @@ class TeleBot {
     String _sdMountPoint = "/sd";
     #endif
     
+    // Очередь отправки
+    struct OutTB {
+      String method;
+      String params;
+      long chat_id;
+      unsigned long due;
+      uint8_t tries;
+    };
+    struct RateTB {
+      long chat_id = 0;
+      unsigned long next = 0;
+    };
+    OutTB *_queue = NULL;
+    uint16_t _qSize = 0;
+    uint16_t _qHead = 0;
+    uint16_t _qCount = 0;
+    QueueStatTB _qStat;
+    RateTB _rate[RATE_CHATS_TB];
+    unsigned long _tokens = 0;
+    unsigned long _tokenTime = 0;
+    
+    // Живые сообщения: ждет только последнее содержимое
+    struct LiveTB {
+      long chat_id = 0;
+      long msg_id = 0;
+      bool loc = false;
+      bool pending = false;
+      String text;            // Текст или "lat,lon"
+      String keys;
+      uint32_t shown = 0;     // Хэш того, что уже в Telegram
+      uint32_t hash = 0;      // Хэш ждущего
+      unsigned long next = 0;
+      uint8_t tries = 0;
+    };
+    LiveTB _live[LIVE_SLOTS_TB];
+    uint8_t _livePend = 0;
+    unsigned long _liveEvery = LIVE_MS_TB;
+    LiveStatTB _liveStat;
+    long _lastMsg = 0;
+    
+    // Асинхронные запросы: параметры уже закодированы
+    struct AsyncTB {
+      uint32_t ticket = 0;
+      String method;
+      String params;
+    };
+    AsyncTB _async[ASYNC_SLOTS_TB];
+    uint8_t _aHead = 0;
+    uint8_t _aCount = 0;
+    uint32_t _ticket = 0;
+    DoneHandlerTB _doneHandler = NULL;
+    
+    // Запросы без ожидания ответа: ответы приходят по порядку
+    struct PendTB {
+      uint8_t api = 0;
+      unsigned long start = 0;
+    };
+    PendTB _pend[NOACK_DEPTH_TB];
+    uint8_t _pHead = 0;
+    uint8_t _unacked = 0;
+    bool _noAck = false;
+    AckTB _ack;
+    AckStatTB _ackStat;
+    
+    // Кэш клавиатур: вытесняется самая давно взятая
+    struct KeySlotTB {
+      uint32_t hash = 0;
+      uint32_t used = 0;
+      KeyTB keys;
+    };
+    KeySlotTB _keys[KEY_CACHE_TB];
+    uint32_t _keyTick = 0;
+    KeyStatTB _keyStat;
+    
     // Обработчики
     MsgHandlerTB _msgHandler = NULL;
-    struct ComHandlerTB {
-      String command;
+    MsgHandlerTB _inlineHandler = NULL;
+    ViewHandlerTB _msgView = NULL;
+    ViewHandlerTB _inlineView = NULL;
+    
+    // Команды: открытая адресация, размер - степень двойки
+    struct RouteTB {
+      uint32_t hash;
+      const char* name;
+      uint8_t len;
+      bool own;
       MsgHandlerTB handler;
+      ViewHandlerTB view;
     };
-    ComHandlerTB _comHandlers[15];
-    int _comCount = 0;
-    MsgHandlerTB _inlineHandler = NULL;
+    RouteTB *_routes = NULL;
+    uint16_t _routeCap = 0;
+    uint16_t _routeCount = 0;
+    String _botName;
     
     // Внутренние методы
-    bool _request(const String &method, const String &params, 
+    bool _connect(bool &reused);
+    bool _open(const String &method, const ParamTB *params, int count,
+               const char* get = NULL, 
+               unsigned long timeout = READ_TIMEOUT_TB);
+    void _finish(bool close);
+    bool _exchange(const String &method, const ParamTB *params, int count,
+                   String &response);
+    bool _readHead(unsigned long timeout = READ_TIMEOUT_TB);
+    bool _readBody(String &response);
+    bool _request(const String &method, const String &params);
+    bool _request(const String &method, const ParamTB *params, int count);
+    bool _request(const String &method, const ParamTB *params, int count,
                   String &response);
+    bool _call(const String &method, const ParamTB *params, int count,
+               long chat_id);
+    KeySlotTB &_keySlot(uint32_t hash);
+    bool _response();
+    bool _result(const String &response);
+    bool _result(const char* data, size_t len);
+    bool _upload(const char* method, const char* field, long chat_id,
+                 Stream &data, size_t size, const String &filename,
+                 const String &caption);
+    static size_t _paramsLen(const ParamTB *params, int count);
+    static void _writeParams(Print &out, const ParamTB *params, int count);
+    bool _enqueue(const String &method, const String &params, long chat_id);
+    unsigned long *_chatSlot(long chat_id, bool create);
+    void _drainQueue();
+    LiveTB *_liveSlot(long chat_id, long msg_id, bool create);
+    bool _livePut(LiveTB *slot, uint32_t hash);
+    void _liveStep();
+    bool _liveSend(LiveTB &slot);
+    uint32_t _asyncPush(const char* method, const ParamTB *params, int count);
+    bool _pipeBatch();
+    bool _dial(WiFiClientSecure &client, ConnStatTB &conn);
+    bool _fire(const String &method, const ParamTB *params, int count);
+    void _ackDrain(bool wait);
+    void _ackDone();
+    void _ackDrop();
+    void _head(Print &out, const String &method, size_t length, bool close);
+    size_t _updatesReq(char* buf, size_t cap, int timeout, int limit, 
+                       bool close);
     String _encode(const String &str);
-    String _getUpdates();
-    void _process(JsonObject &update);
-    void _processMsg(JsonObject &msgObj);
-    void _processInline(JsonObject &inlineObj);
+    bool _getUpdates();
+    bool _resume();
+    void _persistStep();
+    bool _loadOffset(OffsetRecTB &out, bool &found);
+    bool _storeOffset(const OffsetRecTB &rec);
+    static uint8_t _api(const String &method);
+    bool _statCall(uint8_t api, unsigned long start, bool ok);
+    bool _statCall(StatsTB &stats, uint8_t api, unsigned long start, bool ok);
+    StatsTB &_pollStats();
+    ConnStatTB &_pollConn();
+    void _advance(long id);
+    void _detach();
+    void _pollStep();
+    void _pollStream();
+    void _pollReset(bool close);
+    static void _netTask(void *arg);
+    void _stopTask();
+    JsonDocument *_ringSlot();
+    void _ringDispatch();
+    void _hookStep();
+    int _hookRead();
+    bool _hookServe();
+    void _hookEnd();
+    static void _hookReply(Client &client, int code);
+    bool _dispatch(Stream &body);
+    void _process(JsonObject update);
+    void _processMsg(JsonObject msgObj);
+    void _processInline(JsonObject inlineObj);
+    
+    // FNV-1a, общий для команд, WiFi и кэшей: h - продолжить хэш
+    static uint32_t _hash(const char* str, size_t len, 
+                          uint32_t h = 2166136261u);
+    static uint32_t _hashStr(const String &str, uint32_t h = 2166136261u);
+    
+    // Команды
+    RouteTB *_route(const char* name, size_t len, uint32_t hash);
+    void _addRoute(const char* name, size_t len, MsgHandlerTB handler, 
+                   ViewHandlerTB view, bool copy);
+    void _growRoutes();
+    RouteTB *_command(const ArgTB &cmd, const ArgTB &mention);
     
     // WiFi методы
     void _initWiFi();
-    void _wifiEvent(WiFiEvent_t event);
+    void _wifiEvent(WiFiEvent_t event, WiFiEventInfo_t &info);
+    void _wifiStep();
+    void _wifiRound();
+    void _wifiScan();
+    void _wifiRank(int16_t found);
+    void _wifiTry();
+    void _wifiNext();
+    void _wifiBegin(uint8_t ap, const uint8_t* bssid, uint16_t channel);
+    void _wifiDone();
+    bool _wifiLoad();
+    bool _wifiSave();
     void _setWiFiStat(WiFiStatTB status);
     bool _setStaticIP();
 };
 
+// Несколько ботов на общем пуле соединений и одном цикле: память
+// растет с числом соединений, а не ботов. Опрос короткий, по кругу
+class TeleBotHub {
+  public:
+    TeleBotHub(uint8_t conns = 1, int wait = 0);
+    ~TeleBotHub();
+    
+    bool add(TeleBot &bot);          // До HUB_BOTS_TB ботов
+    void loop();                     // Вместо loop() каждого бота
+    uint8_t count();                 // Ботов в хабе
+    uint8_t active();                // Открытых соединений
+    
+  private:
+    friend class TeleBot;
+    
+    struct ConnTB {
+      WiFiClientSecure client;
+      TeleBot *owner = NULL;         // Чей опрос сейчас идет
+      unsigned long lastUse = 0;
+    };
+    
+    ConnTB *_conns;
+    uint8_t _size;
+    int _wait;                       // timeout getUpdates, сек
+    TeleBot *_bots[HUB_BOTS_TB];
+    WiFiClientSecure *_own[HUB_BOTS_TB];   // Клиент бота до add()
+    uint8_t _count = 0;
+    uint8_t _next = 0;
+    
+    bool _busy(ConnTB &conn);
+    ConnTB *_free();
+    WiFiClientSecure *_take(TeleBot &bot);
+    void _used(WiFiClientSecure *client);
+    void _release(TeleBot *bot);
+};
+
 #endif
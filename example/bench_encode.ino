@@ -0,0 +1,81 @@
+#include "TeleBot.h" //подключение библиотеки
+
+// Сравнение URL-кодирования: старый _encode() против TeleBot::encode()
+// Результат выводится в Serial, WiFi не нужен
+
+// Прежняя реализация: String растет по символу, два String на байт
+String oldEncode(const String &str) {
+    String encoded = "";
+    char c;
+    for (unsigned int i = 0; i < str.length(); i++) {
+        c = str[i];
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+            encoded += c;
+        } else if (c == ' ') {
+            encoded += '+';
+        } else {
+            encoded += '%';
+            encoded += String((c >> 4) & 0xF, HEX);
+            encoded += String(c & 0xF, HEX);
+        }
+    }
+    return encoded;
+}
+
+// Считает байты, никуда их не пишет: меряем только кодирование
+class NullPrint : public Print {
+  public:
+    size_t write(uint8_t) { return 1; }
+    size_t write(const uint8_t*, size_t len) { return len; }
+};
+
+const int RUNS = 20;
+
+void bench(const char* name, const String &text) {
+    uint32_t heap = ESP.getFreeHeap();
+    uint32_t minHeap = heap;
+    
+    unsigned long t = micros();
+    for (int i = 0; i < RUNS; i++) {
+        String out = oldEncode(text);
+        minHeap = min(minHeap, ESP.getFreeHeap());
+    }
+    unsigned long tOld = (micros() - t) / RUNS;
+    uint32_t peakOld = heap - minHeap;
+    
+    minHeap = heap;
+    t = micros();
+    for (int i = 0; i < RUNS; i++) {
+        String out = TeleBot::encode(text);
+        minHeap = min(minHeap, ESP.getFreeHeap());
+    }
+    unsigned long tNew = (micros() - t) / RUNS;
+    uint32_t peakNew = heap - minHeap;
+    
+    NullPrint sink;
+    t = micros();
+    for (int i = 0; i < RUNS; i++) {
+        TeleBot::encode(sink, text.c_str(), text.length());
+    }
+    unsigned long tStream = (micros() - t) / RUNS;
+    
+    Serial.printf("%s (%u bytes):\n", name, text.length());
+    Serial.printf("  old _encode():    %6lu us, heap peak %u\n", tOld, peakOld);
+    Serial.printf("  encode(String):   %6lu us, heap peak %u\n", tNew, peakNew);
+    Serial.printf("  encode(Print&):   %6lu us, heap peak 0\n", tStream);
+}
+
+void setup() {
+    Serial.begin(115200);
+    delay(1000);
+    
+    String latin, cyrillic;
+    while (latin.length() < 4096) latin += "Sensor 12: temp=23.5 hum=40% ok; ";
+    while (cyrillic.length() < 4096) cyrillic += "Датчик 12: температура 23,5 °C; ";
+    
+    bench("latin", latin);
+    bench("cyrillic", cyrillic);
+}
+
+void loop() {
+}
@@ -0,0 +1,283 @@
+// Arduino API для сборки TeleBot на Linux (TELEBOT_HOST)
+// Только то, что использует библиотека, поведение - как у ядра ESP32
+#ifndef TELEBOT_HOST_ARDUINO_H
+#define TELEBOT_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+
+#define HEX 16
+#define DEC 10
+#define OCT 8
+#define BIN 2
+
+#define PROGMEM
+#define IRAM_ATTR
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+using std::min;
+using std::max;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// FreeRTOS: задача - поток std::thread, ядро не учитывается
+typedef void* TaskHandle_t;
+typedef void (*TaskFunction_t)(void*);
+#define pdPASS 1
+#define portTICK_PERIOD_MS 1
+int xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack,
+                            void* arg, unsigned priority, TaskHandle_t* handle, int core);
+void vTaskDelay(uint32_t ticks);
+void vTaskDelete(TaskHandle_t task);
+
+// Критическая секция FreeRTOS: спинлок, прерывания не трогаем
+struct portMUX_TYPE {
+  std::atomic_flag lock = ATOMIC_FLAG_INIT;
+};
+#define portMUX_INITIALIZER_UNLOCKED {}
+inline void portENTER_CRITICAL(portMUX_TYPE *mux) {
+  while (mux->lock.test_and_set(std::memory_order_acquire)) {
+  }
+}
+inline void portEXIT_CRITICAL(portMUX_TYPE *mux) {
+  mux->lock.clear(std::memory_order_release);
+}
+
+class String {
+  public:
+    String(const char* str = "") : _s(str ? str : "") {}
+    String(const std::string &str) : _s(str) {}
+    String(const String &other) = default;
+    String(String &&other) = default;
+    explicit String(char c) : _s(1, c) {}
+    explicit String(unsigned char value, unsigned char base = 10);
+    explicit String(int value, unsigned char base = 10);
+    explicit String(unsigned int value, unsigned char base = 10);
+    explicit String(long value, unsigned char base = 10);
+    explicit String(unsigned long value, unsigned char base = 10);
+    explicit String(long long value, unsigned char base = 10);
+    explicit String(unsigned long long value, unsigned char base = 10);
+    explicit String(float value, unsigned int decimals = 2);
+    explicit String(double value, unsigned int decimals = 2);
+    
+    String &operator=(const String &other) = default;
+    String &operator=(String &&other) = default;
+    String &operator=(const char* str) { _s = str ? str : ""; return *this; }
+    
+    unsigned int length() const { return _s.size(); }
+    bool isEmpty() const { return _s.empty(); }
+    const char* c_str() const { return _s.c_str(); }
+    char* begin() { return &_s[0]; }
+    char* end() { return &_s[0] + _s.size(); }
+    bool reserve(unsigned int size) { _s.reserve(size); return true; }
+    
+    bool concat(const String &str) { _s += str._s; return true; }
+    bool concat(const char* str) { if (str) _s += str; return true; }
+    bool concat(const char* str, unsigned int len) { _s.append(str, len); return true; }
+    bool concat(char c) { _s += c; return true; }
+    bool concat(unsigned char value) { return concat(String(value)); }
+    bool concat(int value) { return concat(String(value)); }
+    bool concat(unsigned int value) { return concat(String(value)); }
+    bool concat(long value) { return concat(String(value)); }
+    bool concat(unsigned long value) { return concat(String(value)); }
+    bool concat(long long value) { return concat(String(value)); }
+    bool concat(unsigned long long value) { return concat(String(value)); }
+    bool concat(float value) { return concat(String(value)); }
+    bool concat(double value) { return concat(String(value)); }
+    
+    template <class T>
+    String &operator+=(const T &value) { concat(value); return *this; }
+    
+    char operator[](unsigned int i) const { return i < _s.size() ? _s[i] : 0; }
+    char &operator[](unsigned int i) { return _s[i]; }
+    char charAt(unsigned int i) const { return (*this)[i]; }
+    
+    bool operator==(const String &other) const { return _s == other._s; }
+    bool operator==(const char* str) const { return _s == (str ? str : ""); }
+    bool operator!=(const String &other) const { return _s != other._s; }
+    bool operator!=(const char* str) const { return !(*this == str); }
+    bool operator<(const String &other) const { return _s < other._s; }
+    bool equals(const String &other) const { return _s == other._s; }
+    bool equalsIgnoreCase(const String &other) const;
+    
+    bool startsWith(const String &prefix) const;
+    bool startsWith(const String &prefix, unsigned int offset) const;
+    bool endsWith(const String &suffix) const;
+    int indexOf(char c, unsigned int from = 0) const;
+    int indexOf(const String &str, unsigned int from = 0) const;
+    int lastIndexOf(char c) const;
+    int lastIndexOf(const String &str) const;
+    String substring(unsigned int from) const;
+    String substring(unsigned int from, unsigned int to) const;
+    
+    void replace(char from, char to);
+    void replace(const String &from, const String &to);
+    void remove(unsigned int index);
+    void remove(unsigned int index, unsigned int count);
+    void toLowerCase();
+    void toUpperCase();
+    void trim();
+    
+    long toInt() const { return atol(_s.c_str()); }
+    float toFloat() const { return atof(_s.c_str()); }
+    double toDouble() const { return atof(_s.c_str()); }
+    
+    explicit operator bool() const { return true; }
+    
+  private:
+    std::string _s;
+};
+
+String operator+(const String &a, const String &b);
+String operator+(const String &a, const char* b);
+String operator+(const char* a, const String &b);
+String operator+(const String &a, char b);
+String operator+(const String &a, int b);
+String operator+(const String &a, unsigned int b);
+String operator+(const String &a, long b);
+String operator+(const String &a, unsigned long b);
+String operator+(const String &a, float b);
+String operator+(const String &a, double b);
+
+class IPAddress {
+  public:
+    IPAddress() : _addr(0) {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+    IPAddress(uint32_t addr) : _addr(addr) {}
+    
+    operator uint32_t() const { return _addr; }
+    uint8_t operator[](int i) const { return (_addr >> (i * 8)) & 0xFF; }
+    bool operator==(const IPAddress &other) const { return _addr == other._addr; }
+    bool operator!=(const IPAddress &other) const { return _addr != other._addr; }
+    
+    String toString() const;
+    bool fromString(const char* str);
+    
+  private:
+    uint32_t _addr;   // Порядок байт сети, как у lwIP
+};
+
+class Print {
+  public:
+    virtual ~Print() {}
+    
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t len);
+    size_t write(const char* str) { return str ? write((const uint8_t*)str, strlen(str)) : 0; }
+    size_t write(const char* buf, size_t len) { return write((const uint8_t*)buf, len); }
+    virtual void flush() {}
+    
+    size_t print(const String &str) { return write(str.c_str(), str.length()); }
+    size_t print(const char* str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char value, int base = DEC) { return print(String(value, base)); }
+    size_t print(int value, int base = DEC) { return print(String(value, base)); }
+    size_t print(unsigned int value, int base = DEC) { return print(String(value, base)); }
+    size_t print(long value, int base = DEC) { return print(String(value, base)); }
+    size_t print(unsigned long value, int base = DEC) { return print(String(value, base)); }
+    size_t print(long long value, int base = DEC) { return print(String(value, base)); }
+    size_t print(unsigned long long value, int base = DEC) { return print(String(value, base)); }
+    size_t print(double value, int digits = 2) { return print(String(value, digits)); }
+    size_t print(const IPAddress &ip) { return print(ip.toString()); }
+    
+    size_t println() { return write("\r\n"); }
+    template <class T>
+    size_t println(const T &value) { size_t n = print(value); return n + println(); }
+    template <class T>
+    size_t println(const T &value, int base) { size_t n = print(value, base); return n + println(); }
+    
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    
+    void setTimeout(unsigned long timeout) { _timeout = timeout; }
+    unsigned long getTimeout() { return _timeout; }
+    
+    bool find(const char* target);
+    bool find(const char* target, size_t len);
+    size_t readBytes(char* buf, size_t len);
+    size_t readBytes(uint8_t* buf, size_t len) { return readBytes((char*)buf, len); }
+    size_t readBytesUntil(char terminator, char* buf, size_t len);
+    String readString();
+    String readStringUntil(char terminator);
+    long parseInt();
+    
+  protected:
+    int timedRead();
+    int timedPeek();
+    
+    unsigned long _timeout = 1000;
+};
+
+class Client : public Stream {
+  public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char* host, uint16_t port) = 0;
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buf, size_t len) = 0;
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int read(uint8_t* buf, size_t len) = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+    
+    using Print::write;
+};
+
+// Serial пишет в stdout
+class HardwareSerial : public Stream {
+  public:
+    void begin(unsigned long) {}
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buf, size_t len);
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    void flush();
+    
+    using Print::write;
+};
+
+extern HardwareSerial Serial;
+
+// Куча: на Linux считается по mallinfo от условных 320 КБ ESP32
+class EspClass {
+  public:
+    uint32_t getFreeHeap();
+    uint32_t getMinFreeHeap();
+    uint32_t getMaxAllocHeap();
+    uint32_t getHeapSize();
+    
+  private:
+    uint32_t _minFree = UINT32_MAX;
+};
+
+extern EspClass ESP;
+
+#endif
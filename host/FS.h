@@ -0,0 +1,76 @@
+// Файловая система для сборки TeleBot на Linux (TELEBOT_HOST)
+// Пути карты отображаются в каталог на диске
+#ifndef TELEBOT_HOST_FS_H
+#define TELEBOT_HOST_FS_H
+
+#include <Arduino.h>
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs {
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+struct FileImplTB;
+
+class File : public Stream {
+  public:
+    File() {}
+    File(std::shared_ptr<FileImplTB> impl) : _impl(impl) {}
+    
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buf, size_t len);
+    int available();
+    int read();
+    size_t read(uint8_t* buf, size_t len);
+    size_t readBytes(char* buf, size_t len) { return read((uint8_t*)buf, len); }
+    int peek();
+    void flush();
+    bool seek(uint32_t pos, SeekMode mode = SeekSet);
+    size_t position() const;
+    size_t size() const;
+    void close();
+    operator bool() const;
+    const char* name() const;
+    const char* path() const;
+    bool isDirectory();
+    File openNextFile(const char* mode = FILE_READ);
+    void rewindDirectory();
+    time_t getLastWrite();
+    
+    using Print::write;
+    
+  private:
+    std::shared_ptr<FileImplTB> _impl;
+};
+
+class FS {
+  public:
+    File open(const char* path, const char* mode = FILE_READ, bool create = false);
+    File open(const String &path, const char* mode = FILE_READ, bool create = false) { return open(path.c_str(), mode, create); }
+    bool exists(const char* path);
+    bool exists(const String &path) { return exists(path.c_str()); }
+    bool remove(const char* path);
+    bool remove(const String &path) { return remove(path.c_str()); }
+    bool rename(const char* from, const char* to);
+    bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+    bool mkdir(const char* path);
+    bool mkdir(const String &path) { return mkdir(path.c_str()); }
+    bool rmdir(const char* path);
+    bool rmdir(const String &path) { return rmdir(path.c_str()); }
+    
+  protected:
+    std::string _real(const char* path) const;
+    
+    std::string _root;
+};
+
+}
+
+using fs::File;
+using fs::FS;
+
+#endif
@@ -0,0 +1,7 @@
+// HTTPClient для сборки TeleBot на Linux (TELEBOT_HOST): библиотека его не использует
+#ifndef TELEBOT_HOST_HTTPCLIENT_H
+#define TELEBOT_HOST_HTTPCLIENT_H
+
+#include <WiFiClientSecure.h>
+
+#endif
@@ -0,0 +1,24 @@
+// NVS (Preferences) для сборки TeleBot на Linux (TELEBOT_HOST)
+// Каждый ключ - файл TELEBOT_NVS_ROOT/<namespace>/<key> (по умолчанию ./nvs)
+#ifndef TELEBOT_HOST_PREFERENCES_H
+#define TELEBOT_HOST_PREFERENCES_H
+
+#include <Arduino.h>
+
+class Preferences {
+  public:
+    bool begin(const char* name, bool readOnly = false, const char* partition = NULL);
+    void end();
+    size_t putBytes(const char* key, const void* value, size_t len);
+    size_t getBytes(const char* key, void* buf, size_t maxLen);
+    size_t getBytesLength(const char* key);
+    bool remove(const char* key);
+    
+  private:
+    std::string _path(const char* key) const;
+    
+    std::string _dir;
+    bool _readOnly = false;
+};
+
+#endif
@@ -0,0 +1,23 @@
+// SD карта для сборки TeleBot на Linux (TELEBOT_HOST)
+// Корень карты - каталог TELEBOT_SD_ROOT (по умолчанию ./sd)
+#ifndef TELEBOT_HOST_SD_H
+#define TELEBOT_HOST_SD_H
+
+#include <FS.h>
+#include <SPI.h>
+
+typedef enum { CARD_NONE, CARD_MMC, CARD_SD, CARD_SDHC, CARD_UNKNOWN } sdcard_type_t;
+
+class SDFS : public fs::FS {
+  public:
+    bool begin(uint8_t ssPin = 5, SPIClass &spi = SPI, uint32_t frequency = 4000000, const char* mountpoint = "/sd", uint8_t max_files = 5, bool format_if_empty = false);
+    void end() { _root.clear(); }
+    sdcard_type_t cardType() { return _root.empty() ? CARD_NONE : CARD_SDHC; }
+    uint64_t cardSize() { return 4ULL * 1024 * 1024 * 1024; }
+    size_t numSectors() { return cardSize() / 512; }
+    size_t sectorSize() { return 512; }
+};
+
+extern SDFS SD;
+
+#endif
@@ -0,0 +1,167 @@
+// WiFi для сборки TeleBot на Linux (TELEBOT_HOST)
+// Станция всегда "подключена", клиент - обычный TCP сокет или канал в памяти
+#ifndef TELEBOT_HOST_WIFI_H
+#define TELEBOT_HOST_WIFI_H
+
+#include <Arduino.h>
+#include <memory>
+#include <vector>
+
+typedef enum {
+    ARDUINO_EVENT_WIFI_STA_START,
+    ARDUINO_EVENT_WIFI_STA_CONNECTED,
+    ARDUINO_EVENT_WIFI_STA_DISCONNECTED,
+    ARDUINO_EVENT_WIFI_STA_GOT_IP,
+    ARDUINO_EVENT_WIFI_STA_LOST_IP,
+    ARDUINO_EVENT_MAX
+} arduino_event_id_t;
+typedef arduino_event_id_t WiFiEvent_t;
+
+typedef union {
+    struct { uint8_t ssid[32]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t channel; } wifi_sta_connected;
+    struct { uint8_t ssid[32]; uint8_t ssid_len; uint8_t bssid[6]; uint8_t reason; } wifi_sta_disconnected;
+    struct { struct { uint32_t addr; } ip; } got_ip;
+} WiFiEventInfo_t;
+
+typedef enum { WL_IDLE_STATUS, WL_NO_SSID_AVAIL, WL_SCAN_COMPLETED, WL_CONNECTED, WL_CONNECT_FAILED, WL_CONNECTION_LOST, WL_DISCONNECTED } wl_status_t;
+typedef enum { WIFI_OFF, WIFI_STA, WIFI_AP, WIFI_AP_STA } wifi_mode_t;
+typedef size_t wifi_event_id_t;
+typedef std::function<void(arduino_event_id_t, WiFiEventInfo_t)> WiFiEventFuncCb;
+
+#define WIFI_SCAN_RUNNING (-1)
+#define WIFI_SCAN_FAILED (-2)
+
+// Канал в памяти вместо сокета: rx читает клиент, tx - то, что он отправил.
+// onWrite вызывается после каждой записи, чтобы подставной сервер мог ответить
+struct PipeTB {
+    std::string rx;
+    size_t rxPos = 0;
+    std::string tx;
+    bool open = true;
+    std::function<void(PipeTB&)> onWrite;
+    
+    void push(const char* data, size_t len) { rx.append(data, len); }
+    void push(const String &data) { rx.append(data.c_str(), data.length()); }
+};
+
+struct SockTB;
+
+class WiFiClient : public Client {
+  public:
+    WiFiClient();
+    WiFiClient(int fd);
+    virtual ~WiFiClient();
+    
+    int connect(IPAddress ip, uint16_t port);
+    int connect(IPAddress ip, uint16_t port, int32_t timeout);
+    int connect(const char* host, uint16_t port);
+    int connect(const char* host, uint16_t port, int32_t timeout);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t* buf, size_t len);
+    int available();
+    int read();
+    int read(uint8_t* buf, size_t len);
+    int peek();
+    void flush() {}
+    void stop();
+    uint8_t connected();
+    operator bool() { return connected(); }
+    
+    int setNoDelay(bool) { return 0; }
+    IPAddress remoteIP();
+    
+    // Перевести клиента на канал в памяти (NULL - снова сокет)
+    void usePipe(PipeTB* pipe) { stop(); _pipe = pipe; }
+    PipeTB* pipe() { return _pipe; }
+    
+    using Print::write;
+    
+  protected:
+    int _connectTo(const char* host, uint16_t port, int32_t timeout);
+    
+    std::shared_ptr<SockTB> _sock;
+    PipeTB* _pipe = NULL;
+};
+
+class WiFiServer {
+  public:
+    WiFiServer(uint16_t port = 80, uint8_t max = 4) : _port(port), _max(max) {}
+    ~WiFiServer() { end(); }
+    
+    void begin(uint16_t port = 0);
+    void end();
+    WiFiClient available() { return accept(); }
+    WiFiClient accept();
+    bool hasClient();
+    void setNoDelay(bool) {}
+    operator bool() { return _fd >= 0; }
+    
+  private:
+    uint16_t _port;
+    uint8_t _max;
+    int _fd = -1;
+};
+
+class WiFiClass {
+  public:
+    wifi_event_id_t onEvent(WiFiEventFuncCb cb, arduino_event_id_t event = ARDUINO_EVENT_MAX);
+    void removeEvent(wifi_event_id_t id);
+    
+    wl_status_t status() { return _status; }
+    wl_status_t begin(const char* ssid, const char* pass = NULL, int32_t channel = 0, const uint8_t* bssid = NULL, bool connect = true);
+    bool config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1 = IPAddress(), IPAddress dns2 = IPAddress());
+    bool setHostname(const char*) { return true; }
+    bool mode(wifi_mode_t) { return true; }
+    bool disconnect(bool wifioff = false, bool eraseap = false);
+    bool reconnect();
+    bool setAutoReconnect(bool) { return true; }
+    bool persistent(bool) { return true; }
+    
+    IPAddress localIP() { return _ip; }
+    IPAddress gatewayIP() { return IPAddress(127, 0, 0, 1); }
+    IPAddress subnetMask() { return IPAddress(255, 0, 0, 0); }
+    IPAddress dnsIP(uint8_t = 0) { return IPAddress(127, 0, 0, 1); }
+    int hostByName(const char* host, IPAddress &result);
+    
+    int16_t scanNetworks(bool async = false, bool show_hidden = false);
+    int16_t scanComplete() { return _scan.size(); }
+    void scanDelete() {}
+    String SSID(uint8_t i);
+    String SSID() { return _ssid; }
+    int32_t RSSI(uint8_t i);
+    int32_t RSSI() { return -50; }
+    uint8_t* BSSID(uint8_t i);
+    uint8_t* BSSID() { return _bssid; }
+    int32_t channel(uint8_t i);
+    int32_t channel() { return 1; }
+    
+    // Только для Linux: имитация сети
+    struct NetTB {
+        String ssid;
+        int32_t rssi;
+        uint8_t bssid[6];
+        int32_t channel;
+    };
+    void hostNetworks(const std::vector<NetTB> &nets) { _scan = nets; }
+    void hostDrop();    // Разрыв связи с событием DISCONNECTED
+    
+  private:
+    void _fire(arduino_event_id_t event, const WiFiEventInfo_t &info);
+    
+    struct HandlerTB {
+        wifi_event_id_t id;
+        arduino_event_id_t event;
+        WiFiEventFuncCb cb;
+    };
+    std::vector<HandlerTB> _handlers;
+    wifi_event_id_t _nextId = 1;
+    wl_status_t _status = WL_DISCONNECTED;
+    String _ssid;
+    uint8_t _bssid[6] = {0x02, 0, 0, 0, 0, 1};
+    IPAddress _ip;
+    std::vector<NetTB> _scan;
+};
+
+extern WiFiClass WiFi;
+
+#endif
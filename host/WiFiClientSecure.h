@@ -0,0 +1,25 @@
+// WiFiClientSecure для сборки TeleBot на Linux (TELEBOT_HOST)
+// TLS нет: соединение идет открытым TCP на адрес из TELEBOT_API
+// (по умолчанию 127.0.0.1:8081, где слушает host/fake_api.py)
+#ifndef TELEBOT_HOST_WIFICLIENTSECURE_H
+#define TELEBOT_HOST_WIFICLIENTSECURE_H
+
+#include <WiFi.h>
+
+class WiFiClientSecure : public WiFiClient {
+  public:
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char* host, uint16_t port);
+    int connect(const char* host, uint16_t port, int32_t timeout);
+    int connect(IPAddress ip, uint16_t port, const char* host, const char* CA_cert, const char* cert, const char* private_key);
+    
+    void setInsecure() {}
+    void setCACert(const char*) {}
+    bool verify(const char*, const char*) { return true; }
+    void setHandshakeTimeout(unsigned long) {}
+    
+  private:
+    int _api(int32_t timeout);
+};
+
+#endif
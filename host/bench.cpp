@@ -0,0 +1,371 @@
+// Бенчмарк конвейера обновлений на Linux: опрос, разбор, диспетчеризация, ответ
+// Сервер API подставной и живет в том же процессе (PipeTB), сеть не мешает замерам
+//   ./bench [--json bench.json] [--quick] [--tcp]
+// --tcp добавляет send() по настоящему сокету к TELEBOT_API (host/fake_api.py)
+#ifdef TELEBOT_HOST
+
+#include "TeleBot.h"
+
+#include <chrono>
+#include <vector>
+#include <malloc.h>
+
+// ==================== ПАМЯТЬ ====================
+
+// Все выделения (String, new, ArduinoJson) проходят через malloc
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+}
+
+struct MemTB {
+  unsigned long long allocs;
+  unsigned long long bytes;   // Всего выделено
+  long long cur;              // Занято сейчас
+  long long peak;
+};
+
+static MemTB memTB;
+
+static void takeTB(void* ptr) {
+  if (!ptr) return;
+  size_t size = malloc_usable_size(ptr);
+  memTB.allocs++;
+  memTB.bytes += size;
+  memTB.cur += size;
+  if (memTB.cur > memTB.peak) memTB.peak = memTB.cur;
+}
+
+static void giveTB(void* ptr) {
+  if (ptr) memTB.cur -= malloc_usable_size(ptr);
+}
+
+extern "C" void* malloc(size_t size) {
+  void* ptr = __libc_malloc(size);
+  takeTB(ptr);
+  return ptr;
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  void* ptr = __libc_calloc(count, size);
+  takeTB(ptr);
+  return ptr;
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+  giveTB(ptr);
+  void* out = __libc_realloc(ptr, size);
+  takeTB(out ? out : ptr);
+  return out;
+}
+
+extern "C" void free(void* ptr) {
+  giveTB(ptr);
+  __libc_free(ptr);
+}
+
+// ==================== ПОДСТАВНОЙ СЕРВЕР ====================
+
+static const char* USER_TB = "{\"id\":1001,\"is_bot\":false,\"first_name\":\"Bench\",\"username\":\"bench\"}";
+static const char* CHAT_TB = "{\"id\":1001,\"first_name\":\"Bench\",\"type\":\"private\"}";
+
+// Update в том виде, в каком его присылает Telegram. Дописывается
+// в готовый буфер: сервер не должен выделять память во время замера
+static void updateTB(std::string &out, long id, bool inl) {
+  char msg[512];
+  snprintf(msg, sizeof(msg), "{\"message_id\":%ld,\"from\":%s,\"chat\":%s,"
+           "\"date\":1700000000,\"text\":\"%s\"}", id, USER_TB, CHAT_TB,
+           inl ? "Menu" : (id % 2 ? "/echo hello 42" : "hello there"));
+  char buf[1024];
+  if (!inl) {
+    snprintf(buf, sizeof(buf), "{\"update_id\":%ld,\"message\":%s}", id, msg);
+  } else {
+    snprintf(buf, sizeof(buf), "{\"update_id\":%ld,\"callback_query\":{\"id\":\"%ld\","
+             "\"from\":%s,\"message\":%s,\"chat_instance\":\"-42\",\"data\":\"btn_ok\"}}",
+             id, id, USER_TB, msg);
+  }
+  out += buf;
+}
+
+static String updateTB(long id, bool inl) {
+  std::string out;
+  updateTB(out, id, inl);
+  return String(out.c_str());
+}
+
+// Отвечает на запросы, как только они пришли целиком. Буферы
+// переиспользуются, поэтому выделения и пик кучи в замерах - только
+// библиотеки, а не сервера
+struct StandInTB {
+  PipeTB pipe;
+  int batch = 1;
+  bool inl = false;
+  long nextUpdate = 1;
+  long nextMsg = 1;
+  unsigned long requests = 0;
+  std::string body;
+  
+  StandInTB() {
+    pipe.onWrite = [this](PipeTB &p) { serve(p); };
+    body.reserve(64 * 1024);
+    pipe.rx.reserve(128 * 1024);
+    pipe.tx.reserve(16 * 1024);
+  }
+  
+  void serve(PipeTB &p) {
+    while (true) {
+      size_t end = p.tx.find("\r\n\r\n");
+      if (end == std::string::npos) return;
+      size_t len = 0;
+      size_t cl = p.tx.find("Content-Length: ");
+      if (cl != std::string::npos && cl < end) len = atol(p.tx.c_str() + cl + 16);
+      if (p.tx.size() < end + 4 + len) return;
+      
+      size_t line = p.tx.find("\r\n");
+      size_t get = p.tx.find("/getUpdates");
+      bool updates = get != std::string::npos && get < line;
+      p.tx.erase(0, end + 4 + len);
+      requests++;
+      
+      body.clear();
+      if (updates) {
+        body += "{\"ok\":true,\"result\":[";
+        for (int i = 0; i < batch; i++) {
+          if (i) body += ",";
+          updateTB(body, nextUpdate++, inl);
+        }
+        body += "]}";
+      } else {
+        char buf[512];
+        snprintf(buf, sizeof(buf), "{\"ok\":true,\"result\":{\"message_id\":%ld,"
+                 "\"from\":{\"id\":42,\"is_bot\":true,\"first_name\":\"Bot\",\"username\":\"bench_bot\"},"
+                 "\"chat\":%s,\"date\":1700000000,\"text\":\"hello there\"}}", nextMsg++, CHAT_TB);
+        body += buf;
+      }
+      char head[192];
+      int n = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nServer: nginx/1.18.0\r\n"
+                       "Content-Type: application/json\r\nContent-Length: %u\r\n"
+                       "Connection: keep-alive\r\n\r\n", (unsigned)body.size());
+      p.push(head, n);
+      p.push(body.data(), body.size());
+    }
+  }
+};
+
+// ==================== ЗАМЕРЫ ====================
+
+struct ResultTB {
+  String name;
+  unsigned long iterations;
+  unsigned long ops;          // Обработано сообщений/вызовов
+  double seconds;
+  double p50;                 // мкс на итерацию
+  double p99;
+  double allocsPerOp;
+  double bytesPerOp;
+  long long peak;             // Пик кучи сверх исходной, байт
+};
+
+static std::vector<ResultTB> resultsTB;
+
+static double nowTB() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// fn() выполняет одну итерацию и возвращает число обработанных операций
+template <class F>
+static void runTB(const char* name, unsigned long iterations, F fn) {
+  for (unsigned long i = 0; i < iterations / 10 + 1; i++) fn();
+  
+  std::vector<double> lat;
+  lat.reserve(iterations);
+  unsigned long ops = 0;
+  MemTB before = memTB;
+  memTB.peak = memTB.cur;
+  double start = nowTB();
+  for (unsigned long i = 0; i < iterations; i++) {
+    double t = nowTB();
+    ops += fn();
+    lat.push_back(nowTB() - t);
+  }
+  double total = nowTB() - start;
+  
+  ResultTB r;
+  r.name = name;
+  r.iterations = iterations;
+  r.ops = ops;
+  r.seconds = total / 1e6;
+  r.allocsPerOp = ops ? double(memTB.allocs - before.allocs) / ops : 0;
+  r.bytesPerOp = ops ? double(memTB.bytes - before.bytes) / ops : 0;
+  r.peak = memTB.peak - before.cur;
+  std::sort(lat.begin(), lat.end());
+  r.p50 = lat[lat.size() / 2];
+  r.p99 = lat[std::min(lat.size() - 1, lat.size() * 99 / 100)];
+  resultsTB.push_back(r);
+  
+  printf("%-16s %10.0f op/s  p50 %9.2f us  p99 %9.2f us  %7.1f alloc/op  %9.0f B/op  peak %8lld B\n",
+         name, ops / r.seconds, r.p50, r.p99, r.allocsPerOp, r.bytesPerOp, r.peak);
+  fflush(stdout);
+}
+
+static bool writeTB(const char* path, bool quick) {
+  FILE* f = fopen(path, "w");
+  if (!f) return false;
+  fprintf(f, "{\n  \"bench\": \"telebot\",\n  \"time\": %ld,\n  \"quick\": %s,\n  \"max_msg_size\": %d,\n  \"cases\": [\n",
+          (long)time(NULL), quick ? "true" : "false", MAX_MSG_SIZE);
+  for (size_t i = 0; i < resultsTB.size(); i++) {
+    const ResultTB &r = resultsTB[i];
+    fprintf(f, "    {\"name\": \"%s\", \"iterations\": %lu, \"ops\": %lu, \"ops_per_s\": %.1f, "
+               "\"p50_us\": %.3f, \"p99_us\": %.3f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, \"peak_bytes\": %lld}%s\n",
+            r.name.c_str(), r.iterations, r.ops, r.ops / r.seconds, r.p50, r.p99,
+            r.allocsPerOp, r.bytesPerOp, r.peak, i + 1 < resultsTB.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+  return true;
+}
+
+// ==================== СЦЕНАРИИ ====================
+
+static TeleBot* botTB = NULL;
+static unsigned long handledTB = 0;
+
+struct BenchTB {
+  static bool poll(TeleBot &bot) { return bot._getUpdates(); }
+  static void process(TeleBot &bot, JsonObject update) { bot._process(update); }
+  static String encode(TeleBot &bot, const String &str) { return bot._encode(str); }
+};
+
+static void noopTB(MsgTB &msg) {
+  handledTB++;
+}
+
+static void viewTB(MsgViewTB &msg) {
+  handledTB++;
+}
+
+static void echoTB(MsgTB &msg) {
+  handledTB++;
+  botTB->send(msg.chat_id, msg.text);
+}
+
+int main(int argc, char** argv) {
+  const char* json = "bench.json";
+  bool quick = false;
+  bool tcp = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--json") && i + 1 < argc) json = argv[++i];
+    else if (!strcmp(argv[i], "--quick")) quick = true;
+    else if (!strcmp(argv[i], "--tcp")) tcp = true;
+  }
+  unsigned long n = quick ? 2000 : 20000;
+  
+  StandInTB server;
+  WiFiClientSecure client;
+  client.usePipe(&server.pipe);
+  TeleBot bot("123456:BENCH", client);
+  botTB = &bot;
+  bot.keepAlive(true);
+  bot.on(noopTB);
+  bot.com("/echo", noopTB);
+  bot.inl(noopTB);
+  
+  // URL кодирование текста с кириллицей и спецсимволами
+  String text = "Привет, мир! Temperature=23.5°C & humidity 40% /status?x=1";
+  runTB("encode", n * 5, [&]() { return BenchTB::encode(bot, text).length() > 0; });
+  
+  String keys[3][2] = {{"Вкл", "Выкл"}, {"Статус", "Датчики"}, {"Настройки", "Помощь"}};
+  runTB("createKey", n, [&]() { return TeleBot::createKey(keys, 3).length() > 0; });
+  String inKeys[3][3] = {{"Вкл", "on", ""}, {"Выкл", "off", ""}, {"Статус", "status", ""}};
+  runTB("createIn", n, [&]() { return TeleBot::createIn(inKeys, 3, true).length() > 0; });
+  
+  // Разбор одного update, как в _dispatch()
+  String msgJson = updateTB(7, false);
+  String inlJson = updateTB(8, true);
+  DynamicJsonDocument doc(MAX_MSG_SIZE);
+  runTB("parse_msg", n, [&]() { return !deserializeJson(doc, msgJson); });
+  
+  DynamicJsonDocument msgDoc(MAX_MSG_SIZE);
+  deserializeJson(msgDoc, msgJson);
+  runTB("dispatch_msg", n, [&]() { BenchTB::process(bot, msgDoc.as<JsonObject>()); return 1; });
+  DynamicJsonDocument inlDoc(MAX_MSG_SIZE);
+  deserializeJson(inlDoc, inlJson);
+  runTB("dispatch_inline", n, [&]() { BenchTB::process(bot, inlDoc.as<JsonObject>()); return 1; });
+  
+  // То же через MsgViewTB: без копий полей
+  bot.on(viewTB);
+  bot.com("/echo", viewTB);
+  bot.inl(viewTB);
+  runTB("dispatch_view", n, [&]() { BenchTB::process(bot, msgDoc.as<JsonObject>()); return 1; });
+  runTB("dispatch_inline_view", n, [&]() { BenchTB::process(bot, inlDoc.as<JsonObject>()); return 1; });
+  bot.on(noopTB);
+  bot.com("/echo", noopTB);
+  bot.inl(noopTB);
+  
+  // getUpdates целиком: запрос, заголовки, потоковый разбор, обработчики
+  server.batch = 1;
+  runTB("poll_1", n, [&]() { BenchTB::poll(bot); return 1; });
+  server.batch = 50;
+  runTB("poll_50", n / 50 + 1, [&]() { BenchTB::poll(bot); return 50; });
+  
+  runTB("send", n, [&]() { return bot.send(1001, "hello there") ? 1 : 0; });
+  
+  // Клавиатура на каждом send(): сборка String против готовой KeyTB
+  runTB("send_keys", n, [&]() { 
+    return bot.send(1001, "hello there", "", TeleBot::createIn(inKeys, 3, true)) ? 1 : 0; 
+  });
+  runTB("send_keys_cached", n, [&]() { 
+    return bot.send(1001, "hello there", bot.cacheIn(inKeys, 3, true)) ? 1 : 0; 
+  });
+  // Кэш по id: без хэша кнопок на каждом вызове
+  runTB("send_keys_id", n, [&]() { 
+    return bot.send(1001, "hello there", bot.cacheIn(1, inKeys, 3, true)) ? 1 : 0; 
+  });
+  
+  // Полный цикл эхо-бота: пачка из 50 и ответ на каждое сообщение
+  bot.on(echoTB);
+  bot.com("/echo", echoTB);
+  runTB("echo_50", n / 50 + 1, [&]() { BenchTB::poll(bot); return 50; });
+  
+  // То же с ареной: тела ответов и документы JSON без кучи
+  bot.arena(16 * 1024);
+  bot.on(noopTB);
+  bot.com("/echo", noopTB);
+  runTB("poll_50_arena", n / 50 + 1, [&]() { BenchTB::poll(bot); return 50; });
+  runTB("send_arena", n, [&]() { return bot.send(1001, "hello there") ? 1 : 0; });
+  bot.on(echoTB);
+  bot.com("/echo", echoTB);
+  runTB("echo_50_arena", n / 50 + 1, [&]() { BenchTB::poll(bot); return 50; });
+  bot.arena(0);
+  
+  if (tcp) {
+    WiFiClientSecure net;
+    TeleBot netBot("123456:BENCH", net);
+    netBot.keepAlive(true);
+    runTB("send_tcp", quick ? 200 : 2000, [&]() { return netBot.send(1001, "hello there") ? 1 : 0; });
+    
+    // Те же send() конвейером: пачка PIPE_DEPTH_TB запросов за один RTT
+    runTB("send_tcp_async", quick ? 25 : 250, [&]() { 
+      for (int i = 0; i < PIPE_DEPTH_TB; i++) {
+        netBot.sendAsync(1001, "hello there");
+      }
+      return netBot.flush() ? PIPE_DEPTH_TB : 0; 
+    });
+    
+    // Без ожидания ответа: ответы дочитываются перед следующим окном
+    runTB("send_tcp_push", quick ? 200 : 2000, [&]() { 
+      return netBot.push(1001, "hello there") ? 1 : 0; 
+    });
+  }
+  
+  if (!writeTB(json, quick)) {
+    fprintf(stderr, "bench: cannot write %s\n", json);
+    return 1;
+  }
+  printf("bench: %lu handled, %lu requests, results in %s\n", handledTB, server.requests, json);
+  return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Сравнение двух результатов host/bench (JSON) между версиями.
+
+    python3 bench_compare.py old.json new.json [--tolerance 10]
+
+Регрессия - падение op/s или рост p99 больше чем на tolerance процентов,
+либо рост выделений памяти на операцию. Код возврата 1, если она есть.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return {c["name"]: c for c in json.load(f)["cases"]}
+
+
+def change(old, new):
+    return (new - old) * 100.0 / old if old else 0.0
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Сравнение результатов бенчмарка")
+    ap.add_argument("old")
+    ap.add_argument("new")
+    ap.add_argument("--tolerance", type=float, default=10.0, help="допуск, %%")
+    args = ap.parse_args()
+
+    old, new = load(args.old), load(args.new)
+    bad = []
+    print("%-16s %12s %9s %12s %9s %10s %10s" % ("case", "op/s", "%", "p99 us", "%", "alloc/op", "peak B"))
+    for name in new:
+        n = new[name]
+        if name not in old:
+            print("%-16s %12.0f %9s %12.2f %9s %10.1f %10d" % (
+                name, n["ops_per_s"], "new", n["p99_us"], "", n["allocs_per_op"], n["peak_bytes"]))
+            continue
+        o = old[name]
+        ops = change(o["ops_per_s"], n["ops_per_s"])
+        p99 = change(o["p99_us"], n["p99_us"])
+        print("%-16s %12.0f %+8.1f%% %12.2f %+8.1f%% %+10.1f %+10d" % (
+            name, n["ops_per_s"], ops, n["p99_us"], p99,
+            n["allocs_per_op"] - o["allocs_per_op"], n["peak_bytes"] - o["peak_bytes"]))
+        if ops < -args.tolerance:
+            bad.append("%s: op/s %+.1f%%" % (name, ops))
+        if p99 > args.tolerance:
+            bad.append("%s: p99 %+.1f%%" % (name, p99))
+        if n["allocs_per_op"] > o["allocs_per_op"] + 0.5:
+            bad.append("%s: alloc/op %.1f -> %.1f" % (name, o["allocs_per_op"], n["allocs_per_op"]))
+    for name in old:
+        if name not in new:
+            print("%-16s %12s" % (name, "gone"))
+
+    if bad:
+        print("\nРегрессии:\n  " + "\n  ".join(bad))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,47 @@
+// Эхо-бот для Linux: тот же скетч, что и на ESP32, только с main()
+// Сервер API - host/fake_api.py (адрес в TELEBOT_API, по умолчанию 127.0.0.1:8081)
+#ifdef TELEBOT_HOST
+
+#include "TeleBot.h"
+
+TeleBot bot("123456:HOST");
+const char* modes = "";   // k - keepAlive, n - nonBlock, q - queue, t - dual, w - webhook :8080, a - arena, d - debug
+
+void setup() {
+    bot.conWiFi("host", "");
+    bot.debug(strchr(modes, 'd'));
+    bot.keepAlive(strchr(modes, 'k'));
+    bot.nonBlock(strchr(modes, 'n'), 1);
+    bot.queue(strchr(modes, 'q'));
+    bot.arena(strchr(modes, 'a') ? 16 * 1024 : 0);
+    bot.server(100);
+    bot.begin();
+    bot.dual(strchr(modes, 't'));
+    if (strchr(modes, 'w')) {
+        bot.hook(8080);
+    }
+    bot.on([](MsgTB &msg) {
+        bot.send(msg.chat_id, msg.text);
+    });
+    bot.com("/start", [](MsgTB &msg) {
+        bot.send(msg.chat_id, "Привет!");
+    });
+}
+
+void loop() {
+    bot.loop();
+}
+
+int main(int argc, char** argv) {
+    // ./echo [время работы, мс] [режимы, например kn]
+    unsigned long limit = argc > 1 ? strtoul(argv[1], NULL, 10) : 0;
+    if (argc > 2) modes = argv[2];
+    setup();
+    while (!limit || millis() < limit) {
+        loop();
+        delay(1);
+    }
+    return 0;
+}
+
+#endif
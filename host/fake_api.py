@@ -0,0 +1,395 @@
+#!/usr/bin/env python3
+"""Подставной api.telegram.org для сборки TeleBot на Linux.
+
+Говорит обычным HTTP/1.1 (keep-alive, Content-Length или chunked), отдает
+обновления пачками и по сценарию портит ответы: 429 с retry_after, задержки,
+дробление ответа на мелкие TCP пакеты, chunked тело, закрытие соединения.
+
+    python3 fake_api.py [scenario.json] [--port 8081] [--log requests.jsonl]
+    python3 fake_api.py --updates 100          # 100 текстовых сообщений по 10
+    python3 fake_api.py --updates 8 --text-len 4000   # длинные сообщения
+    python3 fake_api.py --rtt 80               # ответ через 80 мс, как по сети
+
+Сценарий (JSON):
+    {
+      "updates": [["/start", "привет"], [{"text": "hi", "chat": 5}], [{"data": "btn1"}]],
+      "rules": [
+        {"method": "sendMessage", "every": 3, "status": 429, "retry_after": 1},
+        {"method": "*", "split": 7, "gap_ms": 2},
+        {"method": "getUpdates", "delay_ms": 300, "times": 2},
+        {"method": "*", "chunked": true, "chunk": 64},
+        {"method": "sendPhoto", "close": true}
+      ]
+    }
+
+updates - пачки, каждый getUpdates выдает следующую (неподтвержденные через
+offset обновления выдаются повторно). Элемент пачки - строка (текст в чат 1),
+{"text", "chat"}, {"data", "chat"} (inline кнопка) или готовый Update.
+Правило срабатывает на каждом every-м подходящем вызове, пропустив after
+первых, не более times раз.
+"""
+
+import argparse
+import json
+import queue
+import signal
+import socket
+import socketserver
+import sys
+import threading
+import time
+import urllib.parse
+
+DEFAULT_CHAT = 1
+
+
+class State:
+    def __init__(self, scenario, args):
+        self.lock = threading.Lock()
+        self.batches = []
+        self.pending = []
+        self.next_update = 1000
+        self.next_message = 1
+        self.rules = scenario.get("rules", [])
+        self.hits = [0] * len(self.rules)
+        self.applied = [0] * len(self.rules)
+        self.counts = {}
+        self.log = open(args.log, "a") if args.log else None
+        self.poll_cap = args.poll_cap
+        self.rtt = args.rtt / 1000.0
+        self.until_done = args.until_done
+        self.done = threading.Event()
+        for batch in scenario.get("updates", []):
+            self.batches.append([self.update(item) for item in batch])
+
+    def update(self, item):
+        if isinstance(item, str):
+            item = {"text": item}
+        if "update_id" in item or "message" in item or "callback_query" in item:
+            upd = dict(item)
+        else:
+            chat = item.get("chat", DEFAULT_CHAT)
+            user = {"id": chat, "is_bot": False, "first_name": "Host", "username": "host"}
+            if "data" in item:
+                upd = {"callback_query": {
+                    "id": str(self.next_update), "from": user, "data": item["data"],
+                    "message": {"message_id": self.next_message, "chat": {"id": chat, "type": "private"},
+                                "date": int(time.time()), "text": "keys"}}}
+            else:
+                upd = {"message": {
+                    "message_id": self.next_message, "from": user,
+                    "chat": {"id": chat, "type": "private"},
+                    "date": int(time.time()), "text": item.get("text", "")}}
+            self.next_message += 1
+        if "update_id" not in upd:
+            upd["update_id"] = self.next_update
+        self.next_update = max(self.next_update, upd["update_id"]) + 1
+        return upd
+
+    def rule(self, method):
+        """Действующие для вызова правила, объединенные в одно."""
+        effect = {}
+        with self.lock:
+            for i, r in enumerate(self.rules):
+                if r.get("method", "*") not in ("*", method):
+                    continue
+                self.hits[i] += 1
+                n = self.hits[i] - r.get("after", 0)
+                if n <= 0 or n % r.get("every", 1) != 0:
+                    continue
+                if "times" in r and self.applied[i] >= r["times"]:
+                    continue
+                self.applied[i] += 1
+                effect.update({k: v for k, v in r.items() if k not in ("method", "every", "after", "times")})
+        return effect
+
+    def get_updates(self, params):
+        offset = int(params.get("offset", 0) or 0)
+        limit = int(params.get("limit", 100) or 100)
+        timeout = float(params.get("timeout", 0) or 0)
+        with self.lock:
+            if offset:
+                self.pending = [u for u in self.pending if u["update_id"] >= offset]
+            if not self.pending and self.batches:
+                self.pending = self.batches.pop(0)
+            out = self.pending[:limit]
+            idle = not self.pending and not self.batches
+        if idle and self.until_done:
+            self.done.set()
+        if not out and timeout > 0:
+            time.sleep(min(timeout, self.poll_cap))
+        return out
+
+    def message(self, params, extra=None):
+        with self.lock:
+            mid = self.next_message
+            self.next_message += 1
+        chat = params.get("chat_id", DEFAULT_CHAT)
+        try:
+            chat = int(chat)
+        except (TypeError, ValueError):
+            pass
+        msg = {"message_id": mid, "chat": {"id": chat, "type": "private"}, "date": int(time.time())}
+        if "text" in params:
+            msg["text"] = params["text"]
+        if extra:
+            msg.update(extra)
+        return msg
+
+    def call(self, method, params):
+        with self.lock:
+            self.counts[method] = self.counts.get(method, 0) + 1
+        if method == "getUpdates":
+            return True, self.get_updates(params)
+        if method == "getMe":
+            return True, {"id": 123456, "is_bot": True, "first_name": "Host", "username": "HostBot"}
+        if method in ("sendMessage", "sendLocation"):
+            return True, self.message(params)
+        if method in ("sendPhoto", "sendDocument"):
+            return True, self.message(params, {"caption": params.get("caption", "")})
+        if method in ("editMessageText", "editMessageLiveLocation", "editMessageReplyMarkup",
+                      "stopMessageLiveLocation"):
+            if "message_id" in params:
+                return True, self.message(params, {"message_id": int(params["message_id"])})
+            return True, True
+        if method in ("answerCallbackQuery", "deleteMessage", "sendChatAction", "setWebhook", "deleteWebhook"):
+            return True, True
+        if method == "getWebhookInfo":
+            return True, {"url": "", "pending_update_count": 0}
+        return False, None
+
+    def record(self, entry):
+        if self.log:
+            with self.lock:
+                self.log.write(json.dumps(entry, ensure_ascii=False) + "\n")
+                self.log.flush()
+
+
+def parse_multipart(body, ctype):
+    boundary = ctype.split("boundary=", 1)[1].strip().strip('"').encode()
+    params = {}
+    for part in body.split(b"--" + boundary):
+        if not part or part.startswith(b"--"):
+            continue
+        head, _, data = part.partition(b"\r\n\r\n")
+        data = data[:-2] if data.endswith(b"\r\n") else data
+        disp = {}
+        for line in head.decode("utf-8", "replace").split("\r\n"):
+            if line.lower().startswith("content-disposition:"):
+                for item in line.split(";")[1:]:
+                    k, _, v = item.strip().partition("=")
+                    disp[k] = v.strip('"')
+        name = disp.get("name")
+        if not name:
+            continue
+        if "filename" in disp:
+            params[name] = {"filename": disp["filename"], "size": len(data)}
+        else:
+            params[name] = data.decode("utf-8", "replace")
+    return params
+
+
+def parse_params(query, body, ctype):
+    params = dict(urllib.parse.parse_qsl(query, keep_blank_values=True))
+    ctype = ctype or ""
+    if not body:
+        return params
+    if ctype.startswith("multipart/form-data"):
+        params.update(parse_multipart(body, ctype))
+    elif ctype.startswith("application/json"):
+        params.update(json.loads(body.decode("utf-8")))
+    else:
+        params.update(urllib.parse.parse_qsl(body.decode("utf-8"), keep_blank_values=True))
+    return params
+
+
+class Handler(socketserver.StreamRequestHandler):
+    def handle(self):
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        state = self.server.state
+        with state.lock:
+            state.counts["connections"] = state.counts.get("connections", 0) + 1
+        # --rtt: ответы уходят из отдельного потока с задержкой, а чтение
+        # следующих запросов не ждет - конвейер запросов дает выигрыш
+        self.out = None
+        if self.server.state.rtt > 0:
+            self.out = queue.Queue()
+            threading.Thread(target=self.writer, daemon=True).start()
+        try:
+            self.serve()
+        finally:
+            if self.out is not None:
+                self.out.put(None)
+                self.out.join()
+
+    def writer(self):
+        alive = True
+        while True:
+            item = self.out.get()
+            if item is not None and alive:
+                due, data, effect = item
+                time.sleep(max(0, due - time.time()))
+                alive = self.emit(data, effect)
+            self.out.task_done()
+            if item is None:
+                return
+
+    def emit(self, out, effect):
+        split = int(effect.get("split", 0) or 0)
+        try:
+            if split > 0:
+                gap = effect.get("gap_ms", 0) / 1000.0
+                for i in range(0, len(out), split):
+                    self.wfile.write(out[i:i + split])
+                    self.wfile.flush()
+                    if gap:
+                        time.sleep(gap)
+            else:
+                self.wfile.write(out)
+                self.wfile.flush()
+        except OSError:
+            return False
+        return True
+
+    def serve(self):
+        while True:
+            line = self.rfile.readline(65537)
+            if not line:
+                return
+            line = line.decode("latin-1").strip()
+            if not line:
+                continue
+            try:
+                verb, target, _ = line.split(" ", 2)
+            except ValueError:
+                return
+            headers = {}
+            while True:
+                h = self.rfile.readline(65537).decode("latin-1")
+                if h in ("\r\n", "\n", ""):
+                    break
+                k, _, v = h.partition(":")
+                headers[k.strip().lower()] = v.strip()
+            if headers.get("expect", "").lower() == "100-continue":
+                self.wfile.write(b"HTTP/1.1 100 Continue\r\n\r\n")
+            body = self.read_body(headers)
+            if body is None:
+                return
+            if not self.respond(verb, target, headers, body):
+                return
+
+    def read_body(self, headers):
+        if headers.get("transfer-encoding", "").lower() == "chunked":
+            body = b""
+            while True:
+                size = int(self.rfile.readline().split(b";")[0].strip() or b"0", 16)
+                if size == 0:
+                    self.rfile.readline()
+                    return body
+                body += self.rfile.read(size)
+                self.rfile.readline()
+        n = int(headers.get("content-length", 0) or 0)
+        body = self.rfile.read(n) if n else b""
+        return body if len(body) == n else None
+
+    def respond(self, verb, target, headers, body):
+        st = self.server.state
+        url = urllib.parse.urlsplit(target)
+        parts = url.path.strip("/").split("/")
+        method = parts[1] if len(parts) == 2 and parts[0].startswith("bot") else ""
+        started = time.time()
+        try:
+            params = parse_params(url.query, body, headers.get("content-type"))
+        except (ValueError, UnicodeDecodeError) as e:
+            params = {"_error": str(e)}
+
+        effect = st.rule(method)
+        if "delay_ms" in effect:
+            time.sleep(effect["delay_ms"] / 1000.0)
+
+        if "status" in effect:
+            status = effect["status"]
+            payload = {"ok": False, "error_code": status,
+                       "description": effect.get("description", "Too Many Requests: retry later" if status == 429 else "Error")}
+            if "retry_after" in effect:
+                payload["parameters"] = {"retry_after": effect["retry_after"]}
+        else:
+            ok, result = st.call(method, params) if method else (False, None)
+            if ok:
+                status, payload = 200, {"ok": True, "result": result}
+            else:
+                status, payload = 404, {"ok": False, "error_code": 404, "description": "Not Found"}
+
+        # Компактно, как настоящий API: библиотека ищет "result":[ без пробелов
+        data = json.dumps(payload, ensure_ascii=False, separators=(",", ":")).encode("utf-8")
+        close = effect.get("close", False) or headers.get("connection", "").lower() == "close"
+        head = "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nServer: fake_api\r\n" % (
+            status, "OK" if status == 200 else "Error")
+        if effect.get("chunked"):
+            step = max(1, int(effect.get("chunk", 64)))
+            head += "Transfer-Encoding: chunked\r\n"
+            raw = b"".join(b"%x\r\n%s\r\n" % (len(data[i:i + step]), data[i:i + step])
+                           for i in range(0, len(data), step)) + b"0\r\n\r\n"
+        else:
+            head += "Content-Length: %d\r\n" % len(data)
+            raw = data
+        head += "Connection: %s\r\n\r\n" % ("close" if close else "keep-alive")
+        out = head.encode("latin-1") + raw
+
+        if self.out is not None:
+            self.out.put((started + st.rtt, out, effect))
+        elif not self.emit(out, effect):
+            return False
+
+        # bot - id из токена (без секрета), conn - порт клиента: видно, чей
+        # запрос и по какому соединению он пришел
+        st.record({"t": round(started, 3), "verb": verb, "method": method, "params": params,
+                   "bot": parts[0][3:].split(":")[0], "conn": self.client_address[1],
+                   "status": status, "ms": round((time.time() - started) * 1000, 1)})
+        return not close
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Подставной Telegram Bot API")
+    ap.add_argument("scenario", nargs="?", help="JSON сценарий")
+    ap.add_argument("--host", default="127.0.0.1")
+    ap.add_argument("--port", type=int, default=8081)
+    ap.add_argument("--log", help="журнал запросов (JSON lines)")
+    ap.add_argument("--updates", type=int, default=0, help="сгенерировать N текстовых сообщений")
+    ap.add_argument("--batch", type=int, default=10, help="размер пачки для --updates")
+    ap.add_argument("--text-len", type=int, default=0, help="дополнить текст --updates до N символов")
+    ap.add_argument("--poll-cap", type=float, default=1.0, help="предел ожидания long polling, с")
+    ap.add_argument("--rtt", type=float, default=0, help="задержка каждого ответа, мс")
+    ap.add_argument("--until-done", action="store_true", help="выйти, когда все обновления подтверждены")
+    args = ap.parse_args()
+
+    scenario = {}
+    if args.scenario:
+        with open(args.scenario) as f:
+            scenario = json.load(f)
+    if args.updates:
+        texts = [("msg %d " % i).ljust(args.text_len, "x").rstrip() for i in range(args.updates)]
+        scenario.setdefault("updates", []).extend(
+            texts[i:i + args.batch] for i in range(0, len(texts), args.batch))
+
+    state = State(scenario, args)
+    server = Server((args.host, args.port), Handler)
+    server.state = state
+    signal.signal(signal.SIGTERM, lambda *_: state.done.set())
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("fake_api: http://%s:%d, пачек: %d" % (args.host, args.port, len(state.batches)), flush=True)
+    try:
+        state.done.wait()
+    except KeyboardInterrupt:
+        pass
+    server.shutdown()
+    print("fake_api: " + json.dumps(state.counts, ensure_ascii=False), flush=True)
+
+
+if __name__ == "__main__":
+    main()
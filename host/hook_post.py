@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""Клиент webhook для сборки TeleBot на Linux: шлет записанные апдейты
+POST-запросами на встроенный сервер бота (bot.hook()), как это делает
+Telegram или обратный прокси перед платой.
+
+    python3 hook_post.py updates.jsonl [--url http://127.0.0.1:8080/hook]
+    python3 hook_post.py scenario.json --secret s3cr3t --gap-ms 50
+
+updates.jsonl - по одному Update в строке. Файл .json - сценарий fake_api.py:
+берутся его пачки updates, по одному апдейту на запрос. Код выхода 1, если
+хоть один ответ не 200.
+"""
+
+import argparse
+import http.client
+import json
+import sys
+import time
+import urllib.parse
+
+from fake_api import State
+
+
+def load(path):
+    if path.endswith(".jsonl"):
+        with open(path) as f:
+            return [json.loads(line) for line in f if line.strip()]
+    with open(path) as f:
+        scenario = json.load(f)
+    opts = argparse.Namespace(log=None, poll_cap=0, rtt=0, until_done=False)
+    state = State({"updates": scenario.get("updates", [])}, opts)
+    return [u for batch in state.batches for u in batch]
+
+
+def main():
+    ap = argparse.ArgumentParser(description="POST апдейтов на webhook бота")
+    ap.add_argument("updates", help="updates.jsonl или сценарий .json")
+    ap.add_argument("--url", default="http://127.0.0.1:8080/hook")
+    ap.add_argument("--secret", help="X-Telegram-Bot-Api-Secret-Token")
+    ap.add_argument("--gap-ms", type=float, default=0, help="пауза между запросами")
+    ap.add_argument("--timeout", type=float, default=5)
+    args = ap.parse_args()
+
+    url = urllib.parse.urlsplit(args.url)
+    updates = load(args.updates)
+    headers = {"Content-Type": "application/json"}
+    if args.secret:
+        headers["X-Telegram-Bot-Api-Secret-Token"] = args.secret
+
+    bad = 0
+    times = []
+    for upd in updates:
+        body = json.dumps(upd, ensure_ascii=False, separators=(",", ":")).encode("utf-8")
+        started = time.time()
+        try:
+            conn = http.client.HTTPConnection(url.hostname, url.port or 80, timeout=args.timeout)
+            conn.request("POST", url.path or "/", body, headers)
+            status = conn.getresponse().status
+            conn.close()
+        except OSError as e:
+            status = str(e)
+        ms = (time.time() - started) * 1000
+        times.append(ms)
+        if status != 200:
+            bad += 1
+        print("update %s: %s, %.1f ms" % (upd.get("update_id"), status, ms), flush=True)
+        if args.gap_ms:
+            time.sleep(args.gap_ms / 1000.0)
+
+    times.sort()
+    if times:
+        print("hook_post: %d sent, %d failed, p50 %.1f ms, max %.1f ms" % (
+            len(times), bad, times[len(times) // 2], times[-1]))
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,1037 @@
+// Реализация Arduino API для сборки TeleBot на Linux
+// На ESP32 файл пуст: собирается только с -DTELEBOT_HOST (см. host/Makefile)
+#ifdef TELEBOT_HOST
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+#include <SD.h>
+#include <Preferences.h>
+
+#include <chrono>
+#include <thread>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// ==================== ВРЕМЯ ====================
+
+// Отсчет от первого вызова: глобальные объекты скетча зовут millis()
+// из конструкторов, раньше инициализации статиков этого файла
+static std::chrono::steady_clock::time_point startTB() {
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return start;
+}
+
+unsigned long millis() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTB()).count();
+}
+
+unsigned long micros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTB()).count();
+}
+
+void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+// Поток отсоединен: vTaskDelete(NULL) ничего не делает, задача
+// просто возвращается из своей функции
+int xTaskCreatePinnedToCore(TaskFunction_t fn, const char* name, uint32_t stack,
+                            void* arg, unsigned priority, TaskHandle_t* handle, int core) {
+  std::thread(fn, arg).detach();
+  if (handle) *handle = (TaskHandle_t)fn;
+  return pdPASS;
+}
+
+void vTaskDelay(uint32_t ticks) {
+  delay(ticks * portTICK_PERIOD_MS);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+}
+
+// ==================== STRING ====================
+
+static std::string numTB(unsigned long long value, unsigned char base, bool negative) {
+  if (base < 2 || base > 36) base = 10;
+  char buf[72];
+  char* p = buf + sizeof(buf);
+  *--p = 0;
+  do {
+    uint8_t d = value % base;
+    *--p = d < 10 ? '0' + d : 'a' + d - 10;
+    value /= base;
+  } while (value);
+  if (negative) *--p = '-';
+  return p;
+}
+
+static std::string signedTB(long long value, unsigned char base) {
+  // Как в ядре ESP32: знак только для десятичной записи
+  if (base == 10 && value < 0) return numTB(0ULL - (unsigned long long)value, base, true);
+  return numTB((unsigned long long)value, base, false);
+}
+
+static std::string floatTB(double value, unsigned int decimals) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", (int)decimals, value);
+  return buf;
+}
+
+String::String(unsigned char value, unsigned char base) : _s(numTB(value, base, false)) {}
+String::String(int value, unsigned char base) : _s(base == 10 ? signedTB(value, base) : numTB((unsigned int)value, base, false)) {}
+String::String(unsigned int value, unsigned char base) : _s(numTB(value, base, false)) {}
+String::String(long value, unsigned char base) : _s(base == 10 ? signedTB(value, base) : numTB((unsigned long)value, base, false)) {}
+String::String(unsigned long value, unsigned char base) : _s(numTB(value, base, false)) {}
+String::String(long long value, unsigned char base) : _s(signedTB(value, base)) {}
+String::String(unsigned long long value, unsigned char base) : _s(numTB(value, base, false)) {}
+String::String(float value, unsigned int decimals) : _s(floatTB(value, decimals)) {}
+String::String(double value, unsigned int decimals) : _s(floatTB(value, decimals)) {}
+
+bool String::equalsIgnoreCase(const String &other) const {
+  return _s.size() == other._s.size() && strcasecmp(_s.c_str(), other._s.c_str()) == 0;
+}
+
+bool String::startsWith(const String &prefix) const {
+  return startsWith(prefix, 0);
+}
+
+bool String::startsWith(const String &prefix, unsigned int offset) const {
+  if (offset > _s.size() || prefix._s.size() > _s.size() - offset) return false;
+  return _s.compare(offset, prefix._s.size(), prefix._s) == 0;
+}
+
+bool String::endsWith(const String &suffix) const {
+  if (suffix._s.size() > _s.size()) return false;
+  return _s.compare(_s.size() - suffix._s.size(), suffix._s.size(), suffix._s) == 0;
+}
+
+int String::indexOf(char c, unsigned int from) const {
+  size_t pos = _s.find(c, from);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::indexOf(const String &str, unsigned int from) const {
+  size_t pos = _s.find(str._s, from);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(char c) const {
+  size_t pos = _s.rfind(c);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+int String::lastIndexOf(const String &str) const {
+  size_t pos = _s.rfind(str._s);
+  return pos == std::string::npos ? -1 : (int)pos;
+}
+
+String String::substring(unsigned int from) const {
+  return substring(from, _s.size());
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  if (from > to) std::swap(from, to);
+  if (from >= _s.size()) return String();
+  if (to > _s.size()) to = _s.size();
+  return String(_s.substr(from, to - from));
+}
+
+void String::replace(char from, char to) {
+  std::replace(_s.begin(), _s.end(), from, to);
+}
+
+void String::replace(const String &from, const String &to) {
+  if (from._s.empty()) return;
+  size_t pos = 0;
+  while ((pos = _s.find(from._s, pos)) != std::string::npos) {
+    _s.replace(pos, from._s.size(), to._s);
+    pos += to._s.size();
+  }
+}
+
+void String::remove(unsigned int index) {
+  if (index < _s.size()) _s.erase(index);
+}
+
+void String::remove(unsigned int index, unsigned int count) {
+  if (index < _s.size()) _s.erase(index, count);
+}
+
+void String::toLowerCase() {
+  for (size_t i = 0; i < _s.size(); i++) _s[i] = tolower((unsigned char)_s[i]);
+}
+
+void String::toUpperCase() {
+  for (size_t i = 0; i < _s.size(); i++) _s[i] = toupper((unsigned char)_s[i]);
+}
+
+void String::trim() {
+  size_t a = 0, b = _s.size();
+  while (a < b && isspace((unsigned char)_s[a])) a++;
+  while (b > a && isspace((unsigned char)_s[b - 1])) b--;
+  _s = _s.substr(a, b - a);
+}
+
+String operator+(const String &a, const String &b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, const char* b) { String r(a); r.concat(b); return r; }
+String operator+(const char* a, const String &b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, char b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, int b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, unsigned int b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, long b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, unsigned long b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, float b) { String r(a); r.concat(b); return r; }
+String operator+(const String &a, double b) { String r(a); r.concat(b); return r; }
+
+// ==================== IPADDRESS ====================
+
+IPAddress::IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+  _addr = (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24);
+}
+
+String IPAddress::toString() const {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+  return String(buf);
+}
+
+bool IPAddress::fromString(const char* str) {
+  struct in_addr addr;
+  if (!str || inet_pton(AF_INET, str, &addr) != 1) return false;
+  _addr = addr.s_addr;
+  return true;
+}
+
+// ==================== PRINT / STREAM ====================
+
+size_t Print::write(const uint8_t* buf, size_t len) {
+  size_t n = 0;
+  while (n < len && write(buf[n])) n++;
+  return n;
+}
+
+size_t Print::printf(const char* format, ...) {
+  char small[128];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(small, sizeof(small), format, args);
+  va_end(args);
+  if (len < 0) return 0;
+  if ((size_t)len < sizeof(small)) return write((const uint8_t*)small, len);
+  
+  std::string big(len + 1, 0);
+  va_start(args, format);
+  vsnprintf(&big[0], big.size(), format, args);
+  va_end(args);
+  return write((const uint8_t*)big.data(), len);
+}
+
+int Stream::timedRead() {
+  unsigned long start = millis();
+  do {
+    int c = read();
+    if (c >= 0) return c;
+    yield();
+  } while (millis() - start < _timeout);
+  return -1;
+}
+
+int Stream::timedPeek() {
+  unsigned long start = millis();
+  do {
+    int c = peek();
+    if (c >= 0) return c;
+    yield();
+  } while (millis() - start < _timeout);
+  return -1;
+}
+
+bool Stream::find(const char* target) {
+  return find(target, strlen(target));
+}
+
+bool Stream::find(const char* target, size_t len) {
+  if (len == 0) return true;
+  size_t index = 0;
+  int c;
+  while ((c = timedRead()) >= 0) {
+    if (c == target[index]) {
+      if (++index >= len) return true;
+    } else if (index > 0) {
+      // Откат для совпадений с префиксом цели (важно для "\r\n\r\n")
+      std::string seen(target, index);
+      seen += (char)c;
+      index = 0;
+      for (size_t s = 1; s <= seen.size(); s++) {
+        size_t n = seen.size() - s;
+        if (n < len && seen.compare(s, n, target, n) == 0) {
+          index = n;
+          break;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+size_t Stream::readBytes(char* buf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    int c = timedRead();
+    if (c < 0) break;
+    buf[n++] = (char)c;
+  }
+  return n;
+}
+
+size_t Stream::readBytesUntil(char terminator, char* buf, size_t len) {
+  size_t n = 0;
+  while (n < len) {
+    int c = timedRead();
+    if (c < 0 || c == terminator) break;
+    buf[n++] = (char)c;
+  }
+  return n;
+}
+
+String Stream::readString() {
+  String out;
+  int c;
+  while ((c = timedRead()) >= 0) out += (char)c;
+  return out;
+}
+
+String Stream::readStringUntil(char terminator) {
+  String out;
+  int c;
+  while ((c = timedRead()) >= 0 && c != terminator) out += (char)c;
+  return out;
+}
+
+long Stream::parseInt() {
+  int c;
+  while ((c = timedPeek()) >= 0 && c != '-' && !isdigit(c)) read();
+  bool negative = false;
+  long value = 0;
+  if (c == '-') {
+    negative = true;
+    read();
+  }
+  while ((c = timedPeek()) >= 0 && isdigit(c)) {
+    value = value * 10 + (c - '0');
+    read();
+  }
+  return negative ? -value : value;
+}
+
+// ==================== SERIAL / ESP ====================
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIClass SPI;
+
+size_t HardwareSerial::write(uint8_t c) {
+  return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t* buf, size_t len) {
+  return fwrite(buf, 1, len, stdout);
+}
+
+void HardwareSerial::flush() {
+  fflush(stdout);
+}
+
+#define HOST_HEAP_TB (320UL * 1024)
+
+uint32_t EspClass::getHeapSize() {
+  return HOST_HEAP_TB;
+}
+
+uint32_t EspClass::getFreeHeap() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  size_t used = mallinfo2().uordblks;
+#else
+  size_t used = (unsigned)mallinfo().uordblks;
+#endif
+  uint32_t free = used < HOST_HEAP_TB ? HOST_HEAP_TB - used : 0;
+  if (free < _minFree) _minFree = free;
+  return free;
+}
+
+uint32_t EspClass::getMinFreeHeap() {
+  getFreeHeap();
+  return _minFree;
+}
+
+uint32_t EspClass::getMaxAllocHeap() {
+  return getFreeHeap();
+}
+
+// ==================== WIFI CLIENT ====================
+
+struct SockTB {
+  int fd = -1;
+  std::string buf;    // Прочитано из сокета, но не отдано
+  
+  ~SockTB() { if (fd >= 0) ::close(fd); }
+  
+  // Дочитать все, что уже пришло, без ожидания
+  bool pump() {
+    if (fd < 0) return false;
+    char tmp[2048];
+    while (true) {
+      ssize_t n = recv(fd, tmp, sizeof(tmp), MSG_DONTWAIT);
+      if (n > 0) {
+        buf.append(tmp, n);
+        continue;
+      }
+      if (n == 0) {
+        ::close(fd);
+        fd = -1;
+        return false;
+      }
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+  }
+};
+
+WiFiClient::WiFiClient() {}
+
+WiFiClient::WiFiClient(int fd) : _sock(std::make_shared<SockTB>()) {
+  _sock->fd = fd;
+}
+
+WiFiClient::~WiFiClient() {}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+  return connect(ip, port, 3000);
+}
+
+int WiFiClient::connect(IPAddress ip, uint16_t port, int32_t timeout) {
+  return _connectTo(ip.toString().c_str(), port, timeout);
+}
+
+int WiFiClient::connect(const char* host, uint16_t port) {
+  return connect(host, port, 3000);
+}
+
+int WiFiClient::connect(const char* host, uint16_t port, int32_t timeout) {
+  return _connectTo(host, port, timeout);
+}
+
+int WiFiClient::_connectTo(const char* host, uint16_t port, int32_t timeout) {
+  stop();
+  if (_pipe) {
+    _pipe->open = true;
+    return 1;
+  }
+  
+  struct addrinfo hints, *res = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  char portStr[8];
+  snprintf(portStr, sizeof(portStr), "%u", port);
+  if (getaddrinfo(host, portStr, &hints, &res) != 0 || !res) return 0;
+  
+  int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  if (fd < 0) {
+    freeaddrinfo(res);
+    return 0;
+  }
+  
+  // Подключение с таймаутом через неблокирующий connect
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  int rc = ::connect(fd, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  if (rc < 0 && errno != EINPROGRESS) {
+    ::close(fd);
+    return 0;
+  }
+  if (rc < 0) {
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (poll(&pfd, 1, timeout) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+      ::close(fd);
+      return 0;
+    }
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  
+  _sock = std::make_shared<SockTB>();
+  _sock->fd = fd;
+  return 1;
+}
+
+size_t WiFiClient::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t WiFiClient::write(const uint8_t* buf, size_t len) {
+  if (_pipe) {
+    if (!_pipe->open) return 0;
+    _pipe->tx.append((const char*)buf, len);
+    if (_pipe->onWrite) _pipe->onWrite(*_pipe);
+    return len;
+  }
+  if (!_sock || _sock->fd < 0) return 0;
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = send(_sock->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    sent += n;
+  }
+  return sent;
+}
+
+int WiFiClient::available() {
+  if (_pipe) return _pipe->rx.size() - _pipe->rxPos;
+  if (!_sock) return 0;
+  _sock->pump();
+  return _sock->buf.size();
+}
+
+int WiFiClient::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+int WiFiClient::read(uint8_t* buf, size_t len) {
+  if (_pipe) {
+    size_t n = std::min(len, _pipe->rx.size() - _pipe->rxPos);
+    if (n == 0) return -1;
+    memcpy(buf, _pipe->rx.data() + _pipe->rxPos, n);
+    _pipe->rxPos += n;
+    // Прочитанное целиком больше не нужно
+    if (_pipe->rxPos == _pipe->rx.size()) {
+      _pipe->rx.clear();
+      _pipe->rxPos = 0;
+    }
+    return n;
+  }
+  if (!_sock) return -1;
+  if (_sock->buf.empty()) _sock->pump();
+  size_t n = std::min(len, _sock->buf.size());
+  if (n == 0) return -1;
+  memcpy(buf, _sock->buf.data(), n);
+  _sock->buf.erase(0, n);
+  return n;
+}
+
+int WiFiClient::peek() {
+  if (_pipe) return _pipe->rxPos < _pipe->rx.size() ? (uint8_t)_pipe->rx[_pipe->rxPos] : -1;
+  if (!_sock) return -1;
+  if (_sock->buf.empty()) _sock->pump();
+  return _sock->buf.empty() ? -1 : (uint8_t)_sock->buf[0];
+}
+
+void WiFiClient::stop() {
+  if (_pipe) {
+    _pipe->open = false;
+    return;
+  }
+  _sock.reset();
+}
+
+uint8_t WiFiClient::connected() {
+  if (_pipe) return _pipe->open || available();
+  if (!_sock) return 0;
+  // Как у ESP32: закрытый сокет с непрочитанными данными еще "подключен"
+  return _sock->pump() || !_sock->buf.empty();
+}
+
+IPAddress WiFiClient::remoteIP() {
+  if (!_sock || _sock->fd < 0) return IPAddress();
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(_sock->fd, (struct sockaddr*)&addr, &len) < 0) return IPAddress();
+  return IPAddress(addr.sin_addr.s_addr);
+}
+
+// ==================== WIFI CLIENT SECURE ====================
+
+int WiFiClientSecure::_api(int32_t timeout) {
+  // TLS на Linux не нужен: все запросы идут на подставной сервер
+  const char* api = getenv("TELEBOT_API");
+  std::string addr = api && *api ? api : "127.0.0.1:8081";
+  size_t colon = addr.rfind(':');
+  uint16_t port = 8081;
+  if (colon != std::string::npos) {
+    port = atoi(addr.c_str() + colon + 1);
+    addr.erase(colon);
+  }
+  return _connectTo(addr.c_str(), port, timeout);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port) {
+  return _api(3000);
+}
+
+int WiFiClientSecure::connect(const char* host, uint16_t port) {
+  return _api(3000);
+}
+
+int WiFiClientSecure::connect(const char* host, uint16_t port, int32_t timeout) {
+  return _api(timeout);
+}
+
+int WiFiClientSecure::connect(IPAddress ip, uint16_t port, const char* host, const char* CA_cert, const char* cert, const char* private_key) {
+  return _api(3000);
+}
+
+// ==================== WIFI SERVER ====================
+
+void WiFiServer::begin(uint16_t port) {
+  if (port) _port = port;
+  end();
+  
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return;
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(_port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, _max) < 0) {
+    ::close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  _fd = fd;
+}
+
+void WiFiServer::end() {
+  if (_fd >= 0) ::close(_fd);
+  _fd = -1;
+}
+
+bool WiFiServer::hasClient() {
+  if (_fd < 0) return false;
+  struct pollfd pfd = {_fd, POLLIN, 0};
+  return poll(&pfd, 1, 0) == 1;
+}
+
+WiFiClient WiFiServer::accept() {
+  if (_fd < 0) return WiFiClient();
+  int fd = ::accept(_fd, NULL, NULL);
+  if (fd < 0) return WiFiClient();
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return WiFiClient(fd);
+}
+
+// ==================== WIFI ====================
+
+WiFiClass WiFi;
+
+wifi_event_id_t WiFiClass::onEvent(WiFiEventFuncCb cb, arduino_event_id_t event) {
+  HandlerTB h;
+  h.id = _nextId++;
+  h.event = event;
+  h.cb = cb;
+  _handlers.push_back(h);
+  return h.id;
+}
+
+void WiFiClass::removeEvent(wifi_event_id_t id) {
+  for (size_t i = 0; i < _handlers.size(); i++) {
+    if (_handlers[i].id == id) {
+      _handlers.erase(_handlers.begin() + i);
+      return;
+    }
+  }
+}
+
+void WiFiClass::_fire(arduino_event_id_t event, const WiFiEventInfo_t &info) {
+  std::vector<HandlerTB> handlers = _handlers;
+  for (size_t i = 0; i < handlers.size(); i++) {
+    if (handlers[i].event == ARDUINO_EVENT_MAX || handlers[i].event == event) {
+      handlers[i].cb(event, info);
+    }
+  }
+}
+
+wl_status_t WiFiClass::begin(const char* ssid, const char* pass, int32_t channel, const uint8_t* bssid, bool connect) {
+  _ssid = ssid ? ssid : "";
+  if (bssid) memcpy(_bssid, bssid, 6);
+  if (!connect) return _status;
+  
+  // Список сетей задан: подключиться можно только к видимой точке
+  if (!_scan.empty()) {
+    bool found = false;
+    for (size_t i = 0; i < _scan.size() && !found; i++) {
+      found = _scan[i].ssid == _ssid && (!bssid || memcmp(_scan[i].bssid, bssid, 6) == 0);
+    }
+    if (!found) {
+      _status = WL_NO_SSID_AVAIL;
+      WiFiEventInfo_t info;
+      memset(&info, 0, sizeof(info));
+      info.wifi_sta_disconnected.reason = 201;    // NO_AP_FOUND
+      _fire(ARDUINO_EVENT_WIFI_STA_DISCONNECTED, info);
+      return _status;
+    }
+  }
+  
+  // Сеть хоста уже есть: события идут сразу, как после удачного подключения
+  WiFiEventInfo_t info;
+  memset(&info, 0, sizeof(info));
+  size_t len = std::min<size_t>(_ssid.length(), 32);
+  memcpy(info.wifi_sta_connected.ssid, _ssid.c_str(), len);
+  info.wifi_sta_connected.ssid_len = len;
+  memcpy(info.wifi_sta_connected.bssid, _bssid, 6);
+  info.wifi_sta_connected.channel = channel ? channel : 1;
+  _status = WL_CONNECTED;
+  _fire(ARDUINO_EVENT_WIFI_STA_CONNECTED, info);
+  
+  if ((uint32_t)_ip == 0) _ip = IPAddress(127, 0, 0, 1);
+  memset(&info, 0, sizeof(info));
+  info.got_ip.ip.addr = _ip;
+  _fire(ARDUINO_EVENT_WIFI_STA_GOT_IP, info);
+  return _status;
+}
+
+bool WiFiClass::config(IPAddress local, IPAddress gateway, IPAddress subnet, IPAddress dns1, IPAddress dns2) {
+  _ip = local;
+  return true;
+}
+
+bool WiFiClass::disconnect(bool wifioff, bool eraseap) {
+  if (_status == WL_CONNECTED) hostDrop();
+  _status = WL_DISCONNECTED;
+  return true;
+}
+
+void WiFiClass::hostDrop() {
+  _status = WL_CONNECTION_LOST;
+  WiFiEventInfo_t info;
+  memset(&info, 0, sizeof(info));
+  memcpy(info.wifi_sta_disconnected.bssid, _bssid, 6);
+  info.wifi_sta_disconnected.reason = 8;    // ASSOC_LEAVE
+  _fire(ARDUINO_EVENT_WIFI_STA_DISCONNECTED, info);
+}
+
+bool WiFiClass::reconnect() {
+  begin(_ssid.c_str());
+  return true;
+}
+
+int WiFiClass::hostByName(const char* host, IPAddress &result) {
+  // api.telegram.org - это подставной сервер из TELEBOT_API
+  std::string name = host;
+  const char* api = getenv("TELEBOT_API");
+  if (name == "api.telegram.org") {
+    name = api && *api ? api : "127.0.0.1:8081";
+    name.erase(name.rfind(':') == std::string::npos ? name.size() : name.rfind(':'));
+    host = name.c_str();
+  }
+  
+  struct addrinfo hints, *res = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res) return 0;
+  result = IPAddress(((struct sockaddr_in*)res->ai_addr)->sin_addr.s_addr);
+  freeaddrinfo(res);
+  return 1;
+}
+
+int16_t WiFiClass::scanNetworks(bool async, bool show_hidden) {
+  return _scan.size();
+}
+
+String WiFiClass::SSID(uint8_t i) {
+  return i < _scan.size() ? _scan[i].ssid : String();
+}
+
+int32_t WiFiClass::RSSI(uint8_t i) {
+  return i < _scan.size() ? _scan[i].rssi : 0;
+}
+
+uint8_t* WiFiClass::BSSID(uint8_t i) {
+  return i < _scan.size() ? _scan[i].bssid : NULL;
+}
+
+int32_t WiFiClass::channel(uint8_t i) {
+  return i < _scan.size() ? _scan[i].channel : 0;
+}
+
+// ==================== ФАЙЛЫ ====================
+
+namespace fs {
+
+struct FileImplTB {
+  FILE* file = NULL;
+  DIR* dir = NULL;
+  std::string real;     // Путь на диске
+  std::string path;     // Путь на карте
+  std::string name;
+  
+  ~FileImplTB() { close(); }
+  
+  void close() {
+    if (file) fclose(file);
+    if (dir) closedir(dir);
+    file = NULL;
+    dir = NULL;
+  }
+};
+
+static std::shared_ptr<FileImplTB> openTB(const std::string &real, const std::string &path, const char* mode) {
+  std::shared_ptr<FileImplTB> impl = std::make_shared<FileImplTB>();
+  impl->real = real;
+  impl->path = path;
+  size_t slash = path.rfind('/');
+  impl->name = slash == std::string::npos ? path : path.substr(slash + 1);
+  
+  struct stat st;
+  if (stat(real.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+    impl->dir = opendir(real.c_str());
+    if (!impl->dir) return NULL;
+    return impl;
+  }
+  
+  const char* fmode = "rb";
+  if (mode && mode[0] == 'w') fmode = "w+b";
+  else if (mode && mode[0] == 'a') fmode = "a+b";
+  impl->file = fopen(real.c_str(), fmode);
+  if (!impl->file) return NULL;
+  return impl;
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buf, size_t len) {
+  if (!_impl || !_impl->file) return 0;
+  return fwrite(buf, 1, len, _impl->file);
+}
+
+int File::available() {
+  if (!_impl || !_impl->file) return 0;
+  return size() - position();
+}
+
+int File::read() {
+  uint8_t c;
+  return read(&c, 1) == 1 ? c : -1;
+}
+
+size_t File::read(uint8_t* buf, size_t len) {
+  if (!_impl || !_impl->file) return 0;
+  return fread(buf, 1, len, _impl->file);
+}
+
+int File::peek() {
+  if (!_impl || !_impl->file) return -1;
+  int c = fgetc(_impl->file);
+  if (c != EOF) ungetc(c, _impl->file);
+  return c == EOF ? -1 : c;
+}
+
+void File::flush() {
+  if (_impl && _impl->file) fflush(_impl->file);
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+  if (!_impl || !_impl->file) return false;
+  int whence = mode == SeekCur ? SEEK_CUR : (mode == SeekEnd ? SEEK_END : SEEK_SET);
+  return fseek(_impl->file, pos, whence) == 0;
+}
+
+size_t File::position() const {
+  if (!_impl || !_impl->file) return 0;
+  long pos = ftell(_impl->file);
+  return pos < 0 ? 0 : pos;
+}
+
+size_t File::size() const {
+  if (!_impl || !_impl->file) return 0;
+  fflush(_impl->file);
+  struct stat st;
+  if (fstat(fileno(_impl->file), &st) < 0) return 0;
+  return st.st_size;
+}
+
+void File::close() {
+  if (_impl) _impl->close();
+  _impl.reset();
+}
+
+File::operator bool() const {
+  return _impl && (_impl->file || _impl->dir);
+}
+
+const char* File::name() const {
+  return _impl ? _impl->name.c_str() : "";
+}
+
+const char* File::path() const {
+  return _impl ? _impl->path.c_str() : "";
+}
+
+bool File::isDirectory() {
+  return _impl && _impl->dir;
+}
+
+File File::openNextFile(const char* mode) {
+  if (!_impl || !_impl->dir) return File();
+  struct dirent* entry;
+  while ((entry = readdir(_impl->dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+    std::string sep = _impl->path.empty() || _impl->path[_impl->path.size() - 1] != '/' ? "/" : "";
+    return File(openTB(_impl->real + "/" + entry->d_name, _impl->path + sep + entry->d_name, mode));
+  }
+  return File();
+}
+
+void File::rewindDirectory() {
+  if (_impl && _impl->dir) rewinddir(_impl->dir);
+}
+
+time_t File::getLastWrite() {
+  if (!_impl) return 0;
+  struct stat st;
+  if (stat(_impl->real.c_str(), &st) < 0) return 0;
+  return st.st_mtime;
+}
+
+std::string FS::_real(const char* path) const {
+  std::string p = path ? path : "/";
+  if (p.empty() || p[0] != '/') p = "/" + p;
+  return _root + p;
+}
+
+File FS::open(const char* path, const char* mode, bool create) {
+  if (_root.empty()) return File();
+  std::string p = path ? path : "/";
+  if (p.empty() || p[0] != '/') p = "/" + p;
+  return File(openTB(_real(path), p, mode));
+}
+
+bool FS::exists(const char* path) {
+  struct stat st;
+  return !_root.empty() && stat(_real(path).c_str(), &st) == 0;
+}
+
+bool FS::remove(const char* path) {
+  return !_root.empty() && unlink(_real(path).c_str()) == 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+  return !_root.empty() && ::rename(_real(from).c_str(), _real(to).c_str()) == 0;
+}
+
+bool FS::mkdir(const char* path) {
+  return !_root.empty() && ::mkdir(_real(path).c_str(), 0755) == 0;
+}
+
+bool FS::rmdir(const char* path) {
+  return !_root.empty() && ::rmdir(_real(path).c_str()) == 0;
+}
+
+}
+
+SDFS SD;
+
+bool SDFS::begin(uint8_t ssPin, SPIClass &spi, uint32_t frequency, const char* mountpoint, uint8_t max_files, bool format_if_empty) {
+  const char* root = getenv("TELEBOT_SD_ROOT");
+  _root = root && *root ? root : "./sd";
+  while (_root.size() > 1 && _root[_root.size() - 1] == '/') _root.erase(_root.size() - 1);
+  ::mkdir(_root.c_str(), 0755);
+  struct stat st;
+  if (stat(_root.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+    _root.clear();
+    return false;
+  }
+  return true;
+}
+
+// ==================== NVS ====================
+
+bool Preferences::begin(const char* name, bool readOnly, const char* partition) {
+  const char* root = getenv("TELEBOT_NVS_ROOT");
+  std::string base = root && *root ? root : "./nvs";
+  _dir = base + "/" + name;
+  _readOnly = readOnly;
+  if (!readOnly) {
+    ::mkdir(base.c_str(), 0755);
+    ::mkdir(_dir.c_str(), 0755);
+  }
+  struct stat st;
+  if (stat(_dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+    _dir.clear();
+    return false;
+  }
+  return true;
+}
+
+void Preferences::end() {
+  _dir.clear();
+}
+
+std::string Preferences::_path(const char* key) const {
+  return _dir + "/" + key;
+}
+
+// Как в NVS: значение заменяется целиком или остается старым
+size_t Preferences::putBytes(const char* key, const void* value, size_t len) {
+  if (_dir.empty() || _readOnly) return 0;
+  std::string tmp = _path(key) + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "wb");
+  if (!f) return 0;
+  size_t put = fwrite(value, 1, len, f);
+  if (fclose(f) != 0 || put != len || ::rename(tmp.c_str(), _path(key).c_str()) != 0) {
+    unlink(tmp.c_str());
+    return 0;
+  }
+  return len;
+}
+
+size_t Preferences::getBytes(const char* key, void* buf, size_t maxLen) {
+  size_t len = getBytesLength(key);
+  if (len == 0 || len > maxLen) return 0;
+  FILE* f = fopen(_path(key).c_str(), "rb");
+  if (!f) return 0;
+  size_t got = fread(buf, 1, len, f);
+  fclose(f);
+  return got;
+}
+
+size_t Preferences::getBytesLength(const char* key) {
+  struct stat st;
+  if (_dir.empty() || stat(_path(key).c_str(), &st) < 0) return 0;
+  return st.st_size;
+}
+
+bool Preferences::remove(const char* key) {
+  return !_dir.empty() && !_readOnly && unlink(_path(key).c_str()) == 0;
+}
+
+#endif
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Прогон эхо-бота против fake_api.py:
+#   ./run.sh [режимы echo] [апдейтов] [аргументы fake_api.py...]
+#   ./run.sh kta     # dual() с ареной: loop() отвечает, пока задача опрашивает
+#   ./run.sh kn 100 --batch 100   # пачка больше POLL_BODY_MAX_TB
+# Код 1, если ответов sendMessage меньше, чем апдейтов, или TCP соединений
+# больше CONNS (если задан). RUN_MS - сколько работает бот, мс
+modes=${1:-k}
+count=${2:-100}
+[ $# -gt 2 ] && shift 2 || set --
+log=run_$modes.log
+
+python3 fake_api.py --updates "$count" "$@" > "$log" 2>&1 &
+api=$!
+sleep 0.5
+./echo "${RUN_MS:-5000}" "$modes"
+kill -TERM $api
+wait $api
+
+sent=$(sed -n 's/.*"sendMessage": \([0-9]*\).*/\1/p' "$log")
+conns=$(sed -n 's/.*"connections": \([0-9]*\).*/\1/p' "$log")
+echo "echo $modes${*:+ $*}: апдейтов $count, ответов ${sent:-0}, соединений ${conns:-0}"
+[ "${sent:-0}" -eq "$count" ] && [ -z "$CONNS" -o "${conns:-0}" -le "${CONNS:-0}" ]